@@ -0,0 +1,131 @@
+#include "ClockSync.h"
+#include "NetStats.h"
+
+#include <cstring>
+
+// Exchanges come quickly until the window is full, then settle to one a second
+const double kSyncFastInterval = 0.1;
+const double kSyncInterval = 1.0;
+const double kSyncTimeout = 2.0; // A request unanswered this long is given up on
+
+const double kOffsetGain = 0.5; // Of the error against the best sample
+const double kDriftGain = 0.25;
+const double kMinDriftSpan = 1.0; // Seconds between best samples before drift is measured
+const double kMaxDrift = 0.0005; // Crystal clocks are well inside 500 ppm
+const double kJitterGain = 0.125;
+
+static uint64_t ToMicroseconds( double seconds )
+{
+	return (uint64_t)( seconds * 1000000.0 );
+}
+
+static double ToSeconds( uint64_t microseconds )
+{
+	return microseconds / 1000000.0;
+}
+
+void ClockSync::Initialize()
+{
+	memset( this, 0, sizeof(*this) );
+}
+
+uint64_t ClockSync::Request( double now )
+{
+	// One exchange at a time, since only the newest request is answered
+	bool waiting = m_outstanding && now - ToSeconds( m_outstanding ) < kSyncTimeout;
+	if ( now < m_nextRequest || waiting )
+	{
+		return 0;
+	}
+
+	m_nextRequest = now + ( m_samples < kWindow ? kSyncFastInterval : kSyncInterval );
+	m_outstanding = ToMicroseconds( now );
+	return m_outstanding;
+}
+
+void ClockSync::OnSnapshot( uint32_t tick, uint64_t serverTime )
+{
+	m_anchorTick = tick;
+	m_anchorTime = ToSeconds( serverTime );
+}
+
+void ClockSync::OnReply( uint64_t echo, uint64_t serverReceived, uint64_t serverSent, double now )
+{
+	// Anything but the outstanding request is an answer to one given up on
+	if ( !echo || echo != m_outstanding )
+	{
+		return;
+	}
+	m_outstanding = 0;
+
+	double sent = ToSeconds( echo );
+	double received = ToSeconds( serverReceived );
+	double replied = ToSeconds( serverSent );
+
+	Sample sample;
+	sample.clientTime = now;
+	sample.rtt = ( now - sent ) - ( replied - received );
+	sample.offset = ( ( received - sent ) + ( replied - now ) ) * 0.5;
+	m_window[ m_samples % kWindow ] = sample;
+	m_samples++;
+
+	if ( m_samples == 1 )
+	{
+		m_offset = sample.offset;
+		m_offsetTime = sample.clientTime;
+		m_bestRtt = sample.rtt;
+		return;
+	}
+
+	double predicted = m_offset + m_drift * ( sample.clientTime - m_offsetTime );
+	double deviation = sample.offset > predicted ? sample.offset - predicted : predicted - sample.offset;
+	m_jitter += ( deviation - m_jitter ) * kJitterGain;
+
+	// The best sample may be one already used; it only moves the estimate once
+	const Sample* best = &m_window[ 0 ];
+	uint32_t count = m_samples < kWindow ? m_samples : kWindow;
+	for ( uint32_t i = 1; i < count; i++ )
+	{
+		if ( m_window[ i ].rtt < best->rtt )
+		{
+			best = &m_window[ i ];
+		}
+	}
+	if ( best->clientTime <= m_offsetTime )
+	{
+		return;
+	}
+
+	double span = best->clientTime - m_offsetTime;
+	double error = best->offset - ( m_offset + m_drift * span );
+	m_offset += m_drift * span + error * kOffsetGain;
+	m_offsetTime = best->clientTime;
+	if ( span >= kMinDriftSpan )
+	{
+		m_drift += error / span * kDriftGain;
+		m_drift = m_drift > kMaxDrift ? kMaxDrift : ( m_drift < -kMaxDrift ? -kMaxDrift : m_drift );
+	}
+	m_bestRtt = best->rtt;
+}
+
+double ClockSync::ServerTime( double now ) const
+{
+	return now + m_offset + m_drift * ( now - m_offsetTime );
+}
+
+double ClockSync::ServerTick( double now ) const
+{
+	if ( !Synced() || !m_anchorTime )
+	{
+		return 0.0;
+	}
+	return m_anchorTick + ( ServerTime( now ) - m_anchorTime ) / kServerTickSeconds;
+}
+
+void ClockSync::WriteStats( StatsWriter* writer, double now ) const
+{
+	// Path asymmetry can put the offset out by up to half the round trip it was measured over
+	writer->Printf( "{\"samples\":%u,\"offsetMs\":%.3f,\"driftPpm\":%.1f,\"bestRttMs\":%.3f,\"errorBoundMs\":%.3f,\"jitterMs\":%.3f,\"serverTick\":%.2f}",
+		m_samples, ( m_offset + m_drift * ( now - m_offsetTime ) ) * 1000.0, m_drift * 1000000.0, m_bestRtt * 1000.0,
+		m_bestRtt * 500.0, m_jitter * 1000.0, ServerTick( now ) );
+}
@@ -0,0 +1,64 @@
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include <cstdint>
+
+class StatsWriter;
+
+// Nominal length of a server tick; the server's frame loop holds it on average
+const double kServerTickSeconds = 1.0 / 60.0;
+
+// NTP-style estimate of the server's clock, kept by the client. Now and then an
+// input carries the client's clock, and the snapshot answering it carries the
+// server's clock when that input was read and when the snapshot was sent, so
+// each exchange yields a round trip and a clock offset. Queueing only ever
+// adds delay, so of the last few exchanges only the one with the lowest round
+// trip is trusted; it steers a smoothed offset and the drift between the two
+// clocks. Times are seconds on each side's steady clock, microseconds on the
+// wire.
+class ClockSync
+{
+public:
+	void Initialize();
+
+	// The client clock to send in Input::syncTime, or 0 if no exchange is due
+	uint64_t Request( double now );
+
+	// Every snapshot anchors the server's tick count to its clock
+	void OnSnapshot( uint32_t tick, uint64_t serverTime );
+
+	// A snapshot answering a request
+	void OnReply( uint64_t echo, uint64_t serverReceived, uint64_t serverSent, double now );
+
+	bool Synced() const { return m_samples > 0; }
+	double ServerTime( double now ) const;
+	double ServerTick( double now ) const; // Fractional, 0 until synced
+
+	void WriteStats( StatsWriter* writer, double now ) const;
+
+private:
+	struct Sample
+	{
+		double clientTime;
+		double rtt;
+		double offset; // Server clock minus client clock
+	};
+
+	static const uint32_t kWindow = 8;
+
+	Sample m_window[ kWindow ];
+	uint32_t m_samples;
+	uint64_t m_outstanding;
+	double m_nextRequest;
+
+	double m_offset; // As of m_offsetTime on the client clock
+	double m_offsetTime;
+	double m_drift; // Seconds the offset gains per second
+	double m_jitter; // Smoothed distance of samples from the estimate
+	double m_bestRtt; // Of the sample the estimate last moved to
+
+	uint32_t m_anchorTick;
+	double m_anchorTime; // Server clock when m_anchorTick's snapshot was sent
+};
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef COLLISION_H
+#define COLLISION_H
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include "Entity.h"
+
+const float kCollisionCellSize = 1.0f; // World units, so one cell is kGameScale pixels across
+const uint32_t kCollisionMaxCells = 1024;
+const float kShipRadius = 0.5f;
+const uint32_t kShipHistoryTicks = 32; // Bounds how far a hit can be rewound
+
+inline float AsteroidRadius( float size )
+{
+	return 0.5f * size;
+}
+
+// Shortest displacement along one axis of the toroidal world
+inline float WrapDelta( float d, float extent )
+{
+	if ( d > extent ) { d -= extent * 2; }
+	if ( d < -extent ) { d += extent * 2; }
+	return d;
+}
+
+//-----------
+// Spatial hash
+//-----------
+
+// Uniform grid tiling the toroidal world. Bodies are kept on intrusive doubly
+// linked per-cell lists and only relinked when they cross a cell boundary, so a
+// tick where most bodies stay put costs one cell computation per body. All links
+// are stored as index + 1 so a zeroed grid is empty.
+template< uint32_t N >
+class SpatialHash
+{
+public:
+	void Initialize()
+	{
+		memset( this, 0, sizeof(*this) );
+		m_columns = (uint32_t)( kWidthUnits * 2 / kCollisionCellSize );
+		m_rows = (uint32_t)( kHeightUnits * 2 / kCollisionCellSize );
+		if ( m_columns < 1 ) { m_columns = 1; }
+		if ( m_rows < 1 ) { m_rows = 1; }
+		assert( m_columns * m_rows <= kCollisionMaxCells );
+		m_invCellWidth = m_columns / ( kWidthUnits * 2 );
+		m_invCellHeight = m_rows / ( kHeightUnits * 2 );
+	}
+
+	bool Contains( uint32_t body ) const { return m_cell[ body ] != 0; }
+	uint32_t BodyCount() const { return m_bodyCount; }
+	uint32_t Body( uint32_t k ) const { return m_bodies[ k ]; }
+
+	// Inserts the body, or moves it if its cell changed since the last call
+	void Place( uint32_t body, float x, float y )
+	{
+		uint32_t cell = Cell( Column( x ), Row( y ) ) + 1;
+		if ( m_cell[ body ] == cell )
+		{
+			return;
+		}
+
+		if ( m_cell[ body ] )
+		{
+			Unlink( body );
+		}
+		else
+		{
+			m_bodyIndex[ body ] = m_bodyCount;
+			m_bodies[ m_bodyCount++ ] = body;
+		}
+
+		m_cell[ body ] = cell;
+		m_prev[ body ] = 0;
+		m_next[ body ] = m_cellHead[ cell - 1 ];
+		if ( m_next[ body ] )
+		{
+			m_prev[ m_next[ body ] - 1 ] = body + 1;
+		}
+		m_cellHead[ cell - 1 ] = body + 1;
+	}
+
+	void Remove( uint32_t body )
+	{
+		if ( !m_cell[ body ] )
+		{
+			return;
+		}
+
+		Unlink( body );
+		m_cell[ body ] = 0;
+
+		uint32_t last = m_bodies[ --m_bodyCount ];
+		m_bodies[ m_bodyIndex[ body ] ] = last;
+		m_bodyIndex[ last ] = m_bodyIndex[ body ];
+	}
+
+	// Calls visit( body ) for every body in the cells touched by the circle,
+	// wrapping around the world edges
+	template< class Visitor >
+	void Query( float x, float y, float radius, Visitor& visit ) const
+	{
+		int32_t x0 = (int32_t)floorf( ( x - radius + kWidthUnits ) * m_invCellWidth );
+		int32_t x1 = (int32_t)floorf( ( x + radius + kWidthUnits ) * m_invCellWidth );
+		int32_t y0 = (int32_t)floorf( ( y - radius + kHeightUnits ) * m_invCellHeight );
+		int32_t y1 = (int32_t)floorf( ( y + radius + kHeightUnits ) * m_invCellHeight );
+		if ( x1 - x0 >= (int32_t)m_columns ) { x1 = x0 + m_columns - 1; }
+		if ( y1 - y0 >= (int32_t)m_rows ) { y1 = y0 + m_rows - 1; }
+
+		uint32_t firstColumn = Wrap( x0, m_columns );
+		uint32_t row = Wrap( y0, m_rows );
+		for ( int32_t cy = y0; cy <= y1; cy++ )
+		{
+			uint32_t column = firstColumn;
+			for ( int32_t cx = x0; cx <= x1; cx++ )
+			{
+				for ( uint32_t b = m_cellHead[ Cell( column, row ) ]; b; b = m_next[ b - 1 ] )
+				{
+					visit( b - 1 );
+				}
+				if ( ++column == m_columns ) { column = 0; }
+			}
+			if ( ++row == m_rows ) { row = 0; }
+		}
+	}
+
+private:
+	static uint32_t Wrap( int32_t c, uint32_t count )
+	{
+		int32_t w = c % (int32_t)count;
+		return w < 0 ? w + count : w;
+	}
+
+	uint32_t Column( float x ) const { return Wrap( (int32_t)floorf( ( x + kWidthUnits ) * m_invCellWidth ), m_columns ); }
+	uint32_t Row( float y ) const { return Wrap( (int32_t)floorf( ( y + kHeightUnits ) * m_invCellHeight ), m_rows ); }
+	uint32_t Cell( uint32_t column, uint32_t row ) const { return row * m_columns + column; }
+
+	void Unlink( uint32_t body )
+	{
+		uint32_t prev = m_prev[ body ];
+		uint32_t next = m_next[ body ];
+		if ( prev ) { m_next[ prev - 1 ] = next; }
+		else { m_cellHead[ m_cell[ body ] - 1 ] = next; }
+		if ( next ) { m_prev[ next - 1 ] = prev; }
+	}
+
+	uint32_t m_columns;
+	uint32_t m_rows;
+	float m_invCellWidth;
+	float m_invCellHeight;
+
+	uint32_t m_cellHead[ kCollisionMaxCells ];
+	uint32_t m_cell[ N ];
+	uint32_t m_next[ N ];
+	uint32_t m_prev[ N ];
+	uint32_t m_bodies[ N ];
+	uint32_t m_bodyIndex[ N ];
+	uint32_t m_bodyCount;
+};
+
+//-----------
+// Ship history
+//-----------
+
+// Where every ship was at the end of each of the last kShipHistoryTicks ticks,
+// so a laser can be judged against the world its shooter was looking at. Each
+// tick is one structure-of-arrays frame, so a rewind reads a few contiguous
+// arrays however many ships there are.
+template< uint32_t N >
+struct ShipHistory
+{
+	struct Frame
+	{
+		uint32_t alive[ N / 32 ];
+		ShipId id[ N ];
+		float positionX[ N ];
+		float positionY[ N ];
+		float rotation[ N ];
+	};
+
+	void Record( uint64_t tick, const ShipArray< N >& ships )
+	{
+		Frame& frame = frames[ tick % kShipHistoryTicks ];
+		memcpy( frame.alive, ships.alive, sizeof(frame.alive) );
+		memcpy( frame.id, ships.id, sizeof(frame.id) );
+		memcpy( frame.positionX, ships.positionX, sizeof(frame.positionX) );
+		memcpy( frame.positionY, ships.positionY, sizeof(frame.positionY) );
+		memcpy( frame.rotation, ships.rotation, sizeof(frame.rotation) );
+	}
+
+	// Writes a ship that just spawned into every frame, so rewinding past its
+	// spawn finds it where it appeared rather than where it died
+	void Backfill( uint32_t ship, const ShipArray< N >& ships )
+	{
+		for ( uint32_t t = 0; t < kShipHistoryTicks; t++ )
+		{
+			Frame& frame = frames[ t ];
+			frame.alive[ ship / 32 ] |= 1u << ( ship % 32 );
+			frame.id[ ship ] = ships.id[ ship ];
+			frame.positionX[ ship ] = ships.positionX[ ship ];
+			frame.positionY[ ship ] = ships.positionY[ ship ];
+			frame.rotation[ ship ] = ships.rotation[ ship ];
+		}
+	}
+
+	const Frame& At( uint64_t tick ) const { return frames[ tick % kShipHistoryTicks ]; }
+
+	Frame frames[ kShipHistoryTicks ];
+};
+
+//-----------
+// Collision system
+//-----------
+
+enum CollisionType
+{
+	kCollisionLaserAsteroid,
+	kCollisionLaserShip,
+	kCollisionShipAsteroid,
+};
+
+struct Collision
+{
+	CollisionType type;
+	uint32_t a; // Laser or ship slot
+	uint32_t b; // Asteroid or ship slot
+};
+
+// Earliest time in [0, 1] at which a point moving from (0, 0) by (dx, dy) comes
+// within radius of (cx, cy), or a negative value if it never does
+inline float SweptCircle( float dx, float dy, float cx, float cy, float radius )
+{
+	float c = cx * cx + cy * cy - radius * radius;
+	if ( c <= 0.0f )
+	{
+		return 0.0f;
+	}
+
+	float a = dx * dx + dy * dy;
+	float b = dx * cx + dy * cy;
+	if ( a <= 0.0f || b <= 0.0f )
+	{
+		return -1.0f;
+	}
+
+	float disc = b * b - a * c;
+	if ( disc < 0.0f )
+	{
+		return -1.0f;
+	}
+
+	float t = ( b - sqrtf( disc ) ) / a;
+	return t <= 1.0f ? t : -1.0f;
+}
+
+// Asteroids and ships are inserted into one grid, asteroids at body ids
+// [0, kMaxAsteroids) and ships after them. Lasers only query: each one is swept
+// over the distance it covered this tick and keeps its earliest hit, so fast
+// lasers can't tunnel through small asteroids between ticks.
+//
+// A laser with a non-zero laserRewind is lag compensated: it still hits
+// asteroids where they are now, but hits ships where they were that many ticks
+// before tick, as its shooter saw them. Without a history every laser is judged
+// against the present.
+template< uint32_t kMaxShips, uint32_t kMaxAsteroids, uint32_t kMaxLasers >
+class CollisionSystem
+{
+public:
+	void Initialize()
+	{
+		m_grid.Initialize();
+		m_collisionCount = 0;
+	}
+
+	void Update( const ShipArray< kMaxShips >& ships, const AsteroidArray< kMaxAsteroids >& asteroids,
+		const LaserArray< kMaxLasers >& lasers, float dt, const ShipHistory< kMaxShips >* history = nullptr,
+		const uint8_t* laserRewind = nullptr, uint64_t tick = 0 )
+	{
+		m_collisionCount = 0;
+
+		// Drop bodies that died since the last tick, then relink the ones that moved
+		for ( uint32_t k = 0; k < m_grid.BodyCount(); )
+		{
+			uint32_t body = m_grid.Body( k );
+			bool alive = body < kMaxAsteroids ? asteroids.IsAlive( body ) : ships.IsAlive( body - kMaxAsteroids );
+			if ( alive )
+			{
+				k++;
+			}
+			else
+			{
+				m_grid.Remove( body );
+			}
+		}
+
+		// Queries only need to reach as far as the largest body actually present
+		float maxRadius = kShipRadius;
+		for ( uint32_t k = 0; k < asteroids.count; k++ )
+		{
+			uint32_t i = asteroids.dense[ k ];
+			m_grid.Place( i, asteroids.positionX[ i ], asteroids.positionY[ i ] );
+			maxRadius = fmaxf( maxRadius, AsteroidRadius( asteroids.size[ i ] ) );
+		}
+
+		for ( uint32_t k = 0; k < ships.count; k++ )
+		{
+			uint32_t i = ships.dense[ k ];
+			m_grid.Place( kMaxAsteroids + i, ships.positionX[ i ], ships.positionY[ i ] );
+		}
+
+		// Lasers have already been advanced this tick, so sweep back over the step
+		float step = kLaserSpeed * dt;
+		for ( uint32_t k = 0; k < lasers.count; k++ )
+		{
+			uint32_t i = lasers.dense[ k ];
+			LaserQuery query( ships, asteroids );
+			query.owner = lasers.owner[ i ];
+			query.dx = lasers.velocityX[ i ] * dt;
+			query.dy = lasers.velocityY[ i ] * dt;
+			query.x = lasers.positionX[ i ] - query.dx;
+			query.y = lasers.positionY[ i ] - query.dy;
+			query.hitTime = 2.0f;
+			uint32_t rewind = history && laserRewind ? laserRewind[ i ] : 0;
+			query.rewound = rewind != 0;
+
+			m_grid.Query( query.x + query.dx * 0.5f, query.y + query.dy * 0.5f, step * 0.5f + maxRadius, query );
+			if ( rewind )
+			{
+				QueryRewound( history->At( tick - rewind ), ships, query );
+			}
+
+			if ( query.hitTime <= 1.0f )
+			{
+				Collision& collision = m_collisions[ m_collisionCount++ ];
+				collision.type = query.hitBody < kMaxAsteroids ? kCollisionLaserAsteroid : kCollisionLaserShip;
+				collision.a = i;
+				collision.b = query.hitBody < kMaxAsteroids ? query.hitBody : query.hitBody - kMaxAsteroids;
+			}
+		}
+
+		for ( uint32_t k = 0; k < ships.count; k++ )
+		{
+			uint32_t i = ships.dense[ k ];
+			ShipQuery query( asteroids );
+			query.x = ships.positionX[ i ];
+			query.y = ships.positionY[ i ];
+			query.hitBody = kInvalidEntity;
+
+			m_grid.Query( query.x, query.y, kShipRadius + maxRadius, query );
+
+			if ( query.hitBody != kInvalidEntity )
+			{
+				Collision& collision = m_collisions[ m_collisionCount++ ];
+				collision.type = kCollisionShipAsteroid;
+				collision.a = i;
+				collision.b = query.hitBody;
+			}
+		}
+	}
+
+	uint32_t CollisionCount() const { return m_collisionCount; }
+	const Collision& GetCollision( uint32_t i ) const { return m_collisions[ i ]; }
+
+private:
+	struct LaserQuery;
+
+	// Ships aren't in the grid at their old positions, so test the rewound frame
+	// directly, four ships at a time; only ships within reach of the swept
+	// segment get the exact test
+	void QueryRewound( const typename ShipHistory< kMaxShips >::Frame& frame, const ShipArray< kMaxShips >& ships, LaserQuery& query ) const
+	{
+		float reach = sqrtf( query.dx * query.dx + query.dy * query.dy ) * 0.5f + kShipRadius;
+		float4 midX = splat4( query.x + query.dx * 0.5f );
+		float4 midY = splat4( query.y + query.dy * 0.5f );
+		float4 reach2 = splat4( reach * reach );
+		for ( uint32_t w = 0; w < ships.UsedWords(); w++ )
+		{
+			uint32_t bits = ships.alive[ w ] & frame.alive[ w ];
+			for ( uint32_t l = 0; l < 32 && ( bits >> l ); l += 4 )
+			{
+				uint32_t lanes = ( bits >> l ) & 0xF;
+				if ( !lanes )
+				{
+					continue;
+				}
+
+				uint32_t i = w * 32 + l;
+				float4 cx = WrapAxis( load4( &frame.positionX[ i ] ) - midX, kWidthUnits );
+				float4 cy = WrapAxis( load4( &frame.positionY[ i ] ) - midY, kHeightUnits );
+				uint32_t near = bits4( mask4( lanes ) & ( cx * cx + cy * cy <= reach2 ) );
+				for ( ; near; near &= near - 1 )
+				{
+					uint32_t ship = i + __builtin_ctz( near );
+					if ( frame.id[ ship ] != ships.id[ ship ] || ships.id[ ship ] == query.owner )
+					{
+						continue;
+					}
+
+					float t = SweptCircle( query.dx, query.dy, WrapDelta( frame.positionX[ ship ] - query.x, kWidthUnits ),
+						WrapDelta( frame.positionY[ ship ] - query.y, kHeightUnits ), kShipRadius );
+					if ( t >= 0.0f && t < query.hitTime )
+					{
+						query.hitTime = t;
+						query.hitBody = kMaxAsteroids + ship;
+					}
+				}
+			}
+		}
+	}
+
+	struct LaserQuery
+	{
+		LaserQuery( const ShipArray< kMaxShips >& ships, const AsteroidArray< kMaxAsteroids >& asteroids ) : ships( ships ), asteroids( asteroids ) {}
+
+		void operator () ( uint32_t body )
+		{
+			float cx, cy, radius;
+			if ( body < kMaxAsteroids )
+			{
+				cx = asteroids.positionX[ body ];
+				cy = asteroids.positionY[ body ];
+				radius = AsteroidRadius( asteroids.size[ body ] );
+			}
+			else
+			{
+				uint32_t ship = body - kMaxAsteroids;
+				if ( rewound || ships.id[ ship ] == owner )
+				{
+					return;
+				}
+				cx = ships.positionX[ ship ];
+				cy = ships.positionY[ ship ];
+				radius = kShipRadius;
+			}
+
+			float t = SweptCircle( dx, dy, WrapDelta( cx - x, kWidthUnits ), WrapDelta( cy - y, kHeightUnits ), radius );
+			if ( t >= 0.0f && t < hitTime )
+			{
+				hitTime = t;
+				hitBody = body;
+			}
+		}
+
+		const ShipArray< kMaxShips >& ships;
+		const AsteroidArray< kMaxAsteroids >& asteroids;
+		ShipId owner;
+		bool rewound; // Ships are tested by QueryRewound instead
+		float x, y;
+		float dx, dy;
+		float hitTime;
+		uint32_t hitBody;
+	};
+
+	struct ShipQuery
+	{
+		ShipQuery( const AsteroidArray< kMaxAsteroids >& asteroids ) : asteroids( asteroids ) {}
+
+		void operator () ( uint32_t body )
+		{
+			if ( body >= kMaxAsteroids || hitBody != kInvalidEntity )
+			{
+				return;
+			}
+
+			float cx = WrapDelta( asteroids.positionX[ body ] - x, kWidthUnits );
+			float cy = WrapDelta( asteroids.positionY[ body ] - y, kHeightUnits );
+			float radius = kShipRadius + AsteroidRadius( asteroids.size[ body ] );
+			if ( cx * cx + cy * cy <= radius * radius )
+			{
+				hitBody = body;
+			}
+		}
+
+		const AsteroidArray< kMaxAsteroids >& asteroids;
+		float x, y;
+		uint32_t hitBody;
+	};
+
+	SpatialHash< kMaxShips + kMaxAsteroids > m_grid;
+	Collision m_collisions[ kMaxLasers + kMaxShips ];
+	uint32_t m_collisionCount;
+};
+
+#endif
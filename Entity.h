@@ -0,0 +1,376 @@
+#ifndef ENTITY_H
+#define ENTITY_H
+
+#include <cstdint>
+#include "Math.h"
+#include "Simd.h"
+
+typedef uint32_t ShipId;
+
+const int kGameWidth = 640;
+const int kGameHeight = 480;
+const float kGameScale = 50.0f; // Length of 1 unit in pixels(ish)
+
+const float kWidthUnits = kGameWidth / kGameScale;
+const float kHeightUnits = kGameHeight / kGameScale;
+
+const float kShipAcceleration = 10.0f;
+const float kShipRotateSpeed = 4.0f;
+const float kLaserSpeed = 15.0f;
+const float kLaserLifeTime = 3.0f;
+const float kAsteroidSizeMin = 0.5f;
+const float kAsteroidSizeRange = 3.0f;
+
+//-----------
+// Entity storage
+//-----------
+
+// Entities are stored as structure-of-arrays with a packed alive bitmask, so the
+// update kernels below can integrate 4 entities per instruction and skip whole
+// 32-entity words that have nothing alive in them.
+
+inline float4 WrapAxis( float4 p, float extent )
+{
+	p += and4( p < splat4( -extent ), splat4( extent * 2.0f ) );
+	p -= and4( p > splat4( extent ), splat4( extent * 2.0f ) );
+	return p;
+}
+
+const uint32_t kInvalidEntity = ~0u;
+
+// Slot allocator shared by every entity array. Dead slots are threaded onto an
+// intrusive free list through next[], and live slots are packed into dense[] so
+// per-entity loops only visit what is alive. Slots past highWater have never
+// been handed out, which lets a zeroed pool start out valid and keeps the
+// kernels from walking mask words that were never used.
+template< uint32_t N >
+struct EntityPool
+{
+	static_assert( N % 32 == 0, "Entity capacity must be a multiple of 32" );
+	static const uint32_t kCapacity = N;
+	static const uint32_t kWords = N / 32;
+
+	bool IsAlive( uint32_t i ) const { return ( alive[ i / 32 ] >> ( i % 32 ) ) & 1; }
+	uint32_t UsedWords() const { return ( highWater + 31 ) / 32; }
+
+	// Returns kInvalidEntity if every slot is in use
+	uint32_t Allocate()
+	{
+		uint32_t i;
+		if ( freeHead )
+		{
+			i = freeHead - 1;
+			freeHead = next[ i ];
+		}
+		else if ( highWater < N )
+		{
+			i = highWater++;
+		}
+		else
+		{
+			return kInvalidEntity;
+		}
+
+		alive[ i / 32 ] |= 1u << ( i % 32 );
+		denseIndex[ i ] = count;
+		dense[ count++ ] = i;
+		return i;
+	}
+
+	void Free( uint32_t i )
+	{
+		alive[ i / 32 ] &= ~( 1u << ( i % 32 ) );
+
+		uint32_t last = dense[ --count ];
+		dense[ denseIndex[ i ] ] = last;
+		denseIndex[ last ] = denseIndex[ i ];
+
+		next[ i ] = freeHead;
+		freeHead = i + 1;
+	}
+
+	uint32_t alive[ kWords ];
+	uint32_t count;
+	uint32_t highWater;
+	uint32_t freeHead; // Slot index + 1, 0 when the free list is empty
+	uint32_t next[ N ];
+	uint32_t dense[ N ];
+	uint32_t denseIndex[ N ];
+};
+
+template< uint32_t N >
+struct ShipArray : EntityPool< N >
+{
+	void Clear( uint32_t i );
+	void SetRotation( uint32_t i, float r );
+	void Update( float dt, const float* accel, const float* turn );
+	void UpdateWords( float dt, const float* accel, const float* turn, uint32_t wordBegin, uint32_t wordEnd );
+
+	ShipId id[ N ];
+	float positionX[ N ];
+	float positionY[ N ];
+	float velocityX[ N ];
+	float velocityY[ N ];
+	float rotation[ N ];
+	float rotationVelocity[ N ];
+	float directionX[ N ]; // sin( rotation ), only recomputed when rotation changes
+	float directionY[ N ]; // cos( rotation )
+	bool local[ N ];
+};
+
+template< uint32_t N >
+struct AsteroidArray : EntityPool< N >
+{
+	void Clear( uint32_t i );
+	void Update( float dt );
+	void UpdateWords( float dt, uint32_t wordBegin, uint32_t wordEnd );
+
+	float positionX[ N ];
+	float positionY[ N ];
+	float velocityX[ N ];
+	float velocityY[ N ];
+	float rotation[ N ];
+	float size[ N ];
+};
+
+template< uint32_t N >
+struct LaserArray : EntityPool< N >
+{
+	void Clear( uint32_t i );
+	void Update( float dt );
+
+	// Expired lanes are written to expiredOut[ w ] rather than freed, since
+	// freeing touches the shared free list; ReleaseExpired frees them afterwards
+	// in slot order, so the allocation order matches a single-threaded update.
+	void UpdateWords( float dt, uint32_t wordBegin, uint32_t wordEnd, uint32_t* expiredOut );
+	void ReleaseExpired( const uint32_t* expired );
+
+	float positionX[ N ];
+	float positionY[ N ];
+	float velocityX[ N ]; // Fixed at spawn, lasers never turn
+	float velocityY[ N ];
+	float life[ N ];
+	ShipId owner[ N ];
+};
+
+//-----------
+// Entity kernels
+//-----------
+
+// Each kernel works on a range of alive mask words and only touches slots inside
+// it, so disjoint ranges can be updated from different threads.
+
+template< uint32_t N >
+void ShipArray< N >::Clear( uint32_t i )
+{
+	id[ i ] = 0;
+	positionX[ i ] = 0.0f;
+	positionY[ i ] = 0.0f;
+	velocityX[ i ] = 0.0f;
+	velocityY[ i ] = 0.0f;
+	rotation[ i ] = 0.0f;
+	rotationVelocity[ i ] = 0.0f;
+	directionX[ i ] = 0.0f;
+	directionY[ i ] = 1.0f;
+	local[ i ] = false;
+}
+
+template< uint32_t N >
+void ShipArray< N >::SetRotation( uint32_t i, float r )
+{
+	rotation[ i ] = r;
+	directionX[ i ] = sinf( r );
+	directionY[ i ] = cosf( r );
+}
+
+template< uint32_t N >
+void ShipArray< N >::Update( float dt, const float* accel, const float* turn )
+{
+	UpdateWords( dt, accel, turn, 0, this->UsedWords() );
+}
+
+template< uint32_t N >
+void ShipArray< N >::UpdateWords( float dt, const float* accel, const float* turn, uint32_t wordBegin, uint32_t wordEnd )
+{
+	const float4 vdt = splat4( dt );
+	for ( uint32_t w = wordBegin; w < wordEnd; w++ )
+	{
+		uint32_t bits = this->alive[ w ];
+		for ( uint32_t l = 0; l < 32 && ( bits >> l ); l += 4 )
+		{
+			uint32_t lanes = ( bits >> l ) & 0xF;
+			if ( !lanes )
+			{
+				continue;
+			}
+
+			uint32_t i = w * 32 + l;
+			int4 mask = mask4( lanes );
+
+			float4 rot = load4( &rotation[ i ] );
+			float4 rotVel = load4( &rotationVelocity[ i ] );
+			float4 vx = load4( &velocityX[ i ] );
+			float4 vy = load4( &velocityY[ i ] );
+			float4 px = load4( &positionX[ i ] );
+			float4 py = load4( &positionY[ i ] );
+
+			float4 dirX = load4( &directionX[ i ] );
+			float4 dirY = load4( &directionY[ i ] );
+
+			float4 thrust = load4( &accel[ i ] ) * splat4( kShipAcceleration ) * vdt;
+			float4 nvx = ( vx + dirX * thrust ) * splat4( 0.99f );
+			float4 nvy = ( vy + dirY * thrust ) * splat4( 0.99f );
+			int4 moving = ( nvx * nvx + nvy * nvy ) >= splat4( 0.001f * 0.001f );
+			nvx = and4( moving, nvx );
+			nvy = and4( moving, nvy );
+
+			float4 nrotVel = ( rotVel + splat4( kShipRotateSpeed ) * load4( &turn[ i ] ) * vdt ) * splat4( 0.98f );
+			int4 turning = ( nrotVel >= splat4( 0.001f ) ) | ( nrotVel <= splat4( -0.001f ) );
+			nrotVel = and4( turning, nrotVel );
+
+			float4 npx = WrapAxis( px + nvx * vdt, kWidthUnits );
+			float4 npy = WrapAxis( py + nvy * vdt, kHeightUnits );
+			float4 nrot = WrapAxis( rot + nrotVel * vdt, M_PI );
+
+			// Only pay for sin/cos when a ship in this block is actually turning
+			if ( bits4( mask & turning ) )
+			{
+				float4 ndirX, ndirY;
+				SinCos4( nrot, &ndirX, &ndirY );
+				store4( &directionX[ i ], select4( mask & turning, ndirX, dirX ) );
+				store4( &directionY[ i ], select4( mask & turning, ndirY, dirY ) );
+			}
+
+			store4( &velocityX[ i ], select4( mask, nvx, vx ) );
+			store4( &velocityY[ i ], select4( mask, nvy, vy ) );
+			store4( &rotationVelocity[ i ], select4( mask, nrotVel, rotVel ) );
+			store4( &positionX[ i ], select4( mask, npx, px ) );
+			store4( &positionY[ i ], select4( mask, npy, py ) );
+			store4( &rotation[ i ], select4( mask, nrot, rot ) );
+		}
+	}
+}
+
+template< uint32_t N >
+void AsteroidArray< N >::Clear( uint32_t i )
+{
+	positionX[ i ] = 0.0f;
+	positionY[ i ] = 0.0f;
+	velocityX[ i ] = 0.0f;
+	velocityY[ i ] = 0.0f;
+	rotation[ i ] = 0.0f;
+	size[ i ] = 0.0f;
+}
+
+template< uint32_t N >
+void AsteroidArray< N >::Update( float dt )
+{
+	UpdateWords( dt, 0, this->UsedWords() );
+}
+
+template< uint32_t N >
+void AsteroidArray< N >::UpdateWords( float dt, uint32_t wordBegin, uint32_t wordEnd )
+{
+	const float4 vdt = splat4( dt );
+	for ( uint32_t w = wordBegin; w < wordEnd; w++ )
+	{
+		uint32_t bits = this->alive[ w ];
+		for ( uint32_t l = 0; l < 32 && ( bits >> l ); l += 4 )
+		{
+			uint32_t lanes = ( bits >> l ) & 0xF;
+			if ( !lanes )
+			{
+				continue;
+			}
+
+			uint32_t i = w * 32 + l;
+			int4 mask = mask4( lanes );
+
+			float4 rot = load4( &rotation[ i ] );
+			float4 px = load4( &positionX[ i ] );
+			float4 py = load4( &positionY[ i ] );
+
+			float4 npx = WrapAxis( px + load4( &velocityX[ i ] ) * vdt, kWidthUnits );
+			float4 npy = WrapAxis( py + load4( &velocityY[ i ] ) * vdt, kHeightUnits );
+
+			store4( &rotation[ i ], select4( mask, WrapAxis( rot + vdt, M_PI ), rot ) );
+			store4( &positionX[ i ], select4( mask, npx, px ) );
+			store4( &positionY[ i ], select4( mask, npy, py ) );
+		}
+	}
+}
+
+template< uint32_t N >
+void LaserArray< N >::Clear( uint32_t i )
+{
+	positionX[ i ] = 0.0f;
+	positionY[ i ] = 0.0f;
+	velocityX[ i ] = 0.0f;
+	velocityY[ i ] = 0.0f;
+	life[ i ] = 0.0f;
+	owner[ i ] = 0;
+}
+
+template< uint32_t N >
+void LaserArray< N >::Update( float dt )
+{
+	uint32_t expired[ this->kWords ];
+	UpdateWords( dt, 0, this->UsedWords(), expired );
+	ReleaseExpired( expired );
+}
+
+template< uint32_t N >
+void LaserArray< N >::UpdateWords( float dt, uint32_t wordBegin, uint32_t wordEnd, uint32_t* expiredOut )
+{
+	const float4 vdt = splat4( dt );
+	for ( uint32_t w = wordBegin; w < wordEnd; w++ )
+	{
+		uint32_t bits = this->alive[ w ];
+		uint32_t survivors = bits;
+		for ( uint32_t l = 0; l < 32 && ( bits >> l ); l += 4 )
+		{
+			uint32_t lanes = ( bits >> l ) & 0xF;
+			if ( !lanes )
+			{
+				continue;
+			}
+
+			uint32_t i = w * 32 + l;
+			int4 mask = mask4( lanes );
+
+			float4 lf = load4( &life[ i ] ) - vdt;
+			int4 living = lf > splat4( 0.0f );
+			int4 moving = mask & living;
+
+			float4 px = load4( &positionX[ i ] );
+			float4 py = load4( &positionY[ i ] );
+
+			float4 npx = px + load4( &velocityX[ i ] ) * vdt;
+			float4 npy = py + load4( &velocityY[ i ] ) * vdt;
+			int4 inside = ( npx >= splat4( -kWidthUnits ) ) & ( npx <= splat4( kWidthUnits ) ) &
+				( npy >= splat4( -kHeightUnits ) ) & ( npy <= splat4( kHeightUnits ) );
+
+			store4( &life[ i ], select4( mask, lf, load4( &life[ i ] ) ) );
+			store4( &positionX[ i ], select4( moving, npx, px ) );
+			store4( &positionY[ i ], select4( moving, npy, py ) );
+
+			survivors &= ~( ( lanes & ~bits4( living & inside ) ) << l );
+		}
+
+		expiredOut[ w ] = bits & ~survivors;
+	}
+}
+
+template< uint32_t N >
+void LaserArray< N >::ReleaseExpired( const uint32_t* expired )
+{
+	for ( uint32_t w = 0; w < this->UsedWords(); w++ )
+	{
+		for ( uint32_t killed = expired[ w ]; killed; killed &= killed - 1 )
+		{
+			this->Free( w * 32 + __builtin_ctz( killed ) );
+		}
+	}
+}
+
+#endif
@@ -1,379 +1,1170 @@
 #include "Game.h"
 #include <cstring>
 #include "Socket.h"
+#include "Profiler.h"
+#include "Logger.h"
+#include "Replay.h"
+#include "SnapshotCorpus.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cfloat>
+#include <chrono>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <cerrno>
 
-#include "lz4.h"
-
-float kWidthUnits = kGameWidth / kGameScale;
-float kHeightUnits = kGameHeight / kGameScale;
-
 const double kServerSyncInterval = 0.1;
-const float kShipAcceleration = 10.0f;
-const float kShipRotateSpeed = 4.0f;
+const double kPingInterval = 1.0;
+const double kMaxBacklogSeconds = 1.0; // A client that takes longer to read one snapshot is dropped
+const float kRttSmoothing = 0.125; // Weight of each new sample, as TCP uses
+const float kOffsetMeanGain = 0.125f;
+const float kOffsetDeviationGain = 0.25f;
+const float kJitterDeviations = 2.0f;
+
+static double NowSeconds()
+{
+	return std::chrono::duration< double >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
 
+static uint64_t NowMicroseconds()
+{
+	return std::chrono::duration_cast< std::chrono::microseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
 const float kShipFireInterval = 0.3f;
-const float kLaserSpeed = 15.0f;
-const float kLaserLifeTime = 3.0f;
+const uint32_t kRandomSeed = 0x9E3779B9;
+
+// Players in a replayed match count as connected but have nothing to read or write
+const int kReplaySocket = -2;
+
+// Entity updates are split into chunks of whole alive mask words, so each job
+// owns its slots outright and the result doesn't depend on how chunks are
+// scheduled across threads.
+const uint32_t kJobWordsPerChunk = 4;
+
+template< class Capacity >
+struct SimulationJob
+{
+	GameState< Capacity >* gameState;
+	float dt;
+	const float* accel;
+	const float* turn;
+	uint32_t expiredLasers[ LaserArray< Capacity::kMaxLasers >::kWords ];
+};
+
+template< class Capacity >
+void ShipJob( void* data, uint32_t begin, uint32_t end )
+{
+	SimulationJob< Capacity >* job = (SimulationJob< Capacity >*)data;
+	job->gameState->ships.UpdateWords( job->dt, job->accel, job->turn, begin, end );
+}
+
+template< class Capacity >
+void AsteroidJob( void* data, uint32_t begin, uint32_t end )
+{
+	SimulationJob< Capacity >* job = (SimulationJob< Capacity >*)data;
+	job->gameState->asteroids.UpdateWords( job->dt, begin, end );
+}
+
+template< class Capacity >
+void LaserJob( void* data, uint32_t begin, uint32_t end )
+{
+	SimulationJob< Capacity >* job = (SimulationJob< Capacity >*)data;
+	job->gameState->lasers.UpdateWords( job->dt, begin, end, job->expiredLasers );
+}
 
-void Ship::Update( double dt, float accel, float turn )
+static void SubmitJobs( JobSystem* jobs, JobCounter* counter, uint32_t count, JobFunction function, void* data )
 {
-	if ( !alive )
+	if ( jobs )
 	{
-		return;
+		jobs->Submit( counter, count, kJobWordsPerChunk, function, data );
+	}
+	else
+	{
+		function( data, 0, count );
 	}
+}
 
-	vec2 dir( sinf(rotation), cosf(rotation) );
+static void WaitJobs( JobSystem* jobs, JobCounter* counter )
+{
+	if ( jobs )
+	{
+		jobs->Wait( counter );
+	}
+}
 
-	velocity += dir * accel * kShipAcceleration * dt;
-	velocity *= 0.99f;
-	if ( length( velocity ) < 0.001f )
+void InputQueue::Push( const Input& input, uint32_t serverTick )
+{
+	if ( input.tick < newestTick )
+	{
+		return;
+	}
+	if ( input.tick == newestTick )
 	{
-		velocity = vec2( 0.0f, 0.0f );
+		// Already played if nothing is queued
+		if ( count )
+		{
+			inputs[ ( head + count - 1 ) % kInputQueueSize ] = input;
+		}
+		return;
 	}
 
-	rotationVelocity += kShipRotateSpeed * turn * dt;
-	rotationVelocity *= 0.98f;
-	if ( fabs( rotationVelocity ) < 0.001f )
+	float offset = (float)(int32_t)( serverTick - input.tick );
+	if ( !newestTick )
 	{
-		rotationVelocity = 0.0f;
+		offsetMean = offset;
+		offsetDeviation = 0.0f;
+		delay = (int32_t)offset;
 	}
+	else
+	{
+		// Same gains as TCP's RTT estimator
+		float error = offset - offsetMean;
+		offsetMean += error * kOffsetMeanGain;
+		offsetDeviation += ( fabsf( error ) - offsetDeviation ) * kOffsetDeviationGain;
+	}
+	newestTick = input.tick;
 
-	position += velocity * dt;
-	rotation += rotationVelocity * dt;
-	
-	if( position.x < -kWidthUnits ) { position.x += kWidthUnits * 2; }
-	if( position.x > kWidthUnits ) { position.x -= kWidthUnits * 2; }
-	if( position.y < -kHeightUnits ) { position.y += kHeightUnits * 2; }
-	if( position.y > kHeightUnits ) { position.y -= kHeightUnits * 2; }
+	if ( (int32_t)( input.tick - ( serverTick - delay ) ) < 0 )
+	{
+		late++;
+	}
+
+	if ( count == kInputQueueSize )
+	{
+		head = ( head + 1 ) % kInputQueueSize;
+		count--;
+	}
+	inputs[ ( head + count ) % kInputQueueSize ] = input;
+	count++;
 }
 
-void Laser::Update( double dt )
+bool InputQueue::Pop( uint32_t serverTick, Input* input )
 {
-	if ( !alive )
+	if ( !newestTick )
 	{
-		return;
+		return false;
 	}
 
-	life -= dt;
-	if ( life <= 0.0 )
+	int32_t base = (int32_t)floorf( offsetMean );
+	int32_t target = (int32_t)ceilf( offsetMean + kJitterDeviations * offsetDeviation );
+	target = target < base + kMaxInputDelayTicks ? target : base + kMaxInputDelayTicks;
+	delay += target > delay ? 1 : ( target < delay ? -1 : 0 );
+
+	// Inputs that fell behind the play point are skipped; only the newest due one counts
+	uint32_t due = serverTick - delay;
+	bool popped = false;
+	while ( count && (int32_t)( inputs[ head ].tick - due ) <= 0 )
 	{
-		alive = false;
-		return;
+		*input = inputs[ head ];
+		head = ( head + 1 ) % kInputQueueSize;
+		count--;
+		popped = true;
+	}
+	return popped;
+}
+
+int32_t InputQueue::JitterDelay() const
+{
+	int32_t jitterDelay = delay - (int32_t)floorf( offsetMean );
+	return jitterDelay > 0 ? jitterDelay : 0;
+}
+
+// Snapshot priority gained per second while the client's copy is out of date
+const float kShipPriority = 1.0f;
+const float kAsteroidPriority = 0.25f;
+const float kLaserPriority = 0.5f;
+const float kNearPriority = 4.0f; // Extra for a ship beside the player's, fading out by kNearRadius
+const float kNearRadius = 4.0f;
+const float kErrorPriority = 1.0f; // Extra per unit the client's copy is off by
+const float kMaxError = 4.0f;
+const float kNewPriority = 10.0f; // Multiplies the rate for entities the client has never been sent
+const float kMaxPriorityElapsed = 1.0f;
+
+// Fields are scattered across the arrays, so each changed one costs the
+// compressor a literal run of its own, plus the match token and offset that
+// get back to the zeros around it
+const uint32_t kFieldRunBytes = 3;
+
+// Estimated compressed size of slot i's field in the delta
+template< class T >
+static uint32_t FieldBytes( const T* to, const T* from, uint32_t i )
+{
+	return memcmp( &to[ i ], &from[ i ], sizeof(T) ) ? sizeof(T) + kFieldRunBytes : 0;
+}
+
+// Distance along an axis that wraps at +-extent
+static float WrappedDistance( float a, float b, float extent )
+{
+	float d = fabsf( a - b );
+	return d > extent ? 2.0f * extent - d : d;
+}
+
+// Estimated delta bytes for slot i between two copies of an array, whether from
+// holds a different entity or none at all, and how far apart the copies are
+template< uint32_t N >
+static uint32_t DiffShip( const ShipArray< N >& to, const ShipArray< N >& from, uint32_t i, bool* fresh, float* error )
+{
+	*fresh = !from.IsAlive( i ) || from.id[ i ] != to.id[ i ];
+	*error = WrappedDistance( to.positionX[ i ], from.positionX[ i ], kWidthUnits ) + WrappedDistance( to.positionY[ i ], from.positionY[ i ], kHeightUnits ) +
+		fabsf( to.rotation[ i ] - from.rotation[ i ] );
+	return FieldBytes( to.id, from.id, i ) + FieldBytes( to.positionX, from.positionX, i ) + FieldBytes( to.positionY, from.positionY, i ) +
+		FieldBytes( to.velocityX, from.velocityX, i ) + FieldBytes( to.velocityY, from.velocityY, i ) + FieldBytes( to.rotation, from.rotation, i ) +
+		FieldBytes( to.rotationVelocity, from.rotationVelocity, i ) + FieldBytes( to.directionX, from.directionX, i ) +
+		FieldBytes( to.directionY, from.directionY, i ) + FieldBytes( to.local, from.local, i );
+}
+
+// Asteroids keep their size and velocity for life
+template< uint32_t N >
+static uint32_t DiffAsteroid( const AsteroidArray< N >& to, const AsteroidArray< N >& from, uint32_t i, bool* fresh, float* error )
+{
+	*fresh = !from.IsAlive( i ) || from.size[ i ] != to.size[ i ] || from.velocityX[ i ] != to.velocityX[ i ];
+	*error = WrappedDistance( to.positionX[ i ], from.positionX[ i ], kWidthUnits ) + WrappedDistance( to.positionY[ i ], from.positionY[ i ], kHeightUnits );
+	return FieldBytes( to.positionX, from.positionX, i ) + FieldBytes( to.positionY, from.positionY, i ) + FieldBytes( to.velocityX, from.velocityX, i ) +
+		FieldBytes( to.velocityY, from.velocityY, i ) + FieldBytes( to.rotation, from.rotation, i ) + FieldBytes( to.size, from.size, i );
+}
+
+// A laser's life only runs down, so one with more life left is a new laser in a recycled slot
+template< uint32_t N >
+static uint32_t DiffLaser( const LaserArray< N >& to, const LaserArray< N >& from, uint32_t i, bool* fresh, float* error )
+{
+	*fresh = !from.IsAlive( i ) || from.owner[ i ] != to.owner[ i ] || to.life[ i ] > from.life[ i ];
+	*error = fabsf( to.positionX[ i ] - from.positionX[ i ] ) + fabsf( to.positionY[ i ] - from.positionY[ i ] );
+	return FieldBytes( to.positionX, from.positionX, i ) + FieldBytes( to.positionY, from.positionY, i ) + FieldBytes( to.velocityX, from.velocityX, i ) +
+		FieldBytes( to.velocityY, from.velocityY, i ) + FieldBytes( to.life, from.life, i ) + FieldBytes( to.owner, from.owner, i );
+}
+
+template< uint32_t N >
+static void CopyShip( ShipArray< N >* to, const ShipArray< N >& from, uint32_t i )
+{
+	to->id[ i ] = from.id[ i ];
+	to->positionX[ i ] = from.positionX[ i ];
+	to->positionY[ i ] = from.positionY[ i ];
+	to->velocityX[ i ] = from.velocityX[ i ];
+	to->velocityY[ i ] = from.velocityY[ i ];
+	to->rotation[ i ] = from.rotation[ i ];
+	to->rotationVelocity[ i ] = from.rotationVelocity[ i ];
+	to->directionX[ i ] = from.directionX[ i ];
+	to->directionY[ i ] = from.directionY[ i ];
+	to->local[ i ] = from.local[ i ];
+}
+
+template< uint32_t N >
+static void CopyAsteroid( AsteroidArray< N >* to, const AsteroidArray< N >& from, uint32_t i )
+{
+	to->positionX[ i ] = from.positionX[ i ];
+	to->positionY[ i ] = from.positionY[ i ];
+	to->velocityX[ i ] = from.velocityX[ i ];
+	to->velocityY[ i ] = from.velocityY[ i ];
+	to->rotation[ i ] = from.rotation[ i ];
+	to->size[ i ] = from.size[ i ];
+}
+
+template< uint32_t N >
+static void CopyLaser( LaserArray< N >* to, const LaserArray< N >& from, uint32_t i )
+{
+	to->positionX[ i ] = from.positionX[ i ];
+	to->positionY[ i ] = from.positionY[ i ];
+	to->velocityX[ i ] = from.velocityX[ i ];
+	to->velocityY[ i ] = from.velocityY[ i ];
+	to->life[ i ] = from.life[ i ];
+	to->owner[ i ] = from.owner[ i ];
+}
+
+// Rebuilds a pool's bookkeeping to hold exactly the visible slots. Live slots
+// are packed in slot order, so dense[] only changes when the visible set does
+// and costs the delta nothing otherwise.
+template< uint32_t N >
+static void RebuildPool( EntityPool< N >* pool, uint32_t highWater, const uint32_t* visible )
+{
+	memset( pool->alive, 0, sizeof(pool->alive) );
+	pool->count = 0;
+	pool->highWater = highWater;
+	pool->freeHead = 0;
+	for ( uint32_t i = 0; i < highWater; i++ )
+	{
+		if ( ( visible[ i / 32 ] >> ( i % 32 ) ) & 1 )
+		{
+			pool->alive[ i / 32 ] |= 1u << ( i % 32 );
+			pool->denseIndex[ i ] = pool->count;
+			pool->dense[ pool->count++ ] = i;
+		}
+		else
+		{
+			pool->next[ i ] = pool->freeHead;
+			pool->freeHead = i + 1;
+		}
 	}
-	
-	vec2 direction( sinf(rotation), cosf(rotation) ); 
-	position += direction * kLaserSpeed * dt;
-	
-	if( position.x < -kWidthUnits ) { alive = false; }
-	if( position.x > kWidthUnits ) { alive = false; }
-	if( position.y < -kHeightUnits ) { alive = false; }
-	if( position.y > kHeightUnits ) { alive = false; }
 }
 
-void GameServer::Initialize( int listener, GameState* gameState )
+// Most overdue first; ties go to the lower entity so replays build the same snapshots
+static bool MorePressing( const SnapshotCandidate& a, const SnapshotCandidate& b )
+{
+	return a.priority != b.priority ? a.priority > b.priority : a.entity < b.entity;
+}
+
+template< class Capacity >
+void GameServer< Capacity >::Initialize( int listener, State* gameState, JobSystem* jobs )
 {
 	memset( this, 0, sizeof(*this) );
 	memset( gameState, 0, sizeof(*gameState) );
 	m_gameState = gameState;
+	m_jobs = jobs;
 	m_currentShipId = 1;
 	
 	m_listener = listener;
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
 		m_players[ i ].socket = -1;
+		m_players[ i ].ship = kInvalidEntity;
 	}
 
-	m_sendTimer = 0.0;
+	m_rateLimits = kDefaultSnapshotRateLimits;
+	m_snapshotEntityBytes = kDefaultSnapshotEntityBytes;
+	m_random = kRandomSeed;
+	m_maxRewind = kDefaultMaxRewindTicks;
+	m_collision.Initialize();
 
 	AddAsteroid();
 	AddAsteroid();
 	AddAsteroid();
 }
 
-void GameServer::Update( float dt )
+template< class Capacity >
+void GameServer< Capacity >::Update( float dt )
 {
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	ProfileScope tickScope( kProfileServerTick );
+	ProfileTimer timer;
+
+	if ( m_recorder )
 	{
-		if ( m_players[ i ].socket == -1 )
+		if ( m_recorder->KeyframeDue( m_tick ) )
 		{
-			int sock = socket_server_accept( m_listener );
-			if ( sock >= 0 )
-			{
-				printf( "Client connected, adding ship!\n" );
-
-				Player* player = &m_players[ i ];
-				Ship* ship = &m_gameState->ships[ i ];
-				
-				memset( player, 0, sizeof(*player) );
-				memset( ship, 0, sizeof(*ship) );
-
-				player->socket = sock;
-				ship->id = m_currentShipId;
-				ship->alive = true;
-				
-				m_currentShipId++;
-			}
+			SaveKeyframe( (ServerKeyframe< Capacity >*)m_recorder->KeyframeBuffer() );
+			m_recorder->RecordKeyframe( m_tick );
+		}
+		m_recorder->RecordTick( m_tick, dt );
+	}
+
+	while ( m_listener != -1 && PlayerCount() < Capacity::kMaxShips )
+	{
+		int sock = socket_server_accept( m_listener );
+		if ( sock < 0 )
+		{
+			break;
 		}
+		AddPlayer( sock );
 	}
+	timer.Lap( kProfileServerAccept );
 
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
-		while ( m_players[ i ].socket != -1 )
+		Player< Capacity >* player = &m_players[ i ];
+		while ( player->socket != -1 && !m_replaying )
 		{
-			Input* input = &m_players[ i ].input;
-			int recvd = socket_recv_msg( m_players[ i ].socket, input, sizeof(*input) );
+			Input input;
+			int recvd = socket_recv_msg( player->socket, &input, sizeof(input) );
 			if ( recvd == -1 )
 			{
-				printf( "Error receiving, closing socket: %s\n", strerror( errno ) );
-				m_players[ i ].socket = -1;
+				LOG_ERROR( "Error receiving, closing socket: %s", strerror( errno ) );
+				player->socket = -1;
+				if ( m_recorder )
+				{
+					m_recorder->RecordDisconnect( i, false );
+				}
 			}
 			else if ( recvd == 0 )
 			{
 				break;
 			}
+			else
+			{
+				ConnectionStats& stats = player->stats;
+				stats.messagesIn++;
+				stats.bytesIn += sizeof(uint32_t) + recvd;
+				if ( m_recorder )
+				{
+					m_recorder->RecordInput( i, input );
+				}
+				player->inputs.Push( input, (uint32_t)m_tick );
+				if ( input.syncTime )
+				{
+					player->syncTime = input.syncTime;
+					player->syncReceived = NowMicroseconds();
+				}
+
+				if ( stats.pingId && input.pong == stats.pingId )
+				{
+					stats.lastRtt = NowSeconds() - stats.pingSentAt;
+					stats.rtt = stats.rtt ? stats.rtt + ( stats.lastRtt - stats.rtt ) * kRttSmoothing : stats.lastRtt;
+					stats.pingId = 0;
+				}
+			}
 		}
 	}
+	timer.Lap( kProfileServerRecv );
 
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
-		if ( m_players[ i ].socket == -1 && m_gameState->ships[ i ].alive )
+		if ( m_players[ i ].socket == -1 && m_players[ i ].ship != kInvalidEntity )
 		{
-			printf( "Removing ship\n" );
-			
-			Player* player = &m_players[ i ];
-			Ship* ship = &m_gameState->ships[ i ];
+			LOG_INFO( "Removing ship" );
 			
+			Player< Capacity >* player = &m_players[ i ];
+			m_gameState->ships.Clear( player->ship );
+			m_gameState->ships.Free( player->ship );
 			memset( player, 0, sizeof(*player) );
-			memset( ship, 0, sizeof(*ship) );
 
 			player->socket = -1;
+			player->ship = kInvalidEntity;
 		}
 	}
 
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	// One client tick of input per player per tick; with none due the last is held
+	float accel[ Capacity::kMaxShips ] = {};
+	float turn[ Capacity::kMaxShips ] = {};
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
-		Ship* ship = &m_gameState->ships[ i ];
-		ship->Update( dt, m_players[ i ].input.accel, m_players[ i ].input.turn );
+		if ( m_players[ i ].ship != kInvalidEntity )
+		{
+			m_players[ i ].inputs.Pop( (uint32_t)m_tick, &m_players[ i ].input );
+			accel[ m_players[ i ].ship ] = m_players[ i ].input.accel;
+			turn[ m_players[ i ].ship ] = m_players[ i ].input.turn;
+		}
+	}
+
+	SimulationJob< Capacity > job;
+	job.gameState = m_gameState;
+	job.dt = dt;
+	job.accel = accel;
+	job.turn = turn;
+
+	ShipArray< Capacity::kMaxShips >& ships = m_gameState->ships;
+	JobCounter counter( 0 );
+	SubmitJobs( m_jobs, &counter, ships.UsedWords(), &ShipJob< Capacity >, &job );
+	WaitJobs( m_jobs, &counter );
 
-		Player* player = &m_players[ i ];
-		if ( player->input.fire )
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
+	{
+		Player< Capacity >* player = &m_players[ i ];
+		if ( player->ship != kInvalidEntity && player->input.fire )
 		{
 			player->fireTimer -= dt;
 			if ( player->fireTimer < 0.0f )
 			{
 				player->fireTimer += kShipFireInterval;
-				AddLaser( ship->position, ship->rotation );
+				uint32_t ship = player->ship;
+				AddLaser( vec2( ships.positionX[ ship ], ships.positionY[ ship ] ), vec2( ships.directionX[ ship ], ships.directionY[ ship ] ), ships.id[ ship ], RewindTicks( player->input ) );
 			}
 		}
 	}
+	timer.Lap( kProfileServerShips );
 	
-	for ( uint32_t i = 0; i < kGameMaxAsteroids; i++ )
+	// Asteroids and lasers don't interact until collision, so both go out as one batch
+	SubmitJobs( m_jobs, &counter, m_gameState->asteroids.UsedWords(), &AsteroidJob< Capacity >, &job );
+	SubmitJobs( m_jobs, &counter, m_gameState->lasers.UsedWords(), &LaserJob< Capacity >, &job );
+	WaitJobs( m_jobs, &counter );
+	m_gameState->lasers.ReleaseExpired( job.expiredLasers );
+	timer.Lap( kProfileServerAsteroidsAndLasers );
+
+	// Destroyed asteroids are replaced only after every collision is resolved, so
+	// a recycled slot can't be hit by a laser that struck its previous occupant
+	m_collision.Update( ships, m_gameState->asteroids, m_gameState->lasers, dt, &m_shipHistory, m_laserRewind, m_tick );
+	uint32_t destroyedAsteroids = 0;
+	for ( uint32_t c = 0; c < m_collision.CollisionCount(); c++ )
 	{
-		Asteroid* asteroid = &m_gameState->asteroids[ i ];
-		
-		if ( !asteroid->alive )
+		const Collision& collision = m_collision.GetCollision( c );
+		switch ( collision.type )
 		{
-			continue;
+		case kCollisionLaserAsteroid:
+			if ( m_gameState->lasers.IsAlive( collision.a ) && m_gameState->asteroids.IsAlive( collision.b ) )
+			{
+				m_gameState->lasers.Free( collision.a );
+				m_gameState->asteroids.Free( collision.b );
+				destroyedAsteroids++;
+			}
+			break;
+		case kCollisionLaserShip:
+			if ( m_gameState->lasers.IsAlive( collision.a ) )
+			{
+				m_gameState->lasers.Free( collision.a );
+				RespawnShip( collision.b );
+			}
+			break;
+		case kCollisionShipAsteroid:
+			if ( m_gameState->asteroids.IsAlive( collision.b ) )
+			{
+				RespawnShip( collision.a );
+			}
+			break;
 		}
-		
-		asteroid->rotation += dt;
-		asteroid->position += asteroid->velocity * dt;
-		
-		if( asteroid->position.x < -kWidthUnits ) { asteroid->position.x += kWidthUnits * 2; }
-		if( asteroid->position.x > kWidthUnits ) { asteroid->position.x -= kWidthUnits * 2; }
-		if( asteroid->position.y < -kHeightUnits ) { asteroid->position.y += kHeightUnits * 2; }
-		if( asteroid->position.y > kHeightUnits ) { asteroid->position.y -= kHeightUnits * 2; }
 	}
 
-	for ( uint32_t i = 0; i < kGameMaxLasers; i++ )
+	for ( uint32_t i = 0; i < destroyedAsteroids; i++ )
 	{
-		m_gameState->lasers[ i ].Update( dt );
+		AddAsteroid();
 	}
+	m_shipHistory.Record( m_tick, ships );
+	timer.Lap( kProfileServerCollision );
 
-	m_sendTimer += dt;
-	if ( m_sendTimer > kServerSyncInterval )
+	// Each player is sent a snapshot when its own rate says one is due. A frame
+	// the socket only took part of is finished first, and a snapshot due before
+	// it is done is skipped, since the next delta covers it anyway.
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
-		m_sendTimer -= kServerSyncInterval;
-		for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+		bool blocked = m_players[ i ].socket != -1 && !SendBacklog( i );
+		bool due = m_players[ i ].socket != -1 && m_players[ i ].rate.Due( dt );
+		if ( due && blocked )
+		{
+			m_players[ i ].rate.OnBlocked();
+		}
+		else if ( due )
 		{
-			if ( m_players[ i ].socket != -1 )
+			ConnectionStats& stats = m_players[ i ].stats;
+			m_gameState->ships.local[ m_players[ i ].ship ] = true;
+
+			BuildSnapshot( &m_players[ i ] );
+			const uint8_t* outgoing = (const uint8_t*)&m_outgoing;
+			for ( uint32_t b = 0; b < sizeof(State); b++ )
+			{
+				m_diff[ b ] = outgoing[ b ] ^ m_players[ i ].prev[ b ];
+			}
+			timer.Lap( kProfileServerDelta );
+
+			if ( m_corpus )
+			{
+				m_corpus->Append( m_tick, i, m_diff );
+			}
+
+			int32_t compressed = LZ4_compress_default( (const char*)m_diff, (char*)m_message + sizeof(SnapshotHeader), sizeof(State), sizeof(m_message) - sizeof(SnapshotHeader) );
+			timer.Lap( kProfileServerCompress );
+
+			// A ping that never came back is given up on and replaced by the next one
+			double now = NowSeconds();
+			SnapshotHeader header;
+			header.ping = 0;
+			header.tick = (uint32_t)m_tick;
+			header.serverTime = NowMicroseconds();
+			header.syncEcho = m_players[ i ].syncTime;
+			header.syncReceived = m_players[ i ].syncReceived;
+			if ( now - stats.pingSentAt >= kPingInterval )
+			{
+				header.ping = ++m_pingCounter ? m_pingCounter : ++m_pingCounter;
+			}
+			memcpy( m_message, &header, sizeof(header) );
+
+			int32_t result = sizeof(SnapshotHeader) + compressed;
+			Player< Capacity >* player = &m_players[ i ];
+			int bytes = m_replaying ? result : socket_send_msg_backlogged( player->socket, m_message, result, player->backlog, &player->backlogBytes );
+			if ( bytes == result )
 			{
-				m_gameState->ships[ i ].local = true;
+				CommitSnapshot( &m_players[ i ] );
 
-				uint8_t diff[ sizeof(GameState) ];
-				uint8_t* current = (uint8_t*)m_gameState;
-				for ( uint32_t b = 0; b < sizeof(GameState); b++ )
+				stats.messagesOut++;
+				stats.bytesOut += sizeof(uint32_t) + result;
+				stats.snapshotRawBytes += sizeof(State);
+				stats.snapshotCompressedBytes += compressed;
+				m_players[ i ].syncTime = 0;
+				if ( header.ping )
 				{
-					diff[ b ] = current[ b ] ^ m_players[ i ].prev[ b ];
+					stats.pingId = header.ping;
+					stats.pingSentAt = now;
 				}
-				memcpy( m_players[ i ].prev, current, sizeof(GameState) );
 
-				uint8_t compressed[ sizeof(GameState) ];
-				int32_t result = LZ4_compress_default( (const char*)diff, (char*)compressed, sizeof(GameState), sizeof(compressed) );
-				int bytes = socket_send_msg( m_players[ i ].socket, compressed, result );
-				if ( bytes != result )
+				if ( player->backlogBytes )
 				{
-					printf( "Error sending, closing socket: %s\n", strerror( errno ) );
-					m_players[ i ].socket = -1;
+					player->backlogSince = now;
 				}
 
-				m_gameState->ships[ i ].local = false;
+				// Bytes held back are queued too, just on our side of the socket
+				int queued = m_replaying ? -1 : socket_send_queue_bytes( player->socket );
+				queued += queued >= 0 ? player->backlogBytes : 0;
+				m_players[ i ].rate.OnSent( sizeof(uint32_t) + result, queued, stats.lastRtt );
+			}
+			else if ( bytes == 0 )
+			{
+				m_players[ i ].rate.OnBlocked();
+			}
+			else if ( bytes < 0 )
+			{
+				LOG_ERROR( "Error sending, closing socket: %s", strerror( errno ) );
+				m_players[ i ].socket = -1;
+				if ( m_recorder )
+				{
+					m_recorder->RecordDisconnect( i, true );
+				}
 			}
+			timer.Lap( kProfileServerSend );
+
+			m_gameState->ships.local[ m_players[ i ].ship ] = false;
 		}
 	}
+
+	m_tick++;
 }
 
-void GameServer::AddAsteroid()
+template< class Capacity >
+void GameServer< Capacity >::BuildSnapshot( Player< Capacity >* player )
 {
-	Asteroid* asteroid = nullptr;
-	for ( uint32_t i = 0; i < kGameMaxAsteroids; i++ )
+	const State& current = *m_gameState;
+	const State& baseline = *(const State*)player->prev;
+	memcpy( &m_outgoing, &baseline, sizeof(State) );
+	memset( m_visible, 0, sizeof(m_visible) );
+	m_candidateCount = 0;
+
+	float elapsed = ( m_tick - player->priority.lastTick ) * kServerTickSeconds;
+	elapsed = elapsed < kMaxPriorityElapsed ? elapsed : kMaxPriorityElapsed;
+	player->priority.lastTick = m_tick;
+
+	const uint32_t kFirstAsteroid = Capacity::kMaxShips;
+	const uint32_t kFirstLaser = Capacity::kMaxShips + Capacity::kMaxAsteroids;
+	bool fresh;
+	float error;
+
+	const ShipArray< Capacity::kMaxShips >& ships = current.ships;
+	float ownX = ships.positionX[ player->ship ];
+	float ownY = ships.positionY[ player->ship ];
+	for ( uint32_t k = 0; k < ships.count; k++ )
 	{
-		if ( !m_gameState->asteroids[ i ].alive )
+		uint32_t i = ships.dense[ k ];
+		uint32_t bytes = DiffShip( ships, baseline.ships, i, &fresh, &error );
+		float distance = WrappedDistance( ships.positionX[ i ], ownX, kWidthUnits ) + WrappedDistance( ships.positionY[ i ], ownY, kHeightUnits );
+		float closeness = distance < kNearRadius ? 1.0f - distance / kNearRadius : 0.0f;
+		float rate = kShipPriority + kNearPriority * closeness + kErrorPriority * ( error < kMaxError ? error : kMaxError );
+		AddCandidate( player, i, bytes, fresh, rate, elapsed );
+
+		// The player's own ship always makes the cut
+		if ( i == player->ship && m_candidateCount && m_candidates[ m_candidateCount - 1 ].entity == i )
 		{
-			asteroid = &m_gameState->asteroids[ i ];
-			break;
+			m_candidates[ m_candidateCount - 1 ].priority = FLT_MAX;
 		}
 	}
+
+	const AsteroidArray< Capacity::kMaxAsteroids >& asteroids = current.asteroids;
+	for ( uint32_t k = 0; k < asteroids.count; k++ )
+	{
+		uint32_t i = asteroids.dense[ k ];
+		uint32_t bytes = DiffAsteroid( asteroids, baseline.asteroids, i, &fresh, &error );
+		float rate = kAsteroidPriority + kErrorPriority * ( error < kMaxError ? error : kMaxError );
+		AddCandidate( player, kFirstAsteroid + i, bytes, fresh, rate, elapsed );
+	}
+
+	const LaserArray< Capacity::kMaxLasers >& lasers = current.lasers;
+	for ( uint32_t k = 0; k < lasers.count; k++ )
+	{
+		uint32_t i = lasers.dense[ k ];
+		uint32_t bytes = DiffLaser( lasers, baseline.lasers, i, &fresh, &error );
+		float rate = kLaserPriority + kErrorPriority * ( error < kMaxError ? error : kMaxError );
+		AddCandidate( player, kFirstLaser + i, bytes, fresh, rate, elapsed );
+	}
+
+	// Greedy fill: a candidate too big for what's left is passed over for
+	// smaller ones behind it
+	std::sort( m_candidates, m_candidates + m_candidateCount, MorePressing );
+	uint32_t room = m_snapshotEntityBytes;
+	for ( uint32_t c = 0; c < m_candidateCount; c++ )
+	{
+		SnapshotCandidate& candidate = m_candidates[ c ];
+		if ( m_snapshotEntityBytes )
+		{
+			if ( candidate.bytes > room )
+			{
+				continue;
+			}
+			room -= candidate.bytes;
+		}
+
+		candidate.selected = true;
+		uint32_t entity = candidate.entity;
+		m_visible[ entity / 32 ] |= 1u << ( entity % 32 );
+		if ( entity < kFirstAsteroid )
+		{
+			CopyShip( &m_outgoing.ships, ships, entity );
+		}
+		else if ( entity < kFirstLaser )
+		{
+			CopyAsteroid( &m_outgoing.asteroids, asteroids, entity - kFirstAsteroid );
+		}
+		else
+		{
+			CopyLaser( &m_outgoing.lasers, lasers, entity - kFirstLaser );
+		}
+	}
+
+	// Entities that died since the last snapshot always go, since that's only bookkeeping
+	RebuildPool( &m_outgoing.ships, ships.highWater, m_visible );
+	RebuildPool( &m_outgoing.asteroids, asteroids.highWater, m_visible + kFirstAsteroid / 32 );
+	RebuildPool( &m_outgoing.lasers, lasers.highWater, m_visible + kFirstLaser / 32 );
+}
+
+template< class Capacity >
+void GameServer< Capacity >::AddCandidate( Player< Capacity >* player, uint32_t entity, uint32_t bytes, bool fresh, float rate, float elapsed )
+{
+	float& priority = player->priority.priority[ entity ];
+	if ( !fresh )
+	{
+		// Already on the client, so it stays there whether or not it's updated
+		m_visible[ entity / 32 ] |= 1u << ( entity % 32 );
+		if ( !bytes )
+		{
+			priority = 0.0f;
+			return;
+		}
+	}
+
+	priority += rate * ( fresh ? kNewPriority : 1.0f ) * elapsed;
+	SnapshotCandidate candidate = { priority, entity, bytes, false };
+	m_candidates[ m_candidateCount++ ] = candidate;
+}
+
+template< class Capacity >
+void GameServer< Capacity >::CommitSnapshot( Player< Capacity >* player )
+{
+	memcpy( player->prev, &m_outgoing, sizeof(State) );
+	for ( uint32_t c = 0; c < m_candidateCount; c++ )
+	{
+		if ( m_candidates[ c ].selected )
+		{
+			player->priority.priority[ m_candidates[ c ].entity ] = 0.0f;
+			player->stats.entitiesSent++;
+		}
+		else
+		{
+			player->stats.entitiesDeferred++;
+		}
+	}
+}
+
+template< class Capacity >
+bool GameServer< Capacity >::SendBacklog( uint32_t slot )
+{
+	Player< Capacity >* player = &m_players[ slot ];
+	if ( !player->backlogBytes )
+	{
+		return true;
+	}
+
+	// The backlog never holds more than one frame, so only its age needs a limit
+	int pending = socket_send_backlog( player->socket, player->backlog, &player->backlogBytes );
+	if ( pending > 0 && NowSeconds() - player->backlogSince > kMaxBacklogSeconds )
+	{
+		LOG_ERROR( "Timed out completing send, closing socket" );
+		close( player->socket );
+		pending = -1;
+	}
+	if ( pending < 0 )
+	{
+		player->socket = -1;
+		player->backlogBytes = 0;
+		if ( m_recorder )
+		{
+			m_recorder->RecordDisconnect( slot, true );
+		}
+		return false;
+	}
+	return pending == 0;
+}
+
+template< class Capacity >
+bool GameServer< Capacity >::AddPlayer( int sock )
+{
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
+	{
+		if ( m_players[ i ].socket == -1 )
+		{
+			if ( !ConnectPlayer( i, sock ) )
+			{
+				LOG_ERROR( "No ship free for a new client, dropping connection" );
+				break;
+			}
+			LOG_INFO( "Client connected, adding ship!" );
+			if ( m_recorder )
+			{
+				m_recorder->RecordConnect( i );
+			}
+			return true;
+		}
+	}
+	close( sock );
+	return false;
+}
+
+template< class Capacity >
+bool GameServer< Capacity >::ConnectPlayer( uint32_t slot, int sock )
+{
+	// A player dropped this tick keeps its ship until the removal pass, which
+	// a new player taking the slot first would skip
+	Player< Capacity >* player = &m_players[ slot ];
+	if ( player->ship != kInvalidEntity )
+	{
+		m_gameState->ships.Clear( player->ship );
+		m_gameState->ships.Free( player->ship );
+	}
+	memset( player, 0, sizeof(*player) );
+	player->socket = -1;
+	player->ship = m_gameState->ships.Allocate();
+	if ( player->ship == kInvalidEntity )
+	{
+		return false;
+	}
+
+	player->socket = sock;
+	player->rate.Initialize( m_rateLimits, 1.0f / kServerSyncInterval );
+	m_gameState->ships.Clear( player->ship );
+	m_gameState->ships.id[ player->ship ] = m_currentShipId;
+	m_shipHistory.Backfill( player->ship, m_gameState->ships );
 	
-	if ( asteroid )
+	m_currentShipId++;
+	return true;
+}
+
+template< class Capacity >
+uint32_t GameServer< Capacity >::PlayerCount() const
+{
+	uint32_t count = 0;
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
-		memset( asteroid, 0, sizeof(*asteroid) );
-		asteroid->alive = true;
+		if ( m_players[ i ].socket != -1 )
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+template< class Capacity >
+void GameServer< Capacity >::WriteStats( StatsWriter* writer ) const
+{
+	writer->Printf( "[" );
+	bool first = true;
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
+	{
+		const Player< Capacity >& player = m_players[ i ];
+		if ( player.socket != -1 )
+		{
+			writer->Printf( "%s{\"ship\":%u,\"stats\":", first ? "" : ",", m_gameState->ships.id[ player.ship ] );
+			WriteConnectionStats( writer, player.stats, player.socket );
+			writer->Printf( ",\"input\":{\"delayTicks\":%d,\"jitterTicks\":%.2f,\"late\":%u},\"snapshots\":", player.inputs.JitterDelay(),
+				player.inputs.offsetDeviation, player.inputs.late );
+			player.rate.WriteStats( writer );
+			writer->Printf( "}" );
+			first = false;
+		}
+	}
+	writer->Printf( "]" );
+}
+
+template< class Capacity >
+void GameServer< Capacity >::AddAsteroid()
+{
+	AsteroidArray< Capacity::kMaxAsteroids >& asteroids = m_gameState->asteroids;
+	uint32_t i = asteroids.Allocate();
+	if ( i != kInvalidEntity )
+	{
+		asteroids.Clear( i );
 		
-		asteroid->position.x = 0.5 * kGameWidth / kGameScale * ((rand() / (float)RAND_MAX) * 2.0 - 1.0);
-		asteroid->position.y = 0.5 * kGameWidth / kGameScale * ((rand() / (float)RAND_MAX) * 2.0 - 1.0);
+		asteroids.positionX[ i ] = 0.5 * kGameWidth / kGameScale * (Random() * 2.0 - 1.0);
+		asteroids.positionY[ i ] = 0.5 * kGameWidth / kGameScale * (Random() * 2.0 - 1.0);
 		
-		asteroid->rotation = 2.0 * M_PI * (rand() / (float)RAND_MAX);
+		asteroids.rotation[ i ] = M_PI * (Random() * 2.0 - 1.0);
 		
-		const float kAsteroidSizeMin = 0.5;
-		const float kAsteroidSizeRange = 3.0;
-		asteroid->size = kAsteroidSizeMin + kAsteroidSizeRange * (rand() / (float)RAND_MAX);
+		asteroids.size[ i ] = kAsteroidSizeMin + kAsteroidSizeRange * Random();
 		
 		const float kAsteroidSpeedMin = 0.1;
 		const float kAsteroidSpeedRange = 3.0;
-		asteroid->velocity.x = kAsteroidSpeedMin + kAsteroidSpeedRange * (rand() / (float)RAND_MAX);
-		asteroid->velocity.y = kAsteroidSpeedMin + kAsteroidSpeedRange * (rand() / (float)RAND_MAX);
+		asteroids.velocityX[ i ] = kAsteroidSpeedMin + kAsteroidSpeedRange * Random();
+		asteroids.velocityY[ i ] = kAsteroidSpeedMin + kAsteroidSpeedRange * Random();
 	}
 }
 
-void GameServer::AddLaser( vec2 position, float rotation )
+template< class Capacity >
+void GameServer< Capacity >::AddLaser( vec2 position, vec2 direction, ShipId owner, uint32_t rewind )
 {
-	Laser* laser = nullptr;
-	for ( uint32_t i = 0; i < kGameMaxLasers; i++ )
+	LaserArray< Capacity::kMaxLasers >& lasers = m_gameState->lasers;
+	uint32_t i = lasers.Allocate();
+	if ( i != kInvalidEntity )
 	{
-		if ( !m_gameState->lasers[ i ].alive )
-		{
-			laser = &m_gameState->lasers[ i ];
-			break;
-		}
+		lasers.positionX[ i ] = position.x;
+		lasers.positionY[ i ] = position.y;
+		lasers.velocityX[ i ] = direction.x * kLaserSpeed;
+		lasers.velocityY[ i ] = direction.y * kLaserSpeed;
+		lasers.life[ i ] = kLaserLifeTime;
+		lasers.owner[ i ] = owner;
+		m_laserRewind[ i ] = rewind;
 	}
+}
+
+template< class Capacity >
+void GameServer< Capacity >::RespawnShip( uint32_t ship )
+{
+	ShipArray< Capacity::kMaxShips >& ships = m_gameState->ships;
+	ShipId id = ships.id[ ship ];
+	ships.Clear( ship );
+	ships.id[ ship ] = id;
+	ships.positionX[ ship ] = kWidthUnits * (Random() * 2.0 - 1.0);
+	ships.positionY[ ship ] = kHeightUnits * (Random() * 2.0 - 1.0);
+	m_shipHistory.Backfill( ship, ships );
+}
 
-	if ( laser )
+template< class Capacity >
+void GameServer< Capacity >::SetMaxRewind( uint32_t ticks )
+{
+	m_maxRewind = ticks < kShipHistoryTicks ? ticks : kShipHistoryTicks - 1;
+}
+
+// How many ticks behind the server the player's view is. A view tick from the
+// future, or none yet, gets no compensation.
+template< class Capacity >
+uint32_t GameServer< Capacity >::RewindTicks( const Input& input ) const
+{
+	uint32_t behind = (uint32_t)m_tick - input.viewTick;
+	if ( !input.viewTick || behind > (uint32_t)m_tick )
 	{
-		laser->alive = true;
-		laser->position = position;
-		laser->rotation = rotation;
-		laser->life = kLaserLifeTime;
+		return 0;
 	}
+	return behind < m_maxRewind ? behind : m_maxRewind;
 }
 
-void GameServer::SetInput( ShipId id, Input input )
+template< class Capacity >
+void GameServer< Capacity >::SetInput( ShipId id, Input input )
 {
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	const ShipArray< Capacity::kMaxShips >& ships = m_gameState->ships;
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
 	{
-		if ( m_gameState->ships[ i ].id == id )
+		if ( m_players[ i ].ship != kInvalidEntity && ships.id[ m_players[ i ].ship ] == id )
 		{
-			memcpy( &m_players[ i ].input, &input, sizeof(input) );
+			m_players[ i ].inputs.Push( input, (uint32_t)m_tick );
+			if ( m_recorder )
+			{
+				m_recorder->RecordInput( i, input );
+			}
 			return;
 		}
 	}
 }
 
-void GameClient::Initialize( int sock, GameState* gameState )
+template< class Capacity >
+void GameServer< Capacity >::SaveKeyframe( ServerKeyframe< Capacity >* keyframe ) const
+{
+	// Cleared first so padding compares equal when playback checks a keyframe
+	memset( keyframe, 0, sizeof(*keyframe) );
+	keyframe->tick = m_tick;
+	keyframe->currentShipId = m_currentShipId;
+	keyframe->random = m_random;
+	keyframe->maxRewind = m_maxRewind;
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
+	{
+		keyframe->players[ i ].connected = m_players[ i ].socket != -1;
+		keyframe->players[ i ].ship = m_players[ i ].ship;
+		memcpy( &keyframe->players[ i ].input, &m_players[ i ].input, sizeof(Input) );
+		memcpy( &keyframe->players[ i ].inputs, &m_players[ i ].inputs, sizeof(InputQueue) );
+		keyframe->players[ i ].fireTimer = m_players[ i ].fireTimer;
+	}
+	memcpy( &keyframe->state, m_gameState, sizeof(State) );
+	memcpy( &keyframe->collision, &m_collision, sizeof(m_collision) );
+	memcpy( &keyframe->shipHistory, &m_shipHistory, sizeof(m_shipHistory) );
+	memcpy( keyframe->laserRewind, m_laserRewind, sizeof(m_laserRewind) );
+}
+
+template< class Capacity >
+void GameServer< Capacity >::LoadKeyframe( const ServerKeyframe< Capacity >& keyframe )
+{
+	m_replaying = true;
+	m_listener = -1;
+	m_tick = keyframe.tick;
+	m_currentShipId = keyframe.currentShipId;
+	m_random = keyframe.random;
+	m_maxRewind = keyframe.maxRewind;
+	for ( uint32_t i = 0; i < Capacity::kMaxShips; i++ )
+	{
+		// Baselines start empty, so the first snapshot after a seek is a full one
+		Player< Capacity >* player = &m_players[ i ];
+		memset( player, 0, sizeof(*player) );
+		player->socket = keyframe.players[ i ].connected ? kReplaySocket : -1;
+		player->ship = keyframe.players[ i ].ship;
+		player->rate.Initialize( m_rateLimits, 1.0f / kServerSyncInterval );
+		memcpy( &player->input, &keyframe.players[ i ].input, sizeof(Input) );
+		memcpy( &player->inputs, &keyframe.players[ i ].inputs, sizeof(InputQueue) );
+		player->fireTimer = keyframe.players[ i ].fireTimer;
+	}
+	memcpy( m_gameState, &keyframe.state, sizeof(State) );
+	memcpy( &m_collision, &keyframe.collision, sizeof(m_collision) );
+	memcpy( &m_shipHistory, &keyframe.shipHistory, sizeof(m_shipHistory) );
+	memcpy( m_laserRewind, keyframe.laserRewind, sizeof(m_laserRewind) );
+}
+
+template< class Capacity >
+void GameServer< Capacity >::ReplayConnect( uint32_t slot )
+{
+	ConnectPlayer( slot, kReplaySocket );
+}
+
+template< class Capacity >
+void GameServer< Capacity >::ReplayInput( uint32_t slot, const Input& input )
+{
+	m_players[ slot ].inputs.Push( input, (uint32_t)m_tick );
+}
+
+template< class Capacity >
+void GameServer< Capacity >::ReplayDisconnect( uint32_t slot )
+{
+	m_players[ slot ].socket = -1;
+}
+
+template< class Capacity >
+float GameServer< Capacity >::Random()
+{
+	// xorshift32
+	m_random ^= m_random << 13;
+	m_random ^= m_random >> 17;
+	m_random ^= m_random << 5;
+	return ( m_random >> 8 ) * ( 1.0f / 16777215.0f );
+}
+
+template< class Capacity >
+void GameClient< Capacity >::Initialize( int sock, State* gameState )
 {
 	memset( this, 0, sizeof(*this) );
 	memset( gameState, 0, sizeof(*gameState) );
 	m_gameState = gameState;
 	m_socket = sock;
 
-	m_gameState->asteroids[ 0 ].alive = true;
-	m_gameState->asteroids[ 0 ].size = 1.0;
+	uint32_t asteroid = m_gameState->asteroids.Allocate();
+	m_gameState->asteroids.size[ asteroid ] = 1.0;
 
+	m_tick = 0;
+	m_sentTick = 0;
 	m_sendTimer = 0.0;
+	m_clock.Initialize();
 }
 
-void GameClient::Update( float dt )
+template< class Capacity >
+void GameClient< Capacity >::Update( float dt )
 {
-	if ( m_socket != -1 )
+	ProfileScope tickScope( kProfileClientTick );
+	ProfileTimer timer;
+
+	// Held controls go out every tick, since the server simulates one input per
+	// tick; when idle, inputs are only resent now and then to keep viewTick fresh
+	m_tick++;
+	m_sendTimer += dt;
+	bool held = m_input.accel || m_input.turn || m_input.fire;
+	m_input.syncTime = m_socket != -1 ? m_clock.Request( NowSeconds() ) : 0;
+	if ( ( held && m_sentTick != m_tick ) || m_input.syncTime || m_sendTimer > kServerSyncInterval )
 	{
-		m_sendTimer += dt;
-		if ( m_sendTimer > kServerSyncInterval )
-		{
-			int bytes = socket_send_msg( m_socket, &m_input, sizeof(m_input) );
-			if ( bytes < sizeof(m_input) )
-			{
-				printf( "Error sending, closing socket: %s\n", strerror( errno ) );
-				m_socket = -1;
-			}
-			m_sendTimer -= kServerSyncInterval;
-		}
+		SendInput( m_tick );
 	}
+	m_input.syncTime = 0;
+	timer.Lap( kProfileClientSend );
 
 	while ( m_socket != -1 )
 	{
-		uint8_t compressed[ sizeof(GameState) ];
-		int recvd = socket_recv_msg( m_socket, compressed, sizeof(compressed) );
+		int recvd = socket_recv_msg( m_socket, m_message, sizeof(m_message) );
+		timer.Lap( kProfileClientRecv );
 		if ( recvd == -1 )
 		{
-			printf( "Error receiving, closing socket: %s\n", strerror( errno ) );
+			LOG_ERROR( "Error receiving, closing socket: %s", strerror( errno ) );
 			m_socket = -1;
+			break;
 		}
 		else if ( recvd == 0 )
 		{
 			break;
 		}
 
-		uint8_t diff[ sizeof(GameState) ];
-		int result = LZ4_decompress_fast( (const char*)compressed, (char*)diff, sizeof(GameState) );
-		if ( result != recvd )
+		SnapshotHeader header;
+		memcpy( &header, m_message, sizeof(header) );
+		if ( recvd >= (int)sizeof(header) )
+		{
+			double now = NowSeconds();
+			m_clock.OnSnapshot( header.tick, header.serverTime );
+			m_clock.OnReply( header.syncEcho, header.syncReceived, header.serverTime, now );
+		}
+
+		int result = -1;
+		if ( recvd >= (int)sizeof(header) )
+		{
+			result = LZ4_decompress_safe( (const char*)m_message + sizeof(header), (char*)m_diff, recvd - (int)sizeof(header), sizeof(State) );
+		}
+		timer.Lap( kProfileClientDecompress );
+		if ( result != sizeof(State) )
 		{
-			printf( "Error decompressing received state\n" );
+			LOG_ERROR( "Error decompressing received state" );
 			m_socket = -1;
+			break;
 		}
 
 		uint8_t* current = (uint8_t*)m_gameState;
-		for ( uint32_t b = 0; b < sizeof(GameState); b++ )
+		for ( uint32_t b = 0; b < sizeof(State); b++ )
+		{
+			current[ b ] = m_diff[ b ] ^ m_prev[ b ];
+		}
+		memcpy( m_prev, current, sizeof(State) );
+		m_input.viewTick = header.tick;
+		timer.Lap( kProfileClientApply );
+
+		// Answer pings straight away so the server measures the network, not our send rate
+		if ( header.ping )
 		{
-			current[ b ] = diff[ b ] ^ m_prev[ b ];
+			m_input.pong = header.ping;
+			SendInput( m_sentTick );
 		}
-		memcpy( m_prev, current, sizeof(GameState) );
 	}
 
-	for ( uint32_t i = 0; i < kGameMaxShips; i++ )
+	const ShipArray< Capacity::kMaxShips >& ships = m_gameState->ships;
+	float accel[ Capacity::kMaxShips ] = {};
+	float turn[ Capacity::kMaxShips ] = {};
+	for ( uint32_t k = 0; k < ships.count; k++ )
 	{
-		float accel = 0.0f;
-		float turn = 0.0f;
-		if ( m_gameState->ships[ i ].local )
+		uint32_t i = ships.dense[ k ];
+		if ( ships.local[ i ] )
 		{
-			accel = m_input.accel;
-			turn = m_input.turn;
+			accel[ i ] = m_input.accel;
+			turn[ i ] = m_input.turn;
 		}
-		m_gameState->ships[ i ].Update( dt, accel, turn );
 	}
 
-	for ( uint32_t i = 0; i < kGameMaxLasers; i++ )
+	m_gameState->ships.Update( dt, accel, turn );
+	m_gameState->lasers.Update( dt );
+}
+
+template< class Capacity >
+double GameClient< Capacity >::ServerTick() const
+{
+	return m_clock.ServerTick( NowSeconds() );
+}
+
+template< class Capacity >
+void GameClient< Capacity >::WriteStats( StatsWriter* writer ) const
+{
+	writer->Printf( "{\"clock\":" );
+	m_clock.WriteStats( writer, NowSeconds() );
+	writer->Printf( "}" );
+}
+
+template< class Capacity >
+void GameClient< Capacity >::SendInput( uint32_t tick )
+{
+	if ( m_socket == -1 )
 	{
-		m_gameState->lasers[ i ].Update( dt );
+		return;
 	}
+
+	m_input.tick = tick;
+	if ( socket_send_msg( m_socket, &m_input, sizeof(m_input) ) < 0 )
+	{
+		LOG_ERROR( "Error sending, closing socket: %s", strerror( errno ) );
+		m_socket = -1;
+	}
+	m_sentTick = tick;
+	m_sendTimer = 0.0;
 }
 
-void GameClient::SetInput( SDL_Keycode key, bool down )
+template< class Capacity >
+void GameClient< Capacity >::SetInput( SDL_Keycode key, bool down )
 {
+	Input prev = m_input;
+
 	if ( key == SDLK_UP )
 	{
 		m_input.accel = ( down ? 1 : 0 );
@@ -394,4 +1185,15 @@ void GameClient::SetInput( SDL_Keycode key, bool down )
 	{
 		m_input.fire = ( down ? 1 : 0 );
 	}
+
+	// Events are polled between ticks, so the change first applies on the next one
+	if ( m_input.accel != prev.accel || m_input.turn != prev.turn || m_input.fire != prev.fire )
+	{
+		SendInput( m_tick + 1 );
+	}
 }
+
+template class GameServer< StandardCapacity >;
+template class GameServer< LargeCapacity >;
+template class GameClient< StandardCapacity >;
+template class GameClient< LargeCapacity >;
@@ -2,105 +2,292 @@
 #define GAME_H
 
 #include <cstdint>
-#include "Math.h"
+#include "Entity.h"
+#include "Collision.h"
+#include "JobSystem.h"
+#include "NetStats.h"
+#include "ClockSync.h"
+#include "SnapshotRate.h"
+#include "lz4.h"
 #include <SDL.h>
 
-typedef uint32_t ShipId;
+// Capacity policies. GameState, GameServer and GameClient are instantiated per
+// policy so every loop bound and buffer size is a compile-time constant; client
+// and server must agree on the policy since it fixes the snapshot layout.
+struct StandardCapacity
+{
+	static const uint32_t kMaxShips = 32;
+	static const uint32_t kMaxAsteroids = 64;
+	static const uint32_t kMaxLasers = 128;
+};
 
-const uint32_t kGameMaxShips = 32;
-const uint32_t kGameMaxAsteroids = 64;
-const uint32_t kGameMaxLasers = 128;
-const int kGameWidth = 640;
-const int kGameHeight = 480;
-const float kGameScale = 50.0f; // Length of 1 unit in pixels(ish)
+struct LargeCapacity
+{
+	static const uint32_t kMaxShips = 128;
+	static const uint32_t kMaxAsteroids = 512;
+	static const uint32_t kMaxLasers = 2048;
+};
 
-struct Ship
+template< class Capacity >
+struct GameState
 {
-	void Update( double dt, float accel, float turn );
-
-	ShipId id;
-	bool alive;
-	vec2 position;
-	vec2 velocity;
-	float rotation;
-	float rotationVelocity;
-	bool local;
+	ShipArray< Capacity::kMaxShips > ships;
+	AsteroidArray< Capacity::kMaxAsteroids > asteroids;
+	LaserArray< Capacity::kMaxLasers > lasers;
 };
 
-struct Asteroid
+struct Input
 {
-	bool alive;
-	vec2 position;
-	float rotation;
-	vec2 velocity;
-	float size;
+	int32_t accel;
+	int32_t turn;
+	int8_t fire;
+	uint32_t pong; // Last ping id seen in a snapshot
+	uint32_t viewTick; // Tick of the last snapshot applied, what the player is looking at
+	uint32_t tick; // Client tick the input was sampled for, counting up from 1
+	uint64_t syncTime; // Client clock in microseconds when asking for a time sync, 0 otherwise
 };
 
-struct Laser
+const uint32_t kInputQueueSize = 32;
+const int32_t kMaxInputDelayTicks = 8; // Most buffering added to ride out jitter, 133 ms
+
+// A player's inputs in client tick order, played back exactly one client tick
+// per server tick behind an adaptive delay. Every new input's arrival offset,
+// server tick minus client tick, feeds a smoothed mean and deviation; the
+// delay steps a tick at a time towards the mean plus twice the deviation, so a
+// steady connection plays inputs the tick they arrive and a jittery one holds
+// just enough back that bursts and gaps don't reach the simulation.
+//
+// A resend of the newest tick replaces it, since only viewTick or pong can
+// have changed; anything older than that is stale and dropped.
+struct InputQueue
 {
-	void Update( double dt );
+	Input inputs[ kInputQueueSize ];
+	uint32_t head;
+	uint32_t count;
+	uint32_t newestTick;
+	int32_t delay; // Server tick minus the client tick played on it
+	float offsetMean;
+	float offsetDeviation;
+	uint32_t late; // Inputs that arrived after their tick had been played
+
+	void Push( const Input& input, uint32_t serverTick );
 
-	bool alive;
-	vec2 position;
-	float rotation;
-	double life;
+	// Takes the input due on this server tick, skipping any overdue ones; false
+	// if none is due, in which case the last input should be held
+	bool Pop( uint32_t serverTick, Input* input );
+
+	// Ticks of delay beyond the mean arrival offset
+	int32_t JitterDelay() const;
 };
 
-struct GameState
+// Precedes the compressed delta in every snapshot message
+struct SnapshotHeader
 {
-	Ship ships[ kGameMaxShips ];
-	Asteroid asteroids[ kGameMaxAsteroids ];
-	Laser lasers[ kGameMaxLasers ];
+	uint32_t ping; // Non-zero asks the client to echo it in Input::pong straight away
+	uint32_t tick; // Low bits of the server tick the snapshot was taken on
+	uint64_t serverTime; // Server clock in microseconds when the snapshot was sent
+	uint64_t syncEcho; // Input::syncTime this snapshot answers, 0 if none
+	uint64_t syncReceived; // Server clock in microseconds when that input was read
 };
 
-struct Input
+// Most entity bytes a snapshot carries by default, about one full TCP segment
+const uint32_t kDefaultSnapshotEntityBytes = 1400;
+
+// How overdue every entity is for one client, ships then asteroids then
+// lasers by slot. Each snapshot, every entity the client's copy differs from
+// gains priority at a rate set by how much it matters to this client: ships
+// near the player's own, entities the client's copy is furthest off for and
+// entities the client has never been sent gain fastest. The snapshot takes the
+// most overdue entities that fit its byte budget and resets them; the rest keep
+// what they have built up for a later snapshot.
+template< class Capacity >
+struct SnapshotPriority
 {
-	int32_t accel;
-	int32_t turn;
-	int8_t fire;
+	static const uint32_t kEntities = Capacity::kMaxShips + Capacity::kMaxAsteroids + Capacity::kMaxLasers;
+
+	float priority[ kEntities ];
+	uint64_t lastTick; // Server tick of the last snapshot built
+};
+
+// An entity the client's copy of is out of date
+struct SnapshotCandidate
+{
+	float priority;
+	uint32_t entity; // Index into SnapshotPriority::priority
+	uint32_t bytes; // Estimated cost of its fields that differ from the client's copy in the delta
+	bool selected;
 };
 
+// How far back lasers are judged against ships by default: 200 ms at 60 ticks a second
+const uint32_t kDefaultMaxRewindTicks = 12;
+
+template< class Capacity >
 struct Player
 {
 	int socket;
-	Input input;
+	uint32_t ship;
+	Input input; // Applied on the current tick, held until the next one arrives
+	InputQueue inputs;
 	double fireTimer;
-	uint8_t prev[ sizeof(GameState) ];
+	ConnectionStats stats;
+	SnapshotRate rate;
+	SnapshotPriority< Capacity > priority;
+	uint64_t syncTime; // Time sync request to answer in the next snapshot, 0 if none
+	uint64_t syncReceived;
+	uint8_t prev[ sizeof(GameState< Capacity >) ]; // What the client was last sent
+
+	// The rest of a snapshot frame the socket only took part of
+	uint8_t backlog[ sizeof(uint32_t) + sizeof(SnapshotHeader) + LZ4_COMPRESSBOUND( sizeof(GameState< Capacity >) ) ];
+	uint32_t backlogBytes;
+	double backlogSince;
 };
 
+class ReplayRecorder;
+class CorpusWriter;
+
+// Everything the server simulation carries from one tick to the next, so a
+// replay can start from the middle of a match
+template< class Capacity >
+struct ServerKeyframe
+{
+	struct Slot
+	{
+		uint8_t connected;
+		uint32_t ship;
+		Input input;
+		InputQueue inputs;
+		double fireTimer;
+	};
+
+	uint64_t tick;
+	ShipId currentShipId;
+	uint32_t random;
+	uint32_t maxRewind;
+	Slot players[ Capacity::kMaxShips ];
+	GameState< Capacity > state;
+	CollisionSystem< Capacity::kMaxShips, Capacity::kMaxAsteroids, Capacity::kMaxLasers > collision;
+	ShipHistory< Capacity::kMaxShips > shipHistory;
+	uint8_t laserRewind[ Capacity::kMaxLasers ];
+};
+
+template< class Capacity >
 class GameServer
 {
 public:
-	void Initialize( int sock, GameState* gameState );
+	typedef GameState< Capacity > State;
+
+	// Entity updates are split into jobs on the given job system, or run inline
+	// if it is null. A listener of -1 leaves accepting players to the caller.
+	void Initialize( int sock, State* gameState, JobSystem* jobs );
 	void Update( float dt );
 
+	bool AddPlayer( int sock ); // False if every ship slot is taken, in which case the socket is closed
+	uint32_t PlayerCount() const;
+
+	// Appends a JSON array with one object per connected player
+	void WriteStats( StatsWriter* writer ) const;
+
 	void AddAsteroid();
-	void AddLaser( vec2 position, float rotation );
+	void AddLaser( vec2 position, vec2 direction, ShipId owner, uint32_t rewind = 0 );
 	void SetInput( ShipId id, Input input );
 
+	// Lag compensation. A laser hits ships where its shooter saw them, as of the
+	// snapshot named by Input::viewTick, but never more than this many ticks
+	// back; 0 turns it off. Clamped to the history kept.
+	void SetMaxRewind( uint32_t ticks );
+
+	// Each player's snapshot rate floats between these bounds, adapting to its
+	// connection. Applies to players who connect from now on.
+	void SetSnapshotRateLimits( const SnapshotRateLimits& limits ) { m_rateLimits = limits; }
+
+	// Most estimated entity bytes one snapshot carries, 0 for no limit. Entity
+	// updates that don't fit wait for a later snapshot, most relevant first.
+	void SetSnapshotEntityBytes( uint32_t bytes ) { m_snapshotEntityBytes = bytes; }
+
+	// Replay. A recorder logs every connect, input and disconnect plus periodic
+	// keyframes. Loading a keyframe puts the server in replay mode: players have
+	// no sockets and are driven through the Replay calls, and snapshots are
+	// encoded as usual but not sent.
+	void SetRecorder( ReplayRecorder* recorder ) { m_recorder = recorder; }
+	void SaveKeyframe( ServerKeyframe< Capacity >* keyframe ) const;
+	void LoadKeyframe( const ServerKeyframe< Capacity >& keyframe );
+	void ReplayConnect( uint32_t slot );
+	void ReplayInput( uint32_t slot, const Input& input );
+	void ReplayDisconnect( uint32_t slot );
+	uint64_t Tick() const { return m_tick; }
+
+	// Captures every snapshot delta, as handed to the compressor, for offline codec work
+	void SetCorpus( CorpusWriter* corpus ) { m_corpus = corpus; }
+
 private:
+	bool ConnectPlayer( uint32_t slot, int sock ); // False if no ship could be allocated
+	void BuildSnapshot( Player< Capacity >* player ); // Into m_outgoing
+	void AddCandidate( Player< Capacity >* player, uint32_t entity, uint32_t bytes, bool fresh, float rate, float elapsed );
+	void CommitSnapshot( Player< Capacity >* player ); // Once m_outgoing is on its way
+	bool SendBacklog( uint32_t slot ); // True once nothing is left to send
+	void RespawnShip( uint32_t ship );
+	uint32_t RewindTicks( const Input& input ) const;
+	float Random(); // Uniform in [0, 1]; kept per server so replays reproduce it
+
 	int m_listener;
 	ShipId m_currentShipId;
-	double m_sendTimer;
+	SnapshotRateLimits m_rateLimits;
+	uint32_t m_snapshotEntityBytes;
+	uint32_t m_pingCounter;
+	uint32_t m_random;
+	uint64_t m_tick;
+	uint32_t m_maxRewind;
+	bool m_replaying;
+	ReplayRecorder* m_recorder;
+	CorpusWriter* m_corpus;
 	
-	Player m_players[ kGameMaxShips ];
-	GameState* m_gameState;
+	Player< Capacity > m_players[ Capacity::kMaxShips ];
+	State* m_gameState;
+	JobSystem* m_jobs;
+	CollisionSystem< Capacity::kMaxShips, Capacity::kMaxAsteroids, Capacity::kMaxLasers > m_collision;
+	ShipHistory< Capacity::kMaxShips > m_shipHistory;
+	uint8_t m_laserRewind[ Capacity::kMaxLasers ]; // Ticks each laser is judged in the past
+
+	// The snapshot being built: what the client has, with the entities that
+	// made the cut brought up to date
+	State m_outgoing;
+	SnapshotCandidate m_candidates[ SnapshotPriority< Capacity >::kEntities ];
+	uint32_t m_candidateCount;
+	uint32_t m_visible[ SnapshotPriority< Capacity >::kEntities / 32 ]; // Entities alive in m_outgoing
+
+	uint8_t m_diff[ sizeof(State) ];
+	uint8_t m_message[ sizeof(SnapshotHeader) + LZ4_COMPRESSBOUND( sizeof(State) ) ];
 };
 
+template< class Capacity >
 class GameClient
 {
 public:
-	void Initialize( int sock, GameState* gameState );
+	typedef GameState< Capacity > State;
+
+	void Initialize( int sock, State* gameState );
 	void Update( float dt );
 
+	// Changes to the controls are sent straight away
 	void SetInput( SDL_Keycode key, bool down );
 
+	// The server tick the server is on now, going by the synced clock; 0 until synced
+	double ServerTick() const;
+	void WriteStats( StatsWriter* writer ) const;
+
 private:
+	void SendInput( uint32_t tick );
+
 	int m_socket;
 	Input m_input;
-	GameState* m_gameState;
-	double m_sendTimer;
-	uint8_t m_prev[ sizeof(GameState) ];
+	State* m_gameState;
+	uint32_t m_tick;
+	uint32_t m_sentTick; // Of the last input sent
+	double m_sendTimer; // Since the last input sent
+	ClockSync m_clock;
+	uint8_t m_prev[ sizeof(State) ];
+	uint8_t m_diff[ sizeof(State) ];
+	uint8_t m_message[ sizeof(SnapshotHeader) + LZ4_COMPRESSBOUND( sizeof(State) ) ];
 };
 
 #endif
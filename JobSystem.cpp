@@ -0,0 +1,217 @@
+#include "JobSystem.h"
+
+#include <pthread.h>
+#if defined( __APPLE__ )
+#include <mach/mach.h>
+#include <mach/thread_policy.h>
+#elif defined( __linux__ )
+#include <sched.h>
+#endif
+
+static void PinThread( pthread_t thread, uint32_t core )
+{
+#if defined( __APPLE__ )
+	// No hard affinity on macOS; distinct tags ask the scheduler to keep threads on separate cores
+	thread_affinity_policy_data_t policy = { (integer_t)( core + 1 ) };
+	thread_policy_set( pthread_mach_thread_np( thread ), THREAD_AFFINITY_POLICY, (thread_policy_t)&policy, THREAD_AFFINITY_POLICY_COUNT );
+#elif defined( __linux__ )
+	cpu_set_t cores;
+	CPU_ZERO( &cores );
+	CPU_SET( core, &cores );
+	pthread_setaffinity_np( thread, sizeof(cores), &cores );
+#endif
+}
+
+void JobSystem::Initialize( uint32_t threadCount, bool pinThreads )
+{
+	uint32_t cores = std::thread::hardware_concurrency();
+	if ( cores == 0 )
+	{
+		cores = 1;
+	}
+	if ( threadCount == 0 )
+	{
+		threadCount = cores;
+	}
+	if ( threadCount > kMaxThreads )
+	{
+		threadCount = kMaxThreads;
+	}
+
+	m_threadCount = threadCount;
+	m_nextQueue = 0;
+	m_queued = 0;
+	m_quit = false;
+	for ( uint32_t i = 0; i < m_threadCount; i++ )
+	{
+		m_queues[ i ].head = 0;
+		m_queues[ i ].tail = 0;
+	}
+
+	for ( uint32_t i = 1; i < m_threadCount; i++ )
+	{
+		m_threads[ i ] = std::thread( &JobSystem::WorkerMain, this, i );
+	}
+
+	if ( pinThreads )
+	{
+		PinThread( pthread_self(), 0 );
+		for ( uint32_t i = 1; i < m_threadCount; i++ )
+		{
+			PinThread( m_threads[ i ].native_handle(), i % cores );
+		}
+	}
+}
+
+void JobSystem::Shutdown()
+{
+	{
+		std::lock_guard< std::mutex > lock( m_sleepMutex );
+		m_quit = true;
+	}
+	m_wake.notify_all();
+
+	for ( uint32_t i = 1; i < m_threadCount; i++ )
+	{
+		m_threads[ i ].join();
+	}
+	m_threadCount = 0;
+}
+
+void JobSystem::Submit( JobCounter* counter, uint32_t count, uint32_t grain, JobFunction function, void* data )
+{
+	if ( grain == 0 )
+	{
+		grain = 1;
+	}
+
+	if ( m_threadCount <= 1 )
+	{
+		for ( uint32_t begin = 0; begin < count; begin += grain )
+		{
+			function( data, begin, begin + grain < count ? begin + grain : count );
+		}
+		return;
+	}
+
+	for ( uint32_t begin = 0; begin < count; begin += grain )
+	{
+		Job job;
+		job.function = function;
+		job.data = data;
+		job.begin = begin;
+		job.end = begin + grain < count ? begin + grain : count;
+		job.counter = counter;
+
+		// Deal chunks out across every queue so idle workers find work without
+		// having to steal it first
+		counter->fetch_add( 1, std::memory_order_relaxed );
+		m_queued.fetch_add( 1, std::memory_order_release );
+		if ( !Push( m_nextQueue, job ) )
+		{
+			m_queued.fetch_sub( 1, std::memory_order_relaxed );
+			Run( job );
+		}
+		m_nextQueue = ( m_nextQueue + 1 ) % m_threadCount;
+	}
+
+	{
+		std::lock_guard< std::mutex > lock( m_sleepMutex );
+	}
+	m_wake.notify_all();
+}
+
+void JobSystem::Wait( JobCounter* counter )
+{
+	while ( counter->load( std::memory_order_acquire ) > 0 )
+	{
+		if ( !RunOne( 0 ) )
+		{
+			std::this_thread::yield();
+		}
+	}
+}
+
+void JobSystem::ParallelFor( uint32_t count, uint32_t grain, JobFunction function, void* data )
+{
+	JobCounter counter( 0 );
+	Submit( &counter, count, grain, function, data );
+	Wait( &counter );
+}
+
+bool JobSystem::Push( uint32_t worker, const Job& job )
+{
+	Queue& queue = m_queues[ worker ];
+	std::lock_guard< std::mutex > lock( queue.mutex );
+	if ( queue.tail - queue.head == kQueueCapacity )
+	{
+		return false;
+	}
+
+	queue.jobs[ queue.tail % kQueueCapacity ] = job;
+	queue.tail++;
+	return true;
+}
+
+bool JobSystem::Pop( uint32_t worker, Job* job )
+{
+	Queue& queue = m_queues[ worker ];
+	std::lock_guard< std::mutex > lock( queue.mutex );
+	if ( queue.tail == queue.head )
+	{
+		return false;
+	}
+
+	queue.tail--;
+	*job = queue.jobs[ queue.tail % kQueueCapacity ];
+	return true;
+}
+
+bool JobSystem::Steal( uint32_t worker, Job* job )
+{
+	for ( uint32_t i = 1; i < m_threadCount; i++ )
+	{
+		Queue& queue = m_queues[ ( worker + i ) % m_threadCount ];
+		std::lock_guard< std::mutex > lock( queue.mutex );
+		if ( queue.tail != queue.head )
+		{
+			*job = queue.jobs[ queue.head % kQueueCapacity ];
+			queue.head++;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool JobSystem::RunOne( uint32_t worker )
+{
+	Job job;
+	if ( !Pop( worker, &job ) && !Steal( worker, &job ) )
+	{
+		return false;
+	}
+
+	m_queued.fetch_sub( 1, std::memory_order_relaxed );
+	Run( job );
+	return true;
+}
+
+void JobSystem::Run( const Job& job )
+{
+	job.function( job.data, job.begin, job.end );
+	job.counter->fetch_sub( 1, std::memory_order_release );
+}
+
+void JobSystem::WorkerMain( uint32_t worker )
+{
+	while ( !m_quit.load( std::memory_order_relaxed ) )
+	{
+		if ( RunOne( worker ) )
+		{
+			continue;
+		}
+
+		std::unique_lock< std::mutex > lock( m_sleepMutex );
+		m_wake.wait( lock, [this] { return m_queued.load( std::memory_order_acquire ) > 0 || m_quit.load(); } );
+	}
+}
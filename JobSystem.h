@@ -0,0 +1,76 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+typedef void (*JobFunction)( void* data, uint32_t begin, uint32_t end );
+typedef std::atomic< uint32_t > JobCounter;
+
+// Work-stealing scheduler. Every thread owns a job queue: it pops its own work
+// newest-first and, when that runs dry, steals the oldest job from another
+// queue. The thread that called Initialize is worker 0 and helps out while it
+// waits, so a single-threaded system just runs jobs inline.
+//
+// Submit and Wait must be called from the thread that called Initialize.
+class JobSystem
+{
+public:
+	// threadCount of 0 uses one thread per hardware core. Pinning ties worker i
+	// to core i, for long-running jobs that benefit from a warm cache.
+	void Initialize( uint32_t threadCount, bool pinThreads = false );
+	void Shutdown();
+
+	uint32_t ThreadCount() const { return m_threadCount; }
+
+	// Splits [0, count) into chunks of at most grain and queues one job per chunk.
+	// The counter is incremented per job and decremented as each one finishes.
+	void Submit( JobCounter* counter, uint32_t count, uint32_t grain, JobFunction function, void* data );
+	void Wait( JobCounter* counter );
+
+	void ParallelFor( uint32_t count, uint32_t grain, JobFunction function, void* data );
+
+	static const uint32_t kMaxThreads = 64;
+
+private:
+	struct Job
+	{
+		JobFunction function;
+		void* data;
+		uint32_t begin;
+		uint32_t end;
+		JobCounter* counter;
+	};
+
+	static const uint32_t kQueueCapacity = 256;
+
+	struct Queue
+	{
+		std::mutex mutex;
+		uint32_t head; // Oldest job, where thieves take from
+		uint32_t tail; // One past the newest job, where the owner pops from
+		Job jobs[ kQueueCapacity ];
+	};
+
+	bool Push( uint32_t worker, const Job& job );
+	bool Pop( uint32_t worker, Job* job );
+	bool Steal( uint32_t worker, Job* job );
+	bool RunOne( uint32_t worker );
+	void Run( const Job& job );
+	void WorkerMain( uint32_t worker );
+
+	uint32_t m_threadCount;
+	uint32_t m_nextQueue;
+	std::thread m_threads[ kMaxThreads ];
+	Queue m_queues[ kMaxThreads ];
+
+	std::atomic< uint32_t > m_queued;
+	std::atomic< bool > m_quit;
+	std::mutex m_sleepMutex;
+	std::condition_variable m_wake;
+};
+
+#endif
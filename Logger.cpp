@@ -0,0 +1,424 @@
+#include "Logger.h"
+#include "Tracer.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const uint32_t kLogBufferRecords = 1024;
+const uint32_t kMaxLogThreads = 256;
+const uint64_t kLogWindowNs = 1000000000;
+const uint32_t kLogWindowMessages = 10; // Per site per window
+const std::chrono::milliseconds kLogWriteInterval( 5 );
+
+// Single producer, single consumer: the owning thread fills records at tail
+// and the writer thread retires them from head
+struct LogBuffer
+{
+	uint32_t thread;
+	std::atomic< uint32_t > head;
+	std::atomic< uint32_t > tail;
+	std::atomic< uint64_t > dropped;
+	LogRecord records[ kLogBufferRecords ];
+};
+
+static std::mutex s_registryMutex;
+static LogBuffer* s_buffers[ kMaxLogThreads ];
+static std::atomic< uint32_t > s_bufferCount( 0 );
+static thread_local LogBuffer* t_buffer = nullptr;
+static std::atomic< LogSite* > s_sites( nullptr );
+
+static const uint64_t s_startTime = TraceNow();
+static std::atomic< bool > s_writerRunning( false );
+static std::atomic< uint64_t > s_dropped( 0 );
+static FILE* s_out = nullptr;
+static std::thread s_writer;
+static std::mutex s_writerMutex;
+static std::condition_variable s_writerWake;
+static bool s_writerQuit = false;
+
+static LogBuffer* RegisterThread()
+{
+	std::lock_guard< std::mutex > lock( s_registryMutex );
+	uint32_t count = s_bufferCount.load( std::memory_order_relaxed );
+	if ( count == kMaxLogThreads )
+	{
+		return nullptr;
+	}
+
+	LogBuffer* buffer = new LogBuffer;
+	buffer->thread = count;
+	buffer->head = 0;
+	buffer->tail = 0;
+	buffer->dropped = 0;
+	s_buffers[ count ] = buffer;
+	s_bufferCount.store( count + 1, std::memory_order_release );
+	return buffer;
+}
+
+//-----------
+// Recording
+//-----------
+
+LogRecord* LogBegin( LogSite* site )
+{
+	uint64_t now = TraceNow();
+
+	// Racing threads may both reset the window or let a message or two extra
+	// through; the limit only has to be roughly right
+	uint64_t window = now / kLogWindowNs;
+	if ( site->window.load( std::memory_order_relaxed ) != window )
+	{
+		site->window.store( window, std::memory_order_relaxed );
+		site->count.store( 0, std::memory_order_relaxed );
+	}
+	if ( site->count.fetch_add( 1, std::memory_order_relaxed ) >= kLogWindowMessages )
+	{
+		site->suppressed.fetch_add( 1, std::memory_order_relaxed );
+		site->suppressedWindow.store( window, std::memory_order_relaxed );
+		if ( !site->registered.exchange( true, std::memory_order_relaxed ) )
+		{
+			site->next = s_sites.load( std::memory_order_relaxed );
+			while ( !s_sites.compare_exchange_weak( site->next, site, std::memory_order_release, std::memory_order_relaxed ) )
+			{
+			}
+		}
+		return nullptr;
+	}
+
+	if ( !t_buffer )
+	{
+		t_buffer = RegisterThread();
+		if ( !t_buffer )
+		{
+			s_dropped.fetch_add( 1, std::memory_order_relaxed );
+			return nullptr;
+		}
+	}
+
+	uint32_t tail = t_buffer->tail.load( std::memory_order_relaxed );
+	if ( tail - t_buffer->head.load( std::memory_order_acquire ) == kLogBufferRecords )
+	{
+		t_buffer->dropped.fetch_add( 1, std::memory_order_relaxed );
+		s_dropped.fetch_add( 1, std::memory_order_relaxed );
+		return nullptr;
+	}
+
+	LogRecord* record = &t_buffer->records[ tail % kLogBufferRecords ];
+	record->time = now;
+	record->site = site;
+	record->suppressed = site->suppressed.exchange( 0, std::memory_order_relaxed );
+	record->textUsed = 0;
+	record->argCount = 0;
+	return record;
+}
+
+void LogAppend( LogRecord* record, LogType type, LogValue value )
+{
+	if ( record->argCount < kLogMaxArgs )
+	{
+		record->types[ record->argCount ] = type;
+		record->args[ record->argCount ] = value;
+		record->argCount++;
+	}
+}
+
+void LogAppendString( LogRecord* record, const char* string )
+{
+	// Long strings are truncated to the space left; the last byte is always a terminator
+	uint32_t offset = record->textUsed < kLogTextBytes ? record->textUsed : kLogTextBytes - 1;
+	uint32_t length = 0;
+	if ( string )
+	{
+		while ( string[ length ] && offset + length < kLogTextBytes - 1 )
+		{
+			record->text[ offset + length ] = string[ length ];
+			length++;
+		}
+	}
+	record->text[ offset + length ] = '\0';
+	record->textUsed = offset + length + 1;
+
+	LogValue value;
+	value.u = offset;
+	LogAppend( record, kLogTypeString, value );
+}
+
+static void WriteRecord( FILE* out, const LogRecord& record, uint32_t thread );
+
+void LogCommit( LogRecord* record )
+{
+	if ( !s_writerRunning.load( std::memory_order_acquire ) )
+	{
+		WriteRecord( stdout, *record, t_buffer->thread );
+		return;
+	}
+
+	t_buffer->tail.store( t_buffer->tail.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+}
+
+//-----------
+// Formatting
+//-----------
+
+static int64_t AsInteger( uint8_t type, const LogValue& value )
+{
+	return type == kLogTypeDouble ? (int64_t)value.d : value.i;
+}
+
+static double AsDouble( uint8_t type, const LogValue& value )
+{
+	switch ( type )
+	{
+	case kLogTypeDouble: return value.d;
+	case kLogTypeSigned: return (double)value.i;
+	case kLogTypeUnsigned: return (double)value.u;
+	default: return 0.0;
+	}
+}
+
+// Walks the format, handing each conversion to snprintf with the stored value.
+// Length modifiers are replaced to match how the value was stored.
+static size_t FormatMessage( const LogRecord& record, char* out, size_t size )
+{
+	const char* format = record.site->format;
+	size_t length = 0;
+	uint32_t arg = 0;
+	while ( *format && length + 1 < size )
+	{
+		if ( *format != '%' )
+		{
+			out[ length++ ] = *format++;
+			continue;
+		}
+		if ( format[ 1 ] == '%' )
+		{
+			out[ length++ ] = '%';
+			format += 2;
+			continue;
+		}
+
+		char spec[ 32 ];
+		uint32_t specLength = 0;
+		spec[ specLength++ ] = *format++;
+		while ( *format && strchr( "-+ #0123456789.", *format ) && specLength < 24 )
+		{
+			spec[ specLength++ ] = *format++;
+		}
+		while ( *format && strchr( "hljztL", *format ) )
+		{
+			format++;
+		}
+		char conversion = *format;
+		if ( !conversion || arg == record.argCount )
+		{
+			break;
+		}
+		format++;
+
+		uint8_t type = record.types[ arg ];
+		const LogValue& value = record.args[ arg++ ];
+		int written = 0;
+		switch ( conversion )
+		{
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			spec[ specLength++ ] = 'l';
+			spec[ specLength++ ] = 'l';
+			spec[ specLength++ ] = conversion;
+			spec[ specLength ] = '\0';
+			written = snprintf( out + length, size - length, spec, (long long)AsInteger( type, value ) );
+			break;
+		case 'c':
+			spec[ specLength++ ] = 'c';
+			spec[ specLength ] = '\0';
+			written = snprintf( out + length, size - length, spec, (int)AsInteger( type, value ) );
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			spec[ specLength++ ] = conversion;
+			spec[ specLength ] = '\0';
+			written = snprintf( out + length, size - length, spec, AsDouble( type, value ) );
+			break;
+		case 's':
+			spec[ specLength++ ] = 's';
+			spec[ specLength ] = '\0';
+			written = snprintf( out + length, size - length, spec, type == kLogTypeString ? record.text + value.u : "?" );
+			break;
+		case 'p':
+			spec[ specLength++ ] = 'p';
+			spec[ specLength ] = '\0';
+			written = snprintf( out + length, size - length, spec, value.p );
+			break;
+		default:
+			break;
+		}
+
+		if ( written > 0 )
+		{
+			length += std::min< size_t >( written, size - length - 1 );
+		}
+	}
+
+	// Formats written for printf often end in a newline; each record gets exactly one
+	while ( length > 0 && out[ length - 1 ] == '\n' )
+	{
+		length--;
+	}
+	out[ length ] = '\0';
+	return length;
+}
+
+static const char* const kLevelNames[] = { "info", "warning", "error" };
+
+static void WriteRecord( FILE* out, const LogRecord& record, uint32_t thread )
+{
+
+	char message[ 512 ];
+	FormatMessage( record, message, sizeof(message) );
+
+	double seconds = (int64_t)( record.time - s_startTime ) / 1e9;
+	if ( record.suppressed )
+	{
+		fprintf( out, "[%10.3f t%u] %s: %s (%u similar suppressed)\n", seconds, thread, kLevelNames[ record.site->level ], message, record.suppressed );
+	}
+	else
+	{
+		fprintf( out, "[%10.3f t%u] %s: %s\n", seconds, thread, kLevelNames[ record.site->level ], message );
+	}
+}
+
+//-----------
+// Writer
+//-----------
+
+struct PendingRecord
+{
+	uint64_t time;
+	const LogRecord* record;
+	uint32_t thread;
+
+	bool operator<( const PendingRecord& other ) const { return time < other.time; }
+};
+
+// Writes everything published so far in time order across threads, then
+// hands the slots back
+static void Drain( std::vector< PendingRecord >* pending, uint32_t* tails, bool final )
+{
+	uint32_t count = s_bufferCount.load( std::memory_order_acquire );
+	pending->clear();
+	for ( uint32_t i = 0; i < count; i++ )
+	{
+		LogBuffer* buffer = s_buffers[ i ];
+		tails[ i ] = buffer->tail.load( std::memory_order_acquire );
+		for ( uint32_t r = buffer->head.load( std::memory_order_relaxed ); r != tails[ i ]; r++ )
+		{
+			PendingRecord entry;
+			entry.record = &buffer->records[ r % kLogBufferRecords ];
+			entry.time = entry.record->time;
+			entry.thread = buffer->thread;
+			pending->push_back( entry );
+		}
+	}
+
+	std::stable_sort( pending->begin(), pending->end() );
+	for ( size_t i = 0; i < pending->size(); i++ )
+	{
+		WriteRecord( s_out, *(*pending)[ i ].record, (*pending)[ i ].thread );
+	}
+
+	for ( uint32_t i = 0; i < count; i++ )
+	{
+		uint64_t dropped = s_buffers[ i ]->dropped.exchange( 0, std::memory_order_relaxed );
+		if ( dropped )
+		{
+			fprintf( s_out, "[%10.3f t%u] warning: log buffer full, dropped %llu messages\n", (int64_t)( TraceNow() - s_startTime ) / 1e9, i, (unsigned long long)dropped );
+		}
+		s_buffers[ i ]->head.store( tails[ i ], std::memory_order_release );
+	}
+
+	// Counts for statements still being suppressed come out once per window,
+	// or straight away on the final drain
+	uint64_t now = TraceNow();
+	for ( LogSite* site = s_sites.load( std::memory_order_acquire ); site; site = site->next )
+	{
+		if ( !final && site->suppressedWindow.load( std::memory_order_relaxed ) == now / kLogWindowNs )
+		{
+			continue;
+		}
+		uint32_t suppressed = site->suppressed.exchange( 0, std::memory_order_relaxed );
+		if ( suppressed )
+		{
+			fprintf( s_out, "[%10.3f   ] %s: suppressed %u more of \"%s\"\n", (int64_t)( now - s_startTime ) / 1e9, kLevelNames[ site->level ], suppressed, site->format );
+		}
+	}
+
+	fflush( s_out );
+}
+
+static void WriterMain()
+{
+	std::vector< PendingRecord > pending;
+	pending.reserve( kLogBufferRecords );
+	uint32_t tails[ kMaxLogThreads ];
+
+	std::unique_lock< std::mutex > lock( s_writerMutex );
+	while ( !s_writerQuit )
+	{
+		lock.unlock();
+		Drain( &pending, tails, false );
+		lock.lock();
+		s_writerWake.wait_for( lock, kLogWriteInterval );
+	}
+	lock.unlock();
+
+	Drain( &pending, tails, true );
+}
+
+void LogStart( FILE* out )
+{
+	if ( s_writerRunning.load() )
+	{
+		return;
+	}
+
+	s_out = out;
+	s_writerQuit = false;
+	s_writer = std::thread( WriterMain );
+	s_writerRunning.store( true, std::memory_order_release );
+}
+
+void LogStop()
+{
+	if ( !s_writerRunning.load() )
+	{
+		return;
+	}
+
+	// New messages go straight out from here on, so the final drain catches
+	// everything that was queued
+	s_writerRunning.store( false, std::memory_order_release );
+	{
+		std::lock_guard< std::mutex > lock( s_writerMutex );
+		s_writerQuit = true;
+	}
+	s_writerWake.notify_all();
+	s_writer.join();
+}
+
+uint64_t LogDropped()
+{
+	return s_dropped.load( std::memory_order_relaxed );
+}
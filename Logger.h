@@ -0,0 +1,137 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+// Logging that is safe to call from a tick. A log statement copies its
+// arguments into a ring buffer owned by the calling thread and returns;
+// formatting and the stdio write happen later on a background writer thread.
+// A full ring drops the message and counts it rather than waiting, and each
+// statement is rate limited so an error repeated by every connection in a
+// reconnect storm prints a handful of times plus a count.
+//
+// Until LogStart is called messages are formatted and written straight away,
+// which keeps tools and benchmarks that never start the writer working. The
+// writer reports suppressed counts once a second; without it they are only
+// reported with the next message from the same statement.
+//
+//   LOG_ERROR( "Error sending, closing socket: %s", strerror( errno ) );
+//
+// Formats are printf formats and must be string literals. String arguments are
+// copied, so strerror and stack buffers are fine.
+
+enum LogLevel
+{
+	kLogInfo,
+	kLogWarning,
+	kLogError,
+};
+
+const uint32_t kLogMaxArgs = 8;
+const uint32_t kLogTextBytes = 128; // Shared by every string argument of a message
+
+// One per log statement
+struct LogSite
+{
+	const char* format;
+	LogLevel level;
+	std::atomic< uint64_t > window; // Rate limit window the count belongs to
+	std::atomic< uint32_t > count;
+	std::atomic< uint32_t > suppressed;
+	std::atomic< uint64_t > suppressedWindow;
+	std::atomic< bool > registered; // Sites that have suppressed anything are on a list the writer reports from
+	LogSite* next;
+};
+
+union LogValue
+{
+	int64_t i;
+	uint64_t u;
+	double d;
+	const void* p;
+};
+
+enum LogType : uint8_t
+{
+	kLogTypeSigned,
+	kLogTypeUnsigned,
+	kLogTypeDouble,
+	kLogTypeString, // u is an offset into text
+	kLogTypePointer,
+};
+
+struct LogRecord
+{
+	uint64_t time;
+	const LogSite* site;
+	uint32_t suppressed; // Messages from the same site rate limited and not yet reported
+	uint16_t textUsed;
+	uint8_t argCount;
+	uint8_t types[ kLogMaxArgs ];
+	LogValue args[ kLogMaxArgs ];
+	char text[ kLogTextBytes ];
+};
+
+// Returns a record to fill on this thread's ring, or null if the message is
+// rate limited or the ring is full
+LogRecord* LogBegin( LogSite* site );
+void LogCommit( LogRecord* record );
+
+void LogAppend( LogRecord* record, LogType type, LogValue value );
+void LogAppendString( LogRecord* record, const char* string );
+
+inline void LogArg( LogRecord* record, int value ) { LogValue v; v.i = value; LogAppend( record, kLogTypeSigned, v ); }
+inline void LogArg( LogRecord* record, long value ) { LogValue v; v.i = value; LogAppend( record, kLogTypeSigned, v ); }
+inline void LogArg( LogRecord* record, long long value ) { LogValue v; v.i = value; LogAppend( record, kLogTypeSigned, v ); }
+inline void LogArg( LogRecord* record, unsigned value ) { LogValue v; v.u = value; LogAppend( record, kLogTypeUnsigned, v ); }
+inline void LogArg( LogRecord* record, unsigned long value ) { LogValue v; v.u = value; LogAppend( record, kLogTypeUnsigned, v ); }
+inline void LogArg( LogRecord* record, unsigned long long value ) { LogValue v; v.u = value; LogAppend( record, kLogTypeUnsigned, v ); }
+inline void LogArg( LogRecord* record, double value ) { LogValue v; v.d = value; LogAppend( record, kLogTypeDouble, v ); }
+inline void LogArg( LogRecord* record, const void* value ) { LogValue v; v.p = value; LogAppend( record, kLogTypePointer, v ); }
+inline void LogArg( LogRecord* record, const char* value ) { LogAppendString( record, value ); }
+
+inline void LogArgs( LogRecord* ) {}
+
+template< class T, class... Args >
+inline void LogArgs( LogRecord* record, T value, Args... args )
+{
+	LogArg( record, value );
+	LogArgs( record, args... );
+}
+
+template< class... Args >
+inline void LogWrite( LogSite* site, Args... args )
+{
+	LogRecord* record = LogBegin( site );
+	if ( record )
+	{
+		LogArgs( record, args... );
+		LogCommit( record );
+	}
+}
+
+// The dead printf lets the compiler check the format against the arguments
+#define LOG( level, format, ... ) \
+	do \
+	{ \
+		static LogSite s_logSite = { format, level, { 0 }, { 0 }, { 0 }, { 0 }, { false }, nullptr }; \
+		if ( false ) printf( format, ##__VA_ARGS__ ); \
+		LogWrite( &s_logSite, ##__VA_ARGS__ ); \
+	} while ( 0 )
+
+#define LOG_INFO( format, ... ) LOG( kLogInfo, format, ##__VA_ARGS__ )
+#define LOG_WARNING( format, ... ) LOG( kLogWarning, format, ##__VA_ARGS__ )
+#define LOG_ERROR( format, ... ) LOG( kLogError, format, ##__VA_ARGS__ )
+
+// Starts the writer thread, which drains every ring to out a few times a frame
+void LogStart( FILE* out );
+
+// Writes anything still queued and stops the writer
+void LogStop();
+
+// Messages lost to full rings since startup
+uint64_t LogDropped();
+
+#endif
@@ -0,0 +1,193 @@
+#include "NetStats.h"
+#include "Socket.h"
+#include "Logger.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+const double kStatsReplySeconds = 1.0; // A reader slower than this is dropped
+
+static double StatsNow()
+{
+	return std::chrono::duration< double >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void StatsWriter::Printf( const char* format, ... )
+{
+	char buffer[ 512 ];
+	va_list args;
+	va_start( args, format );
+	int length = vsnprintf( buffer, sizeof(buffer), format, args );
+	va_end( args );
+
+	if ( length > 0 )
+	{
+		m_text.append( buffer, length < (int)sizeof(buffer) ? length : sizeof(buffer) - 1 );
+	}
+}
+
+bool StatsServer::Initialize( const char* path )
+{
+	for ( uint32_t i = 0; i < kMaxPendingReplies; i++ )
+	{
+		m_pending[ i ].reader = -1;
+	}
+
+	m_listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+	if ( m_listener < 0 )
+	{
+		LOG_ERROR( "Could not open stats socket: %s", strerror( errno ) );
+		return false;
+	}
+
+	sockaddr_un address;
+	memset( &address, 0, sizeof(address) );
+	address.sun_family = AF_UNIX;
+	strncpy( address.sun_path, path, sizeof(address.sun_path) - 1 );
+	strncpy( m_path, address.sun_path, sizeof(m_path) );
+
+	// A stale socket file from a previous run would make bind fail
+	unlink( m_path );
+	if ( bind( m_listener, (sockaddr*)&address, sizeof(address) ) != 0 || listen( m_listener, 4 ) != 0 )
+	{
+		LOG_ERROR( "Could not bind stats socket %s: %s", m_path, strerror( errno ) );
+		close( m_listener );
+		m_listener = -1;
+		return false;
+	}
+
+	fcntl( m_listener, F_SETFL, O_NONBLOCK );
+	LOG_INFO( "Serving stats on %s", m_path );
+	return true;
+}
+
+void StatsServer::Shutdown()
+{
+	for ( uint32_t i = 0; i < kMaxPendingReplies; i++ )
+	{
+		Drop( &m_pending[ i ] );
+	}
+
+	if ( m_listener != -1 )
+	{
+		close( m_listener );
+		unlink( m_path );
+		m_listener = -1;
+	}
+}
+
+int StatsServer::Accept()
+{
+	int reader = accept( m_listener, nullptr, nullptr );
+	if ( reader != -1 )
+	{
+		// Linux doesn't pass the listener's non-blocking flag on to accepted sockets
+		fcntl( reader, F_SETFL, O_NONBLOCK );
+#ifdef SO_NOSIGPIPE
+		int enable = 1;
+		setsockopt( reader, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable) );
+#endif
+	}
+	return reader;
+}
+
+void StatsServer::Reply( int reader, const StatsWriter& writer )
+{
+	PendingReply* reply = nullptr;
+	for ( uint32_t i = 0; i < kMaxPendingReplies && !reply; i++ )
+	{
+		reply = m_pending[ i ].reader == -1 ? &m_pending[ i ] : nullptr;
+	}
+	if ( !reply )
+	{
+		LOG_WARNING( "Too many stats readers, dropping one" );
+		close( reader );
+		return;
+	}
+
+	reply->reader = reader;
+	reply->text = writer.Text();
+	reply->sent = 0;
+	reply->deadline = StatsNow() + kStatsReplySeconds;
+	if ( Send( reply ) )
+	{
+		Drop( reply );
+	}
+}
+
+void StatsServer::Flush()
+{
+	double now = StatsNow();
+	for ( uint32_t i = 0; i < kMaxPendingReplies; i++ )
+	{
+		PendingReply* reply = &m_pending[ i ];
+		if ( reply->reader == -1 )
+		{
+			continue;
+		}
+
+		if ( Send( reply ) )
+		{
+			Drop( reply );
+		}
+		else if ( now >= reply->deadline )
+		{
+			LOG_WARNING( "Stats reader took %zu of %zu bytes in %.1f s, dropping it", reply->sent, reply->text.size(), kStatsReplySeconds );
+			Drop( reply );
+		}
+	}
+}
+
+// True once the reply is finished with, whether it was all sent or the reader went away
+bool StatsServer::Send( PendingReply* reply )
+{
+	while ( reply->sent < reply->text.size() )
+	{
+#ifdef MSG_NOSIGNAL
+		ssize_t bytes = send( reply->reader, reply->text.data() + reply->sent, reply->text.size() - reply->sent, MSG_NOSIGNAL );
+#else
+		ssize_t bytes = send( reply->reader, reply->text.data() + reply->sent, reply->text.size() - reply->sent, 0 );
+#endif
+		if ( bytes < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) )
+		{
+			return false;
+		}
+		if ( bytes <= 0 )
+		{
+			return true;
+		}
+		reply->sent += bytes;
+	}
+	return true;
+}
+
+void StatsServer::Drop( PendingReply* reply )
+{
+	if ( reply->reader != -1 )
+	{
+		close( reply->reader );
+		reply->reader = -1;
+		// Don't hold on to the largest document ever served
+		std::string().swap( reply->text );
+	}
+}
+
+void WriteConnectionStats( StatsWriter* writer, const ConnectionStats& stats, int sock )
+{
+	double ratio = stats.snapshotCompressedBytes ? (double)stats.snapshotRawBytes / stats.snapshotCompressedBytes : 0.0;
+	writer->Printf( "{\"bytesIn\":%llu,\"bytesOut\":%llu,\"messagesIn\":%llu,\"messagesOut\":%llu,"
+		"\"snapshotRawBytes\":%llu,\"snapshotCompressedBytes\":%llu,\"compressionRatio\":%.2f,"
+		"\"entitiesSent\":%llu,\"entitiesDeferred\":%llu,"
+		"\"sendQueueBytes\":%d,\"rttMs\":%.2f,\"lastRttMs\":%.2f}",
+		(unsigned long long)stats.bytesIn, (unsigned long long)stats.bytesOut,
+		(unsigned long long)stats.messagesIn, (unsigned long long)stats.messagesOut,
+		(unsigned long long)stats.snapshotRawBytes, (unsigned long long)stats.snapshotCompressedBytes, ratio,
+		(unsigned long long)stats.entitiesSent, (unsigned long long)stats.entitiesDeferred,
+		socket_send_queue_bytes( sock ), stats.rtt * 1000.0, stats.lastRtt * 1000.0 );
+}
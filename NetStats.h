@@ -0,0 +1,79 @@
+#ifndef NET_STATS_H
+#define NET_STATS_H
+
+#include <cstdint>
+#include <string>
+
+// Per-connection counters kept by the server. Updating them is a few adds per
+// message; they are only formatted when something reads the stats socket.
+struct ConnectionStats
+{
+	uint64_t bytesIn; // Including frame headers
+	uint64_t bytesOut;
+	uint64_t messagesIn;
+	uint64_t messagesOut;
+	uint64_t snapshotRawBytes; // Uncompressed size of every snapshot sent
+	uint64_t snapshotCompressedBytes;
+	uint64_t entitiesSent; // Entity updates snapshots carried
+	uint64_t entitiesDeferred; // Left for a later snapshot for lack of room
+
+	float rtt; // Smoothed round trip in seconds, 0 until the first pong
+	float lastRtt;
+	uint32_t pingId; // Outstanding ping, 0 if none
+	double pingSentAt;
+};
+
+// Accumulates a JSON document
+class StatsWriter
+{
+public:
+	void Printf( const char* format, ... ) __attribute__(( format( printf, 2, 3 ) ));
+	const std::string& Text() const { return m_text; }
+
+private:
+	std::string m_text;
+};
+
+// Serves stats over a Unix domain socket: a reader connects, gets one JSON
+// document and is disconnected, so `nc -U <path>` prints the current numbers.
+// Readers never block the caller: whatever a reply can't send at once is kept
+// and sent by later calls to Flush, and a reader that hasn't taken it all
+// within a second is dropped. While nobody connects this costs one
+// non-blocking accept per call.
+class StatsServer
+{
+public:
+	bool Initialize( const char* path );
+	void Shutdown();
+
+	// Returns a reader waiting for stats, or -1
+	int Accept();
+
+	// Sends what the reader will take now and keeps the rest for Flush
+	void Reply( int reader, const StatsWriter& writer );
+
+	// Call once per frame to carry on with replies still being sent
+	void Flush();
+
+private:
+	struct PendingReply
+	{
+		int reader; // -1 if the slot is free
+		std::string text;
+		size_t sent;
+		double deadline;
+	};
+
+	static const uint32_t kMaxPendingReplies = 4;
+
+	bool Send( PendingReply* reply );
+	void Drop( PendingReply* reply );
+
+	int m_listener;
+	char m_path[ 108 ];
+	PendingReply m_pending[ kMaxPendingReplies ];
+};
+
+void WriteConnectionStats( StatsWriter* writer, const ConnectionStats& stats, int sock );
+
+#endif
@@ -0,0 +1,138 @@
+#include "Profiler.h"
+#include <csignal>
+
+ProfileHistogram g_profileHistograms[ kProfilePhaseCount ];
+
+static const char* const kPhaseNames[ kProfilePhaseCount ] =
+{
+	"server tick",
+	"server accept",
+	"server recv",
+	"server ships",
+	"server asteroids+lasers",
+	"server collision",
+	"server delta",
+	"server compress",
+	"server send",
+	"client tick",
+	"client send",
+	"client recv",
+	"client decompress",
+	"client apply",
+	"client render",
+	"client swap",
+};
+
+static volatile sig_atomic_t s_dumpRequested = 0;
+static double s_dumpInterval = 0.0;
+static uint64_t s_lastDump = 0;
+
+const char* ProfilePhaseName( ProfilePhase phase )
+{
+	return kPhaseNames[ phase ];
+}
+
+uint64_t ProfileHistogram::Drain( uint64_t* countsOut )
+{
+	for ( uint32_t i = 0; i < kBuckets; i++ )
+	{
+		countsOut[ i ] = m_counts[ i ].exchange( 0, std::memory_order_relaxed );
+	}
+	return m_sum.exchange( 0, std::memory_order_relaxed );
+}
+
+uint64_t ProfileHistogram::BucketValue( uint32_t index )
+{
+	if ( index < kLinearBuckets )
+	{
+		return index;
+	}
+
+	uint32_t exponent = 5 + ( index - kLinearBuckets ) / kSubBuckets;
+	uint64_t sub = ( index - kLinearBuckets ) % kSubBuckets;
+	uint64_t width = 1ull << ( exponent - 4 );
+	return ( kSubBuckets + sub ) * width + width / 2;
+}
+
+static void ProfileSignalHandler( int )
+{
+	s_dumpRequested = 1;
+}
+
+void ProfileInstallSignalHandler()
+{
+	signal( SIGUSR1, ProfileSignalHandler );
+}
+
+void ProfileSetDumpInterval( double intervalSeconds )
+{
+	s_dumpInterval = intervalSeconds;
+	s_lastDump = ProfileNow();
+}
+
+void ProfilePoll( FILE* out )
+{
+	uint64_t now = ProfileNow();
+	bool due = s_dumpInterval > 0.0 && now - s_lastDump >= s_dumpInterval * 1e9;
+	if ( s_dumpRequested || due )
+	{
+		s_dumpRequested = 0;
+		s_lastDump = now;
+		ProfileDump( out );
+	}
+}
+
+static double Percentile( const uint64_t* counts, uint64_t total, double p )
+{
+	uint64_t target = (uint64_t)( total * p );
+	if ( target >= total )
+	{
+		target = total - 1;
+	}
+
+	uint64_t seen = 0;
+	for ( uint32_t i = 0; i < ProfileHistogram::kBuckets; i++ )
+	{
+		seen += counts[ i ];
+		if ( seen > target )
+		{
+			return ProfileHistogram::BucketValue( i ) / 1000.0;
+		}
+	}
+	return 0.0;
+}
+
+void ProfileDump( FILE* out )
+{
+	fprintf( out, "%-24s %10s %10s %10s %10s %10s %10s\n", "phase (us)", "count", "mean", "p50", "p99", "p999", "max" );
+
+	uint64_t counts[ ProfileHistogram::kBuckets ];
+	for ( uint32_t p = 0; p < kProfilePhaseCount; p++ )
+	{
+		uint64_t sum = g_profileHistograms[ p ].Drain( counts );
+		uint64_t total = 0;
+		uint32_t highest = 0;
+		for ( uint32_t i = 0; i < ProfileHistogram::kBuckets; i++ )
+		{
+			total += counts[ i ];
+			highest = counts[ i ] ? i : highest;
+		}
+		if ( total == 0 )
+		{
+			continue;
+		}
+
+		fprintf( out, "%-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", kPhaseNames[ p ], (unsigned long long)total, sum / 1000.0 / total,
+			Percentile( counts, total, 0.5 ), Percentile( counts, total, 0.99 ), Percentile( counts, total, 0.999 ), ProfileHistogram::BucketValue( highest ) / 1000.0 );
+	}
+	fflush( out );
+}
+
+void ProfileReset()
+{
+	uint64_t counts[ ProfileHistogram::kBuckets ];
+	for ( uint32_t p = 0; p < kProfilePhaseCount; p++ )
+	{
+		g_profileHistograms[ p ].Drain( counts );
+	}
+}
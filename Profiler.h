@@ -0,0 +1,143 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include "Tracer.h"
+
+// Always-on tick profiler. Each phase has a log-linear latency histogram (16
+// sub-buckets per power of two, so within ~6%) whose counters are updated with
+// relaxed atomics, which keeps recording to a clock read and two increments and
+// lets rooms on different threads share it. Phases also show up as spans in
+// trace captures.
+
+enum ProfilePhase
+{
+	kProfileServerTick,
+	kProfileServerAccept,
+	kProfileServerRecv,
+	kProfileServerShips,
+	kProfileServerAsteroidsAndLasers,
+	kProfileServerCollision,
+	kProfileServerDelta, // Per player
+	kProfileServerCompress, // Per player
+	kProfileServerSend, // Per player
+
+	kProfileClientTick,
+	kProfileClientSend,
+	kProfileClientRecv,
+	kProfileClientDecompress,
+	kProfileClientApply,
+	kProfileClientRender, // CPU side of submitting a frame, on the render thread
+	kProfileClientSwap, // Render thread waiting to present, mostly on vsync
+
+	kProfilePhaseCount
+};
+
+class ProfileHistogram
+{
+public:
+	static const uint32_t kLinearBuckets = 32;
+	static const uint32_t kSubBuckets = 16;
+	static const uint32_t kMaxExponent = 47; // ~39 hours in nanoseconds
+	static const uint32_t kBuckets = kLinearBuckets + ( kMaxExponent - 4 ) * kSubBuckets;
+
+	void Record( uint64_t ns )
+	{
+		m_counts[ BucketIndex( ns ) ].fetch_add( 1, std::memory_order_relaxed );
+		m_sum.fetch_add( ns, std::memory_order_relaxed );
+	}
+
+	// Moves the counts into countsOut and resets them, so nothing recorded
+	// concurrently is lost or counted twice. Returns the summed nanoseconds.
+	uint64_t Drain( uint64_t* countsOut );
+
+	static uint32_t BucketIndex( uint64_t ns );
+	static uint64_t BucketValue( uint32_t index ); // Midpoint of the bucket
+
+private:
+	std::atomic< uint64_t > m_counts[ kBuckets ];
+	std::atomic< uint64_t > m_sum;
+};
+
+inline uint32_t ProfileHistogram::BucketIndex( uint64_t ns )
+{
+	if ( ns < kLinearBuckets )
+	{
+		return (uint32_t)ns;
+	}
+
+	uint32_t exponent = 63 - __builtin_clzll( ns );
+	if ( exponent > kMaxExponent )
+	{
+		return kBuckets - 1;
+	}
+	uint32_t sub = ( ns >> ( exponent - 4 ) ) & ( kSubBuckets - 1 );
+	return kLinearBuckets + ( exponent - 5 ) * kSubBuckets + sub;
+}
+
+extern ProfileHistogram g_profileHistograms[ kProfilePhaseCount ];
+
+const char* ProfilePhaseName( ProfilePhase phase );
+
+inline uint64_t ProfileNow()
+{
+	return TraceNow();
+}
+
+inline void ProfileRecord( ProfilePhase phase, uint64_t startNs, uint64_t endNs )
+{
+	g_profileHistograms[ phase ].Record( endNs - startNs );
+	if ( TraceEnabled() )
+	{
+		TraceSpan( ProfilePhaseName( phase ), startNs, endNs );
+	}
+}
+
+// Times the enclosing scope
+class ProfileScope
+{
+public:
+	explicit ProfileScope( ProfilePhase phase ) : m_phase( phase ), m_start( ProfileNow() ) {}
+	~ProfileScope() { ProfileRecord( m_phase, m_start, ProfileNow() ); }
+
+private:
+	ProfilePhase m_phase;
+	uint64_t m_start;
+};
+
+// Times back-to-back phases: each Lap records the time since the previous one
+class ProfileTimer
+{
+public:
+	ProfileTimer() : m_last( ProfileNow() ) {}
+
+	void Lap( ProfilePhase phase )
+	{
+		uint64_t now = ProfileNow();
+		ProfileRecord( phase, m_last, now );
+		m_last = now;
+	}
+
+private:
+	uint64_t m_last;
+};
+
+// SIGUSR1 asks for a dump at the next ProfilePoll
+void ProfileInstallSignalHandler();
+
+// Dumps every intervalSeconds from ProfilePoll, 0 to dump only on request
+void ProfileSetDumpInterval( double intervalSeconds );
+
+// Call once per frame from the main loop
+void ProfilePoll( FILE* out );
+
+// Prints count, mean and p50/p99/p999/max per phase in microseconds, covering
+// everything recorded since the previous dump
+void ProfileDump( FILE* out );
+
+// Discards everything recorded so far
+void ProfileReset();
+
+#endif
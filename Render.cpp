@@ -0,0 +1,273 @@
+#include "Render.h"
+#include "Profiler.h"
+#include "Logger.h"
+
+#include <cassert>
+#include <cstddef>
+#if defined( __APPLE__ )
+#include <OpenGL/gl3.h>
+#else
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+#endif
+
+// Offsets into the mesh buffer
+const GLint kShipMeshFirst = 0;
+const GLint kAsteroidMeshFirst = 8;
+const GLsizei kMeshVertices = 8;
+
+const float kLaserScale = 0.5f;
+const float kLaserRotation = 0.5f;
+
+static GLuint s_program;
+static GLint s_invFrameSizeLocation = -1;
+static GLuint s_vao;
+static GLuint s_instanceBuffer;
+static RenderFrame s_frame; // For Render, which builds and draws in one go
+
+static bool CompileShader( GLuint shader, const char* source, const char* name )
+{
+	GLint success;
+	GLchar errorsBuf[ 256 ];
+	glShaderSource( shader, 1, &source, NULL );
+	glCompileShader( shader );
+	glGetShaderiv( shader, GL_COMPILE_STATUS, &success );
+	if ( !success )
+	{
+		glGetShaderInfoLog( shader, sizeof(errorsBuf), 0, errorsBuf );
+		LOG_ERROR( "%s shader errors:\n%s", name, errorsBuf );
+		return false;
+	}
+	return true;
+}
+
+static bool CreateProgram( GLuint* program )
+{
+	assert( program != nullptr );
+
+	// The instance transform is the model matrix's rotation and scale plus its
+	// translation, applied by hand rather than built into a mat3
+	const char* vertexShaderString = "\
+	#version 330\n \
+	layout(location = 0) in vec3 position; \
+	layout(location = 1) in vec4 transform; \
+	layout(location = 2) in vec4 instanceColor; \
+	uniform vec2 invFrameSize; \
+	out vec3 color; \
+	void main() \
+	{ \
+	vec2 pos = vec2( transform.x * position.x + transform.y * position.y, transform.x * position.y - transform.y * position.x ) + transform.zw; \
+	gl_Position = vec4( invFrameSize * pos, 0.0, 1.0 ); \
+	color = instanceColor.rgb; \
+	}";
+
+	const char* pixelShaderString = "\
+	#version 330\n \
+	in vec3 color; \
+	out vec4 outputColor; \
+	void main() \
+	{ \
+	outputColor = vec4( color, 1.0f ); \
+	} ";
+
+	GLuint vs = glCreateShader( GL_VERTEX_SHADER );
+	GLuint ps = glCreateShader( GL_FRAGMENT_SHADER );
+	if ( !CompileShader( vs, vertexShaderString, "Vertex" ) || !CompileShader( ps, pixelShaderString, "Pixel" ) )
+	{
+		return false;
+	}
+
+	GLint success;
+	GLchar errorsBuf[ 256 ];
+	GLuint prgm = glCreateProgram();
+	glAttachShader( prgm, vs );
+	glAttachShader( prgm, ps );
+	glLinkProgram( prgm );
+	glGetProgramiv( prgm, GL_LINK_STATUS, &success );
+	if ( !success )
+	{
+		glGetProgramInfoLog( prgm, sizeof(errorsBuf), 0, errorsBuf );
+		LOG_ERROR( "Program link errors:\n%s", errorsBuf );
+		return false;
+	}
+
+	*program = prgm;
+	return true;
+}
+
+bool RenderInit()
+{
+	if ( !CreateProgram( &s_program ) )
+	{
+		return false;
+	}
+	glUseProgram( s_program );
+	s_invFrameSizeLocation = glGetUniformLocation( s_program, "invFrameSize" );
+
+	glGenVertexArrays( 1, &s_vao );
+	glBindVertexArray( s_vao );
+
+	static const GLfloat verts[] = {
+		// Ship
+		0.0f, 1.0f, 1.0f,
+		-0.3f, 0.0f, 1.0f,
+		-0.3f, 0.0f, 1.0f,
+		0.0f,  0.2f, 1.0f,
+		0.0f,  0.2f, 1.0f,
+		0.3f,  0.0f, 1.0f,
+		0.3f,  0.0f, 1.0f,
+		0.0f, 1.0f, 1.0f,
+
+		// Asteroid 0
+		-0.5f, -0.5f, 1.0f,
+		-0.5f,  0.5f, 1.0f,
+		-0.5f,  0.5f, 1.0f,
+		0.5f,  0.5f, 1.0f,
+		0.5f,  0.5f, 1.0f,
+		0.5f, -0.5f, 1.0f,
+		0.5f, -0.5f, 1.0f,
+		-0.5f, -0.5f, 1.0f,
+	};
+
+	GLuint meshBuffer;
+	glGenBuffers( 1, &meshBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, meshBuffer );
+	glBufferData( GL_ARRAY_BUFFER, sizeof( verts ), verts, GL_STATIC_DRAW );
+	glEnableVertexAttribArray( 0 );
+	glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0 );
+
+	// Instance attributes step once per instance; their offsets are set per draw
+	glGenBuffers( 1, &s_instanceBuffer );
+	glBindBuffer( GL_ARRAY_BUFFER, s_instanceBuffer );
+	glBufferData( GL_ARRAY_BUFFER, kMaxRenderInstances * sizeof(RenderInstance), nullptr, GL_STREAM_DRAW );
+	glEnableVertexAttribArray( 1 );
+	glEnableVertexAttribArray( 2 );
+	glVertexAttribDivisor( 1, 1 );
+	glVertexAttribDivisor( 2, 1 );
+
+	return glGetError() == GL_NO_ERROR;
+}
+
+static void SetInstance( RenderInstance* instance, float scale, float sinA, float cosA, float x, float y, float r, float g, float b )
+{
+	instance->cosScale = cosA * scale;
+	instance->sinScale = sinA * scale;
+	instance->x = x;
+	instance->y = y;
+	instance->color[ 0 ] = r;
+	instance->color[ 1 ] = g;
+	instance->color[ 2 ] = b;
+	instance->color[ 3 ] = 1.0f;
+}
+
+template< class Capacity >
+void PackInstances( const GameState< Capacity >& gameState, RenderInstance* out, RenderBatches* batches )
+{
+	uint32_t n = 0;
+
+	const ShipArray< Capacity::kMaxShips >& ships = gameState.ships;
+	batches->ships.first = n;
+	for ( uint32_t k = 0; k < ships.count; k++ )
+	{
+		uint32_t i = ships.dense[ k ];
+		float other = ships.local[ i ] ? 0.0f : 1.0f; // The local ship is green, the rest white
+		SetInstance( &out[ n++ ], 1.0f, ships.directionX[ i ], ships.directionY[ i ], ships.positionX[ i ], ships.positionY[ i ], other, 1.0f, other );
+	}
+	batches->ships.count = n - batches->ships.first;
+
+	// Asteroids spin every tick, so evaluate their rotations 4 at a time
+	const AsteroidArray< Capacity::kMaxAsteroids >& asteroids = gameState.asteroids;
+	batches->asteroids.first = n;
+	for ( uint32_t k = 0; k < asteroids.count; k += 4 )
+	{
+		uint32_t lanes = asteroids.count - k < 4 ? asteroids.count - k : 4;
+		float4 rotation = splat4( 0.0f );
+		for ( uint32_t l = 0; l < lanes; l++ )
+		{
+			rotation[ l ] = asteroids.rotation[ asteroids.dense[ k + l ] ];
+		}
+		float4 sinA, cosA;
+		SinCos4( rotation, &sinA, &cosA );
+
+		for ( uint32_t l = 0; l < lanes; l++ )
+		{
+			uint32_t i = asteroids.dense[ k + l ];
+			SetInstance( &out[ n++ ], asteroids.size[ i ], sinA[ l ], cosA[ l ], asteroids.positionX[ i ], asteroids.positionY[ i ], 1.0f, 1.0f, 1.0f );
+		}
+	}
+	batches->asteroids.count = n - batches->asteroids.first;
+
+	const LaserArray< Capacity::kMaxLasers >& lasers = gameState.lasers;
+	float laserSin = sinf( kLaserRotation );
+	float laserCos = cosf( kLaserRotation );
+	batches->lasers.first = n;
+	for ( uint32_t k = 0; k < lasers.count; k++ )
+	{
+		uint32_t i = lasers.dense[ k ];
+		SetInstance( &out[ n++ ], kLaserScale, laserSin, laserCos, lasers.positionX[ i ], lasers.positionY[ i ], 1.0f, 1.0f, 1.0f );
+	}
+	batches->lasers.count = n - batches->lasers.first;
+}
+
+static void DrawBatch( const RenderBatch& batch, GLint meshFirst, RenderStats* stats )
+{
+	if ( !batch.count )
+	{
+		return;
+	}
+
+	size_t offset = batch.first * sizeof(RenderInstance);
+	glVertexAttribPointer( 1, 4, GL_FLOAT, GL_FALSE, sizeof(RenderInstance), (void*)offset );
+	glVertexAttribPointer( 2, 4, GL_FLOAT, GL_FALSE, sizeof(RenderInstance), (void*)( offset + offsetof( RenderInstance, color ) ) );
+	glDrawArraysInstanced( GL_LINES, meshFirst, kMeshVertices, batch.count );
+	stats->drawCalls++;
+}
+
+template< class Capacity >
+void BuildFrame( const GameState< Capacity >& gameState, int width, int height, RenderFrame* frame )
+{
+	frame->width = width;
+	frame->height = height;
+	PackInstances( gameState, frame->instances, &frame->batches );
+}
+
+RenderStats DrawFrame( const RenderFrame& frame )
+{
+	ProfileScope renderScope( kProfileClientRender );
+
+	RenderStats stats;
+	stats.drawCalls = 0;
+	stats.instances = frame.batches.lasers.first + frame.batches.lasers.count;
+
+	glClearColor( 0.0, 0.0, 0.0, 1.0 );
+	glClear( GL_COLOR_BUFFER_BIT );
+
+	glUseProgram( s_program );
+	glBindVertexArray( s_vao );
+	glUniform2f( s_invFrameSizeLocation, kGameScale / frame.width, kGameScale / frame.height );
+
+	// Respecifying the whole store lets the driver hand back fresh memory
+	// instead of waiting on draws still reading last frame's instances
+	glBindBuffer( GL_ARRAY_BUFFER, s_instanceBuffer );
+	glBufferData( GL_ARRAY_BUFFER, kMaxRenderInstances * sizeof(RenderInstance), nullptr, GL_STREAM_DRAW );
+	glBufferSubData( GL_ARRAY_BUFFER, 0, stats.instances * sizeof(RenderInstance), frame.instances );
+
+	DrawBatch( frame.batches.ships, kShipMeshFirst, &stats );
+	DrawBatch( frame.batches.asteroids, kAsteroidMeshFirst, &stats );
+	DrawBatch( frame.batches.lasers, kAsteroidMeshFirst, &stats );
+	return stats;
+}
+
+template< class Capacity >
+RenderStats Render( const GameState< Capacity >& gameState, int width, int height )
+{
+	BuildFrame( gameState, width, height, &s_frame );
+	return DrawFrame( s_frame );
+}
+
+template void PackInstances< StandardCapacity >( const GameState< StandardCapacity >&, RenderInstance*, RenderBatches* );
+template void PackInstances< LargeCapacity >( const GameState< LargeCapacity >&, RenderInstance*, RenderBatches* );
+template void BuildFrame< StandardCapacity >( const GameState< StandardCapacity >&, int, int, RenderFrame* );
+template void BuildFrame< LargeCapacity >( const GameState< LargeCapacity >&, int, int, RenderFrame* );
+template RenderStats Render< StandardCapacity >( const GameState< StandardCapacity >&, int, int );
+template RenderStats Render< LargeCapacity >( const GameState< LargeCapacity >&, int, int );
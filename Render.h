@@ -0,0 +1,76 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <cstdint>
+#include "Game.h"
+
+// Every entity is drawn as an instance of one of two line meshes. Each frame a
+// transform and colour per live entity is packed into one instance buffer,
+// uploaded in one go, and drawn with one instanced draw call per entity type,
+// so the GL work of a frame doesn't grow with the number of entities.
+
+// Rotation and scale as ( cos, sin ) * scale, then translation, then colour;
+// 32 bytes so instances stay aligned in the buffer
+struct RenderInstance
+{
+	float cosScale;
+	float sinScale;
+	float x;
+	float y;
+	float color[ 4 ]; // Alpha is unused
+};
+
+// A run of the instance buffer drawn with one mesh
+struct RenderBatch
+{
+	uint32_t first;
+	uint32_t count;
+};
+
+struct RenderBatches
+{
+	RenderBatch ships;
+	RenderBatch asteroids;
+	RenderBatch lasers;
+};
+
+struct RenderStats
+{
+	uint32_t drawCalls;
+	uint32_t instances;
+};
+
+const uint32_t kMaxRenderInstances = LargeCapacity::kMaxShips + LargeCapacity::kMaxAsteroids + LargeCapacity::kMaxLasers;
+
+// Everything needed to draw one frame, so a frame can be built from the game
+// state on one thread and drawn on another
+struct RenderFrame
+{
+	int width;
+	int height;
+	RenderBatches batches;
+	RenderInstance instances[ kMaxRenderInstances ];
+};
+
+// Creates the program, meshes and instance buffer. Needs a current GL 3.3 core
+// context; the instance buffer is sized for the largest capacity policy.
+bool RenderInit();
+
+// Writes one instance per live entity, ships then asteroids then lasers. out
+// must have room for kMaxShips + kMaxAsteroids + kMaxLasers instances.
+template< class Capacity >
+void PackInstances( const GameState< Capacity >& gameState, RenderInstance* out, RenderBatches* batches );
+
+// Packs the game state into a frame for a width by height framebuffer. Needs
+// no GL context.
+template< class Capacity >
+void BuildFrame( const GameState< Capacity >& gameState, int width, int height, RenderFrame* frame );
+
+// Uploads a frame's instances and draws it into the current framebuffer
+RenderStats DrawFrame( const RenderFrame& frame );
+
+// Builds and draws a frame on the calling thread
+template< class Capacity >
+RenderStats Render( const GameState< Capacity >& gameState, int width, int height );
+
+#endif
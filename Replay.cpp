@@ -0,0 +1,588 @@
+#include "Replay.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const size_t kReplayInitialBytes = 16 << 20;
+
+//-----------
+// Recorder
+//-----------
+
+bool ReplayRecorder::Open( const char* path, uint32_t keyframeBytes, uint32_t maxShips )
+{
+	m_file = open( path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+	if ( m_file < 0 )
+	{
+		LOG_ERROR( "Could not open replay %s: %s", path, strerror( errno ) );
+		return false;
+	}
+
+	m_map = nullptr;
+	m_mapBytes = 0;
+	m_size = 0;
+	m_keyframe = new uint8_t[ keyframeBytes ];
+	m_keyframeBytes = keyframeBytes;
+	m_keyframes = 0;
+	m_lastKeyframe = 0;
+	m_tick = 0;
+	m_frameTick = 0;
+	m_eventCount = 0;
+	m_index.clear();
+
+	ReplayFileHeader header;
+	header.magic = kReplayMagic;
+	header.version = kReplayVersion;
+	header.keyframeBytes = keyframeBytes;
+	header.maxShips = maxShips;
+	uint8_t* out = Reserve( sizeof(header) );
+	if ( !out )
+	{
+		Close();
+		return false;
+	}
+	memcpy( out, &header, sizeof(header) );
+	m_size += sizeof(header);
+
+	LOG_INFO( "Recording replay to %s", path );
+	return true;
+}
+
+void ReplayRecorder::Close()
+{
+	if ( m_file < 0 )
+	{
+		return;
+	}
+
+	if ( m_map )
+	{
+		FlushEvents();
+
+		ReplayTrailer trailer;
+		trailer.indexOffset = m_size;
+		trailer.magic = kReplayMagic;
+		trailer.reserved = 0;
+		WriteFrame( kReplayFrameIndex, m_tick, m_index.data(), m_index.size() * sizeof(ReplayIndexEntry) );
+		uint8_t* out = Reserve( sizeof(trailer) );
+		if ( out )
+		{
+			memcpy( out, &trailer, sizeof(trailer) );
+			m_size += sizeof(trailer);
+		}
+
+		munmap( m_map, m_mapBytes );
+		m_map = nullptr;
+	}
+
+	// The mapping grew ahead of the data; give the slack back
+	if ( ftruncate( m_file, m_size ) != 0 )
+	{
+		LOG_ERROR( "Could not trim replay: %s", strerror( errno ) );
+	}
+	close( m_file );
+	m_file = -1;
+
+	delete[] m_keyframe;
+	m_keyframe = nullptr;
+}
+
+void ReplayRecorder::RecordKeyframe( uint64_t tick )
+{
+	// Events before the keyframe go out first so a reader seeking to it starts
+	// on a frame boundary
+	FlushEvents();
+
+	ReplayIndexEntry entry;
+	entry.tick = tick;
+	entry.offset = m_size;
+	if ( WriteFrame( kReplayFrameKeyframe, tick, m_keyframe, m_keyframeBytes ) )
+	{
+		m_index.push_back( entry );
+		m_keyframes++;
+		m_lastKeyframe = tick;
+	}
+}
+
+void ReplayRecorder::RecordTick( uint64_t tick, float dt )
+{
+	m_tick = tick;
+
+	ReplayEvent event;
+	memset( &event, 0, sizeof(event) );
+	event.type = kReplayEventTick;
+	event.dt = dt;
+	Record( event );
+}
+
+void ReplayRecorder::RecordConnect( uint32_t slot )
+{
+	ReplayEvent event;
+	memset( &event, 0, sizeof(event) );
+	event.type = kReplayEventConnect;
+	event.slot = slot;
+	Record( event );
+}
+
+void ReplayRecorder::RecordInput( uint32_t slot, const Input& input )
+{
+	ReplayEvent event;
+	memset( &event, 0, sizeof(event) );
+	event.type = kReplayEventInput;
+	event.slot = slot;
+	memcpy( &event.input, &input, sizeof(input) );
+	Record( event );
+}
+
+void ReplayRecorder::RecordDisconnect( uint32_t slot, bool afterSend )
+{
+	ReplayEvent event;
+	memset( &event, 0, sizeof(event) );
+	event.type = afterSend ? kReplayEventSendFailed : kReplayEventDisconnect;
+	event.slot = slot;
+	Record( event );
+}
+
+void ReplayRecorder::Record( const ReplayEvent& event )
+{
+	if ( m_eventCount == 0 )
+	{
+		m_frameTick = m_tick;
+	}
+
+	m_events[ m_eventCount++ ] = event;
+	if ( m_eventCount == kReplayEventsPerFrame )
+	{
+		FlushEvents();
+	}
+}
+
+void ReplayRecorder::FlushEvents()
+{
+	if ( m_eventCount )
+	{
+		WriteFrame( kReplayFrameEvents, m_frameTick, m_events, m_eventCount * sizeof(ReplayEvent) );
+		m_eventCount = 0;
+	}
+}
+
+bool ReplayRecorder::WriteFrame( uint32_t type, uint64_t tick, const void* raw, uint32_t rawBytes )
+{
+	uint32_t bound = LZ4_compressBound( rawBytes );
+	uint8_t* out = Reserve( sizeof(ReplayFrame) + bound );
+	if ( !out )
+	{
+		return false;
+	}
+
+	// Compress in place, then fill in the header in front of it
+	int compressed = LZ4_compress_default( (const char*)raw, (char*)out + sizeof(ReplayFrame), rawBytes, bound );
+	if ( compressed <= 0 && rawBytes > 0 )
+	{
+		LOG_ERROR( "Could not compress replay frame of %u bytes", rawBytes );
+		return false;
+	}
+
+	ReplayFrame frame;
+	frame.type = type;
+	frame.rawBytes = rawBytes;
+	frame.compressedBytes = compressed;
+	frame.reserved = 0;
+	frame.tick = tick;
+	memcpy( out, &frame, sizeof(frame) );
+	m_size += sizeof(frame) + compressed;
+	return true;
+}
+
+uint8_t* ReplayRecorder::Reserve( size_t bytes )
+{
+	if ( !m_map || m_size + bytes > m_mapBytes )
+	{
+		size_t mapBytes = m_mapBytes ? m_mapBytes : kReplayInitialBytes;
+		while ( m_size + bytes > mapBytes )
+		{
+			mapBytes *= 2;
+		}
+
+		if ( m_map )
+		{
+			munmap( m_map, m_mapBytes );
+			m_map = nullptr;
+		}
+
+		void* map = MAP_FAILED;
+		if ( ftruncate( m_file, mapBytes ) == 0 )
+		{
+			map = mmap( nullptr, mapBytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, 0 );
+		}
+		if ( map == MAP_FAILED )
+		{
+			LOG_ERROR( "Could not grow replay to %zu bytes: %s", mapBytes, strerror( errno ) );
+			m_mapBytes = 0;
+			return nullptr;
+		}
+
+		m_map = (uint8_t*)map;
+		m_mapBytes = mapBytes;
+	}
+	return m_map + m_size;
+}
+
+//-----------
+// Reader
+//-----------
+
+bool ReplayReader::Open( const char* path )
+{
+	m_map = nullptr;
+	m_index.clear();
+	m_cursor = 0;
+	m_skipped = false;
+	m_eventCount = 0;
+	m_eventIndex = 0;
+
+	m_file = open( path, O_RDONLY );
+	if ( m_file < 0 )
+	{
+		LOG_ERROR( "Could not open replay %s: %s", path, strerror( errno ) );
+		return false;
+	}
+
+	struct stat info;
+	if ( fstat( m_file, &info ) != 0 || info.st_size < (off_t)sizeof(ReplayFileHeader) )
+	{
+		LOG_ERROR( "Replay %s is too short", path );
+		Close();
+		return false;
+	}
+
+	m_size = info.st_size;
+	void* map = mmap( nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0 );
+	if ( map == MAP_FAILED )
+	{
+		LOG_ERROR( "Could not map replay %s: %s", path, strerror( errno ) );
+		Close();
+		return false;
+	}
+	m_map = (const uint8_t*)map;
+
+	memcpy( &m_header, m_map, sizeof(m_header) );
+	if ( m_header.magic != kReplayMagic || m_header.version != kReplayVersion )
+	{
+		LOG_ERROR( "%s is not a replay this build can read", path );
+		Close();
+		return false;
+	}
+
+	BuildIndex();
+	if ( m_index.empty() )
+	{
+		LOG_ERROR( "Replay %s has no keyframes", path );
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void ReplayReader::Close()
+{
+	if ( m_map )
+	{
+		munmap( (void*)m_map, m_size );
+		m_map = nullptr;
+	}
+	if ( m_file >= 0 )
+	{
+		close( m_file );
+		m_file = -1;
+	}
+}
+
+bool ReplayReader::ReadFrameHeader( uint64_t offset, ReplayFrame* frame ) const
+{
+	if ( offset + sizeof(ReplayFrame) > m_size )
+	{
+		return false;
+	}
+	memcpy( frame, m_map + offset, sizeof(*frame) );
+	return frame->type >= kReplayFrameEvents && frame->type <= kReplayFrameIndex &&
+		offset + sizeof(ReplayFrame) + frame->compressedBytes <= m_size;
+}
+
+void ReplayReader::BuildIndex()
+{
+	ReplayTrailer trailer;
+	ReplayFrame frame;
+	if ( m_size >= sizeof(ReplayFileHeader) + sizeof(trailer) )
+	{
+		memcpy( &trailer, m_map + m_size - sizeof(trailer), sizeof(trailer) );
+		if ( trailer.magic == kReplayMagic && ReadFrameHeader( trailer.indexOffset, &frame ) && frame.type == kReplayFrameIndex &&
+			frame.rawBytes % sizeof(ReplayIndexEntry) == 0 )
+		{
+			m_index.resize( frame.rawBytes / sizeof(ReplayIndexEntry) );
+			int bytes = LZ4_decompress_safe( (const char*)m_map + trailer.indexOffset + sizeof(frame), (char*)m_index.data(), frame.compressedBytes, frame.rawBytes );
+			if ( bytes == (int)frame.rawBytes )
+			{
+				return;
+			}
+			m_index.clear();
+		}
+	}
+
+	// No usable index, most likely because the recording server died; every
+	// complete frame is still good
+	LOG_WARNING( "Replay has no index, scanning for keyframes" );
+	for ( uint64_t offset = sizeof(ReplayFileHeader); ReadFrameHeader( offset, &frame ); offset += sizeof(frame) + frame.compressedBytes )
+	{
+		if ( frame.type == kReplayFrameKeyframe )
+		{
+			ReplayIndexEntry entry;
+			entry.tick = frame.tick;
+			entry.offset = offset;
+			m_index.push_back( entry );
+		}
+	}
+}
+
+bool ReplayReader::ReadKeyframe( const ReplayIndexEntry& entry, void* out )
+{
+	ReplayFrame frame;
+	if ( !ReadFrameHeader( entry.offset, &frame ) || frame.type != kReplayFrameKeyframe || frame.rawBytes != m_header.keyframeBytes )
+	{
+		return false;
+	}
+
+	int bytes = LZ4_decompress_safe( (const char*)m_map + entry.offset + sizeof(frame), (char*)out, frame.compressedBytes, frame.rawBytes );
+	return bytes == (int)frame.rawBytes;
+}
+
+void ReplayReader::SeekPast( const ReplayIndexEntry& entry )
+{
+	ReplayFrame frame;
+	m_cursor = ReadFrameHeader( entry.offset, &frame ) ? entry.offset + sizeof(frame) + frame.compressedBytes : m_size;
+	m_skipped = false;
+	m_eventCount = 0;
+	m_eventIndex = 0;
+}
+
+bool ReplayReader::NextEvent( ReplayEvent* event )
+{
+	while ( m_eventIndex == m_eventCount )
+	{
+		ReplayFrame frame;
+		if ( !ReadFrameHeader( m_cursor, &frame ) || frame.type == kReplayFrameIndex )
+		{
+			return false;
+		}
+
+		uint64_t offset = m_cursor;
+		m_cursor += sizeof(frame) + frame.compressedBytes;
+		if ( frame.type == kReplayFrameKeyframe )
+		{
+			m_skipped = true;
+			m_skippedKeyframe.tick = frame.tick;
+			m_skippedKeyframe.offset = offset;
+			continue;
+		}
+
+		if ( frame.rawBytes > sizeof(m_events) || frame.rawBytes % sizeof(ReplayEvent) != 0 ||
+			LZ4_decompress_safe( (const char*)m_map + offset + sizeof(frame), (char*)m_events, frame.compressedBytes, frame.rawBytes ) != (int)frame.rawBytes )
+		{
+			LOG_ERROR( "Corrupt replay event frame at offset %llu", (unsigned long long)offset );
+			return false;
+		}
+		m_eventCount = frame.rawBytes / sizeof(ReplayEvent);
+		m_eventIndex = 0;
+	}
+
+	*event = m_events[ m_eventIndex++ ];
+	return true;
+}
+
+bool ReplayReader::TakeSkippedKeyframe( ReplayIndexEntry* entry )
+{
+	if ( !m_skipped )
+	{
+		return false;
+	}
+	*entry = m_skippedKeyframe;
+	m_skipped = false;
+	return true;
+}
+
+//-----------
+// Player
+//-----------
+
+template< class Capacity >
+bool ReplayPlayer< Capacity >::Open( const char* path, JobSystem* jobs )
+{
+	m_state = nullptr;
+	m_server = nullptr;
+	m_expected = nullptr;
+	m_actual = nullptr;
+	if ( !m_reader.Open( path ) )
+	{
+		return false;
+	}
+
+	if ( m_reader.Header().keyframeBytes != sizeof(ServerKeyframe< Capacity >) || m_reader.Header().maxShips != Capacity::kMaxShips )
+	{
+		LOG_ERROR( "Replay %s was recorded with a different capacity policy", path );
+		m_reader.Close();
+		return false;
+	}
+
+	m_state = new GameState< Capacity >();
+	m_server = new GameServer< Capacity >();
+	m_server->Initialize( -1, m_state, jobs );
+	m_expected = new ServerKeyframe< Capacity >();
+	m_actual = new ServerKeyframe< Capacity >();
+	m_checked = 0;
+	m_mismatches = 0;
+
+	return Seek( 0 );
+}
+
+template< class Capacity >
+void ReplayPlayer< Capacity >::Close()
+{
+	m_reader.Close();
+	delete m_actual;
+	delete m_expected;
+	delete m_server;
+	delete m_state;
+	m_actual = nullptr;
+	m_expected = nullptr;
+	m_server = nullptr;
+	m_state = nullptr;
+}
+
+template< class Capacity >
+bool ReplayPlayer< Capacity >::Seek( uint64_t tick )
+{
+	const std::vector< ReplayIndexEntry >& keyframes = m_reader.Keyframes();
+	uint32_t k = 0;
+	while ( k + 1 < keyframes.size() && keyframes[ k + 1 ].tick <= tick )
+	{
+		k++;
+	}
+
+	if ( !m_reader.ReadKeyframe( keyframes[ k ], m_expected ) )
+	{
+		LOG_ERROR( "Could not read keyframe for tick %llu", (unsigned long long)keyframes[ k ].tick );
+		return false;
+	}
+	m_server->LoadKeyframe( *m_expected );
+	m_reader.SeekPast( keyframes[ k ] );
+	m_peeked = false;
+
+	while ( m_server->Tick() < tick )
+	{
+		if ( !Step() )
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+template< class Capacity >
+bool ReplayPlayer< Capacity >::Step()
+{
+	ReplayEvent event;
+	do
+	{
+		if ( !Peek( &event ) )
+		{
+			return false;
+		}
+		m_peeked = false;
+	} while ( event.type != kReplayEventTick );
+
+	ReplayIndexEntry keyframe;
+	if ( m_reader.TakeSkippedKeyframe( &keyframe ) )
+	{
+		Check( keyframe );
+	}
+
+	// Sends come last in a server tick, so sockets that failed to send are
+	// dropped after the simulation has run
+	ReplayEvent next;
+	while ( Peek( &next ) && next.type != kReplayEventTick && next.type != kReplayEventSendFailed )
+	{
+		Apply( next );
+		m_peeked = false;
+	}
+
+	m_server->Update( event.dt );
+
+	while ( Peek( &next ) && next.type == kReplayEventSendFailed )
+	{
+		Apply( next );
+		m_peeked = false;
+	}
+	return true;
+}
+
+template< class Capacity >
+bool ReplayPlayer< Capacity >::Peek( ReplayEvent* event )
+{
+	if ( !m_peeked )
+	{
+		if ( !m_reader.NextEvent( &m_next ) )
+		{
+			return false;
+		}
+		m_peeked = true;
+	}
+	*event = m_next;
+	return true;
+}
+
+template< class Capacity >
+void ReplayPlayer< Capacity >::Apply( const ReplayEvent& event )
+{
+	if ( event.slot >= Capacity::kMaxShips )
+	{
+		return;
+	}
+
+	switch ( event.type )
+	{
+	case kReplayEventConnect:
+		m_server->ReplayConnect( event.slot );
+		break;
+	case kReplayEventInput:
+		m_server->ReplayInput( event.slot, event.input );
+		break;
+	case kReplayEventDisconnect:
+	case kReplayEventSendFailed:
+		m_server->ReplayDisconnect( event.slot );
+		break;
+	}
+}
+
+template< class Capacity >
+void ReplayPlayer< Capacity >::Check( const ReplayIndexEntry& entry )
+{
+	if ( !m_reader.ReadKeyframe( entry, m_expected ) )
+	{
+		return;
+	}
+
+	m_server->SaveKeyframe( m_actual );
+	m_checked++;
+	if ( memcmp( m_expected, m_actual, sizeof(*m_actual) ) != 0 )
+	{
+		m_mismatches++;
+		LOG_WARNING( "Replay diverged from the recording by tick %llu", (unsigned long long)entry.tick );
+	}
+}
+
+template class ReplayPlayer< StandardCapacity >;
+template class ReplayPlayer< LargeCapacity >;
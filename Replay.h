@@ -0,0 +1,194 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <cstdint>
+#include <vector>
+#include "Game.h"
+
+// Replay files record a server match so it can be re-simulated offline. The
+// file is an append-only log of LZ4 frames written through a memory mapping:
+// event frames hold every tick's dt and the connects, inputs and disconnects
+// the server saw, and every kReplayKeyframeTicks a keyframe frame holds the
+// whole simulation state. A closed file ends with an index of keyframes; a
+// file cut short by a crash is still readable and is indexed by scanning it.
+
+const uint32_t kReplayMagic = 0x504A5352; // "RSJP"
+const uint32_t kReplayVersion = 6;
+const uint32_t kReplayKeyframeTicks = 600;
+const uint32_t kReplayEventsPerFrame = 2048;
+
+enum ReplayFrameType
+{
+	kReplayFrameEvents = 1,
+	kReplayFrameKeyframe,
+	kReplayFrameIndex,
+};
+
+enum ReplayEventType : uint8_t
+{
+	kReplayEventTick = 1,
+	kReplayEventConnect,
+	kReplayEventInput,
+	kReplayEventDisconnect, // Socket failed while receiving
+	kReplayEventSendFailed, // Socket failed while sending, after the simulation ran
+};
+
+struct ReplayFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t keyframeBytes; // Differs between capacity policies
+	uint32_t maxShips;
+};
+
+struct ReplayFrame
+{
+	uint32_t type;
+	uint32_t rawBytes;
+	uint32_t compressedBytes;
+	uint32_t reserved;
+	uint64_t tick; // First tick the frame covers
+};
+
+struct ReplayEvent
+{
+	uint8_t type;
+	uint8_t slot;
+	uint16_t reserved;
+	float dt; // Tick events only
+	Input input; // Input events only
+};
+
+struct ReplayIndexEntry
+{
+	uint64_t tick;
+	uint64_t offset; // Of the keyframe's frame header
+};
+
+struct ReplayTrailer
+{
+	uint64_t indexOffset;
+	uint32_t magic;
+	uint32_t reserved;
+};
+
+// Written to from the server tick. Events are batched and compressed a frame
+// at a time straight into the mapping; the file grows by doubling.
+class ReplayRecorder
+{
+public:
+	bool Open( const char* path, uint32_t keyframeBytes, uint32_t maxShips );
+	void Close();
+
+	// A keyframe is due on the first tick recorded and every kReplayKeyframeTicks after
+	bool KeyframeDue( uint64_t tick ) const { return !m_keyframes || tick >= m_lastKeyframe + kReplayKeyframeTicks; }
+
+	// Fill the buffer with the server's keyframe, then record it
+	void* KeyframeBuffer() { return m_keyframe; }
+	void RecordKeyframe( uint64_t tick );
+
+	void RecordTick( uint64_t tick, float dt );
+	void RecordConnect( uint32_t slot );
+	void RecordInput( uint32_t slot, const Input& input );
+	void RecordDisconnect( uint32_t slot, bool afterSend );
+
+private:
+	void Record( const ReplayEvent& event );
+	void FlushEvents();
+	bool WriteFrame( uint32_t type, uint64_t tick, const void* raw, uint32_t rawBytes );
+	uint8_t* Reserve( size_t bytes );
+
+	int m_file;
+	uint8_t* m_map;
+	size_t m_mapBytes;
+	size_t m_size;
+
+	uint8_t* m_keyframe;
+	uint32_t m_keyframeBytes;
+	uint32_t m_keyframes;
+	uint64_t m_lastKeyframe;
+
+	uint64_t m_tick;
+	uint64_t m_frameTick;
+	uint32_t m_eventCount;
+	ReplayEvent m_events[ kReplayEventsPerFrame ];
+	std::vector< ReplayIndexEntry > m_index;
+};
+
+// Maps a replay file read-only and walks its events
+class ReplayReader
+{
+public:
+	bool Open( const char* path );
+	void Close();
+
+	const ReplayFileHeader& Header() const { return m_header; }
+	const std::vector< ReplayIndexEntry >& Keyframes() const { return m_index; }
+
+	bool ReadKeyframe( const ReplayIndexEntry& entry, void* out );
+
+	// Continues reading events from the frame after the given keyframe
+	void SeekPast( const ReplayIndexEntry& entry );
+
+	// Keyframes between events are skipped over; the last one is remembered so
+	// playback can check itself against it
+	bool NextEvent( ReplayEvent* event );
+	bool TakeSkippedKeyframe( ReplayIndexEntry* entry );
+
+private:
+	bool ReadFrameHeader( uint64_t offset, ReplayFrame* frame ) const;
+	void BuildIndex();
+
+	int m_file;
+	const uint8_t* m_map;
+	size_t m_size;
+	ReplayFileHeader m_header;
+	std::vector< ReplayIndexEntry > m_index;
+
+	uint64_t m_cursor;
+	bool m_skipped;
+	ReplayIndexEntry m_skippedKeyframe;
+	uint32_t m_eventCount;
+	uint32_t m_eventIndex;
+	ReplayEvent m_events[ kReplayEventsPerFrame ];
+};
+
+// Drives a GameServer from a replay file, headless and as fast as it's asked
+// to step. Every keyframe passed along the way is compared with the state the
+// replay produced, so a build that simulates differently is caught.
+template< class Capacity >
+class ReplayPlayer
+{
+public:
+	bool Open( const char* path, JobSystem* jobs );
+	void Close();
+
+	// Loads the last keyframe at or before tick and plays forward to it
+	bool Seek( uint64_t tick );
+
+	// Runs one recorded tick; false at the end of the recording
+	bool Step();
+
+	uint64_t Tick() const { return m_server->Tick(); }
+	const GameState< Capacity >& State() const { return *m_state; }
+	uint32_t KeyframesChecked() const { return m_checked; }
+	uint32_t Mismatches() const { return m_mismatches; }
+
+private:
+	bool Peek( ReplayEvent* event );
+	void Apply( const ReplayEvent& event );
+	void Check( const ReplayIndexEntry& entry );
+
+	ReplayReader m_reader;
+	GameState< Capacity >* m_state;
+	GameServer< Capacity >* m_server;
+	ServerKeyframe< Capacity >* m_expected;
+	ServerKeyframe< Capacity >* m_actual;
+
+	bool m_peeked;
+	ReplayEvent m_next;
+	uint32_t m_checked;
+	uint32_t m_mismatches;
+};
+
+#endif
@@ -0,0 +1,369 @@
+#include "RoomManager.h"
+#include <cstring>
+#include "Socket.h"
+#include "Logger.h"
+
+#include <cerrno>
+#include <unistd.h>
+
+// Clients that don't ask for a room still send input straight away, so waiting
+// longer than this only delays a silent client
+const float kHandshakeTimeout = 1.0f;
+
+// An empty room is kept this long for its players to come back before its
+// memory is given back
+const float kEmptyRoomSeconds = 30.0f;
+
+const float kHandshakeReplyTimeout = 2.0f;
+const uint32_t kShardAttempts = 2; // Per shard, so every port residue gets tried
+
+int ConnectToRoom( const char* hostname, uint16_t port, uint32_t room, uint32_t shardCount )
+{
+	shardCount = shardCount ? shardCount : 1;
+	for ( uint32_t attempt = 0; attempt < shardCount * kShardAttempts; attempt++ )
+	{
+		// The residue that should reach the room's shard first, then the others in
+		// case the shards joined the listener group in a different order
+		uint32_t shard = ( room + attempt ) % shardCount;
+		int sock = socket_client_connect_shard( hostname, port, shard, shardCount );
+
+		Handshake handshake;
+		handshake.magic = kHandshakeMagic;
+		handshake.room = room;
+		if ( socket_send_msg( sock, &handshake, sizeof(handshake) ) != sizeof(handshake) )
+		{
+			LOG_ERROR( "Could not send handshake for room %u", room );
+			return -1;
+		}
+
+		HandshakeReply reply;
+		int recvd = 0;
+		for ( float waited = 0.0f; recvd == 0 && waited < kHandshakeReplyTimeout; waited += 0.001f )
+		{
+			recvd = socket_recv_msg( sock, &reply, sizeof(reply) );
+			if ( recvd == 0 )
+			{
+				usleep( 1000 );
+			}
+		}
+		if ( recvd != sizeof(reply) || reply.magic != kHandshakeMagic )
+		{
+			LOG_ERROR( "Server didn't answer the handshake for room %u", room );
+			if ( recvd >= 0 )
+			{
+				close( sock );
+			}
+			return -1;
+		}
+
+		if ( reply.result == kHandshakeSeated )
+		{
+			return sock;
+		}
+
+		close( sock );
+		if ( reply.result != kHandshakeWrongShard )
+		{
+			LOG_ERROR( "Room %u %s", room, reply.result == kHandshakeRoomFull ? "is full" : "doesn't exist" );
+			return -1;
+		}
+		LOG_WARNING( "Port residue %u reached shard %u instead of %u, retrying", shard, reply.shard, room % shardCount );
+	}
+
+	LOG_ERROR( "Could not reach the shard hosting room %u; is a NAT rewriting source ports?", room );
+	return -1;
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::Initialize( int listener, uint32_t playersPerRoom, JobSystem* jobs, uint32_t shard, uint32_t shardCount )
+{
+	memset( this, 0, sizeof(*this) );
+	m_listener = listener;
+	m_jobs = jobs;
+
+	m_playersPerRoom = playersPerRoom;
+	if ( m_playersPerRoom == 0 || m_playersPerRoom > Capacity::kMaxShips )
+	{
+		m_playersPerRoom = Capacity::kMaxShips;
+	}
+
+	m_shardCount = shardCount ? shardCount : 1;
+	m_shard = shard % m_shardCount;
+	m_maxRewind = kDefaultMaxRewindTicks;
+	m_rateLimits = kDefaultSnapshotRateLimits;
+	m_snapshotEntityBytes = kDefaultSnapshotEntityBytes;
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::Shutdown()
+{
+	for ( uint32_t i = 0; i < m_pendingCount; i++ )
+	{
+		close( m_pending[ i ].socket );
+	}
+	m_pendingCount = 0;
+
+	for ( uint32_t i = 0; i < m_roomCount; i++ )
+	{
+		delete m_rooms[ i ].server;
+		delete m_rooms[ i ].gameState;
+	}
+	m_roomCount = 0;
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::Update( float dt )
+{
+	// Rooms only touch their own state while ticking, so connections are routed
+	// here on the calling thread while no room is running
+	while ( m_pendingCount < kMaxPending )
+	{
+		int sock = socket_server_accept( m_listener );
+		if ( sock < 0 )
+		{
+			break;
+		}
+
+		m_pending[ m_pendingCount ].socket = sock;
+		m_pending[ m_pendingCount ].time = 0.0f;
+		m_pendingCount++;
+	}
+	UpdatePending( dt );
+
+	for ( uint32_t i = 0; i < m_roomCount; i++ )
+	{
+		Room* room = &m_rooms[ i ];
+		if ( room->server )
+		{
+			room->emptyTime = room->server->PlayerCount() > 0 ? 0.0f : room->emptyTime + dt;
+			if ( room->emptyTime > kEmptyRoomSeconds )
+			{
+				CloseRoom( i );
+			}
+		}
+	}
+
+	for ( uint32_t p = 0; p < kTickPhases; p++ )
+	{
+		m_phaseTime[ p ] += dt;
+	}
+
+	m_tickDt = m_phaseTime[ m_phase ];
+	m_phaseTime[ m_phase ] = 0.0f;
+
+	// Empty rooms are left paused until someone joins or they are closed
+	m_dueCount = 0;
+	for ( uint32_t i = m_phase; i < m_roomCount; i += kTickPhases )
+	{
+		if ( m_rooms[ i ].server && m_rooms[ i ].server->PlayerCount() > 0 )
+		{
+			m_due[ m_dueCount++ ] = i;
+		}
+	}
+
+	m_jobs->ParallelFor( m_dueCount, 1, &TickJob, this );
+
+	m_phase = ( m_phase + 1 ) % kTickPhases;
+}
+
+template< class Capacity >
+uint32_t RoomManager< Capacity >::RoomCount() const
+{
+	uint32_t count = 0;
+	for ( uint32_t i = 0; i < m_roomCount; i++ )
+	{
+		if ( m_rooms[ i ].server )
+		{
+			count++;
+		}
+	}
+	return count;
+}
+
+template< class Capacity >
+uint32_t RoomManager< Capacity >::PlayerCount() const
+{
+	uint32_t count = 0;
+	for ( uint32_t i = 0; i < m_roomCount; i++ )
+	{
+		if ( m_rooms[ i ].server )
+		{
+			count += m_rooms[ i ].server->PlayerCount();
+		}
+	}
+	return count;
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::WriteStats( StatsWriter* writer ) const
+{
+	bool first = true;
+	for ( uint32_t i = 0; i < m_roomCount; i++ )
+	{
+		if ( m_rooms[ i ].server )
+		{
+			writer->Printf( "%s{\"room\":%u,\"players\":", first ? "" : ",", RoomId( i ) );
+			m_rooms[ i ].server->WriteStats( writer );
+			writer->Printf( "}" );
+			first = false;
+		}
+	}
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::TickJob( void* data, uint32_t begin, uint32_t end )
+{
+	RoomManager< Capacity >* manager = (RoomManager< Capacity >*)data;
+	for ( uint32_t k = begin; k < end; k++ )
+	{
+		manager->m_rooms[ manager->m_due[ k ] ].server->Update( manager->m_tickDt );
+	}
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::UpdatePending( float dt )
+{
+	for ( uint32_t i = 0; i < m_pendingCount; )
+	{
+		Pending* pending = &m_pending[ i ];
+		pending->time += dt;
+
+		// Only a handshake is taken off the socket; the input message an older
+		// client opens with is left for its room
+		Handshake handshake;
+		int recvd = socket_peek_msg( pending->socket, &handshake, sizeof(handshake) );
+		if ( recvd == -1 )
+		{
+			LOG_ERROR( "Error receiving handshake: %s", strerror( errno ) );
+		}
+		else if ( recvd == sizeof(Handshake) && handshake.magic == kHandshakeMagic )
+		{
+			socket_recv_msg( pending->socket, &handshake, sizeof(handshake) );
+			Route( pending->socket, handshake.room );
+		}
+		else if ( recvd > 0 || pending->time > kHandshakeTimeout )
+		{
+			Route( pending->socket, kAnyRoom );
+		}
+		else
+		{
+			i++;
+			continue;
+		}
+
+		*pending = m_pending[ --m_pendingCount ];
+	}
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::Route( int sock, uint32_t room )
+{
+	// A client that asked for a room is told where it stands rather than being
+	// seated somewhere it didn't ask for
+	if ( room != kAnyRoom )
+	{
+		HandshakeReply reply;
+		reply.magic = kHandshakeMagic;
+		reply.result = kHandshakeSeated;
+		reply.shard = m_shard;
+
+		uint32_t local = room / m_shardCount;
+		if ( room % m_shardCount != m_shard )
+		{
+			LOG_WARNING( "Room %u belongs to shard %u, not %u; turning the client away", room, room % m_shardCount, m_shard );
+			reply.result = kHandshakeWrongShard;
+		}
+		else if ( local >= kMaxRooms )
+		{
+			LOG_WARNING( "Room %u is out of range", room );
+			reply.result = kHandshakeNoSuchRoom;
+		}
+		else
+		{
+			OpenRoom( local );
+			if ( m_rooms[ local ].server->PlayerCount() >= m_playersPerRoom )
+			{
+				LOG_WARNING( "Room %u is full", room );
+				reply.result = kHandshakeRoomFull;
+			}
+		}
+
+		int sent = socket_send_msg( sock, &reply, sizeof(reply) );
+		if ( sent == sizeof(reply) && reply.result == kHandshakeSeated )
+		{
+			m_rooms[ local ].server->AddPlayer( sock );
+		}
+		else if ( sent != -1 )
+		{
+			close( sock );
+		}
+		return;
+	}
+
+	for ( uint32_t i = 0; i < m_roomCount; i++ )
+	{
+		if ( m_rooms[ i ].server && m_rooms[ i ].server->PlayerCount() < m_playersPerRoom )
+		{
+			m_rooms[ i ].server->AddPlayer( sock );
+			return;
+		}
+	}
+
+	for ( uint32_t i = 0; i < kMaxRooms; i++ )
+	{
+		if ( !m_rooms[ i ].server )
+		{
+			OpenRoom( i );
+			m_rooms[ i ].server->AddPlayer( sock );
+			return;
+		}
+	}
+
+	LOG_WARNING( "Every room is full, dropping connection" );
+	close( sock );
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::OpenRoom( uint32_t local )
+{
+	Room* room = &m_rooms[ local ];
+	if ( room->server )
+	{
+		return;
+	}
+
+	// Each room's entity updates run inline on whichever thread ticks it
+	room->gameState = new State();
+	room->server = new GameServer< Capacity >();
+	room->server->Initialize( -1, room->gameState, nullptr );
+	room->server->SetMaxRewind( m_maxRewind );
+	room->server->SetSnapshotRateLimits( m_rateLimits );
+	room->server->SetSnapshotEntityBytes( m_snapshotEntityBytes );
+	room->emptyTime = 0.0f;
+	if ( local >= m_roomCount )
+	{
+		m_roomCount = local + 1;
+	}
+
+	LOG_INFO( "Opened room %u", RoomId( local ) );
+}
+
+template< class Capacity >
+void RoomManager< Capacity >::CloseRoom( uint32_t local )
+{
+	Room* room = &m_rooms[ local ];
+	delete room->server;
+	delete room->gameState;
+	room->server = nullptr;
+	room->gameState = nullptr;
+
+	while ( m_roomCount > 0 && !m_rooms[ m_roomCount - 1 ].server )
+	{
+		m_roomCount--;
+	}
+
+	LOG_INFO( "Closed room %u after %.0f s empty", RoomId( local ), kEmptyRoomSeconds );
+}
+
+template class RoomManager< StandardCapacity >;
+template class RoomManager< LargeCapacity >;
@@ -0,0 +1,120 @@
+#ifndef ROOM_MANAGER_H
+#define ROOM_MANAGER_H
+
+#include "Game.h"
+
+// A client that wants a particular room sends this as its first message. Room
+// ids are global across shards: room r lives on shard r % shardCount, and the
+// client connects with socket_client_connect_shard so it lands there.
+const uint32_t kHandshakeMagic = 0x4A4D5053;
+const uint32_t kAnyRoom = ~0u;
+
+struct Handshake
+{
+	uint32_t magic;
+	uint32_t room;
+};
+
+// The server answers every handshake with a reply before anything else, and
+// closes the connection unless the player was seated. A client that reached
+// the wrong shard, because a NAT rewrote its source port or the shards joined
+// the listener group out of order, can reconnect from another port.
+const uint32_t kHandshakeSeated = 0;
+const uint32_t kHandshakeWrongShard = 1;
+const uint32_t kHandshakeRoomFull = 2;
+const uint32_t kHandshakeNoSuchRoom = 3;
+
+struct HandshakeReply
+{
+	uint32_t magic;
+	uint32_t result;
+	uint32_t shard; // That answered
+};
+
+// Connects to the shard hosting room and takes a seat in it, trying other
+// source ports while the connection lands on the wrong shard. Returns the
+// socket, or -1 if the room couldn't be joined.
+int ConnectToRoom( const char* hostname, uint16_t port, uint32_t room, uint32_t shardCount );
+
+// Hosts many independent matches in one process. The manager owns the listener
+// and routes each new connection into the room it asked for, or else the first
+// room with a free seat, opening a new room when they are all full and closing
+// rooms again once they have stayed empty for a while. Rooms are
+// spread over kTickPhases phases and each Update ticks only the rooms in the
+// next phase, on the job system's threads, so the load of hundreds of rooms is
+// spread evenly across the frame instead of arriving all at once.
+template< class Capacity >
+class RoomManager
+{
+public:
+	typedef GameState< Capacity > State;
+
+	static const uint32_t kMaxRooms = 1024;
+	static const uint32_t kMaxPending = 64;
+	static const uint32_t kTickPhases = 4;
+
+	// Rooms tick on the job system's threads, one job per room. This manager
+	// owns the rooms with ids congruent to shard modulo shardCount.
+	void Initialize( int listener, uint32_t playersPerRoom, JobSystem* jobs, uint32_t shard, uint32_t shardCount );
+	void Shutdown();
+
+	// Call kTickPhases times per game frame; every room ticks once per frame
+	void Update( float dt );
+
+	// Applies to rooms opened from now on
+	void SetMaxRewind( uint32_t ticks ) { m_maxRewind = ticks; }
+	void SetSnapshotRateLimits( const SnapshotRateLimits& limits ) { m_rateLimits = limits; }
+	void SetSnapshotEntityBytes( uint32_t bytes ) { m_snapshotEntityBytes = bytes; }
+
+	uint32_t RoomCount() const;
+	uint32_t PlayerCount() const;
+
+	// Appends one {"room", "players"} object per open room, comma separated
+	void WriteStats( StatsWriter* writer ) const;
+
+private:
+	struct Room
+	{
+		GameServer< Capacity >* server;
+		State* gameState;
+		float emptyTime; // Since the last player left
+	};
+
+	struct Pending
+	{
+		int socket;
+		float time;
+	};
+
+	static void TickJob( void* data, uint32_t begin, uint32_t end );
+
+	void UpdatePending( float dt );
+	void Route( int sock, uint32_t room );
+	void OpenRoom( uint32_t local );
+	void CloseRoom( uint32_t local );
+	uint32_t RoomId( uint32_t local ) const { return local * m_shardCount + m_shard; }
+
+	int m_listener;
+	uint32_t m_playersPerRoom;
+	JobSystem* m_jobs;
+	uint32_t m_shard;
+	uint32_t m_shardCount;
+	uint32_t m_maxRewind;
+	SnapshotRateLimits m_rateLimits;
+	uint32_t m_snapshotEntityBytes;
+
+	uint32_t m_phase;
+	float m_phaseTime[ kTickPhases ]; // Time since each phase last ticked
+	float m_tickDt;
+
+	// Connections that haven't said which room they want yet
+	uint32_t m_pendingCount;
+	Pending m_pending[ kMaxPending ];
+
+	uint32_t m_roomCount; // Rooms are indexed by local id, some may not be open
+	Room m_rooms[ kMaxRooms ];
+	uint32_t m_dueCount;
+	uint32_t m_due[ kMaxRooms ];
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+#include <cstring>
+
+// 4-wide vectors via the GCC/Clang vector extension. These lower to SSE on x86
+// and NEON on ARM, so the entity kernels don't need per-platform intrinsics.
+typedef float float4 __attribute__(( vector_size( 16 ) ));
+typedef int32_t int4 __attribute__(( vector_size( 16 ) ));
+
+inline float4 load4( const float* p )
+{
+	float4 v;
+	memcpy( &v, p, sizeof(v) );
+	return v;
+}
+
+inline void store4( float* p, float4 v )
+{
+	memcpy( p, &v, sizeof(v) );
+}
+
+inline float4 splat4( float s )
+{
+	float4 v = { s, s, s, s };
+	return v;
+}
+
+// Lanes where mask is set take a, the rest take b
+inline float4 select4( int4 mask, float4 a, float4 b )
+{
+	return (float4)( ( (int4)a & mask ) | ( (int4)b & ~mask ) );
+}
+
+// Lanes where mask is set keep v, the rest become 0.0f
+inline float4 and4( int4 mask, float4 v )
+{
+	return (float4)( (int4)v & mask );
+}
+
+// Expand the low 4 bits of an alive mask into a per-lane mask
+inline int4 mask4( uint32_t bits )
+{
+	int4 b = { (int32_t)bits, (int32_t)bits, (int32_t)bits, (int32_t)bits };
+	int4 lane = { 1, 2, 4, 8 };
+	return ( b & lane ) != 0;
+}
+
+inline float4 abs4( float4 v )
+{
+	return (float4)( (int4)v & 0x7FFFFFFF );
+}
+
+// Pack a per-lane mask back into 4 bits
+inline uint32_t bits4( int4 mask )
+{
+	return ( mask[ 0 ] & 1 ) | ( mask[ 1 ] & 2 ) | ( mask[ 2 ] & 4 ) | ( mask[ 3 ] & 8 );
+}
+
+// Cephes-style sine and cosine: reduce to [-pi/4, pi/4] around the nearest
+// multiple of pi/4, evaluate both minimax polynomials and swap/negate per octant.
+// Accurate to about 2 ulp for |angle| < 8192. Defining SIMD_FAST_SINCOS drops the
+// highest order term of each polynomial, which bounds the absolute error at 5e-5
+// (see bench/bench_trig).
+inline void SinCos4( float4 angle, float4* sinOut, float4* cosOut )
+{
+	const float kFourOverPi = 1.27323954473516f;
+	const float kDP1 = 0.78515625f;
+	const float kDP2 = 2.4187564849853515625e-4f;
+	const float kDP3 = 3.77489497744594108e-8f;
+
+	int4 sinSign = (int4)angle & (int4)splat4( -0.0f );
+	float4 x = abs4( angle );
+
+	int4 j = __builtin_convertvector( x * splat4( kFourOverPi ), int4 );
+	j = ( j + 1 ) & ~1;
+	float4 y = __builtin_convertvector( j, float4 );
+
+	sinSign ^= ( j & 4 ) << 29;
+	int4 cosSign = ( ~( j - 2 ) & 4 ) << 29;
+	int4 sinPoly = ( j & 2 ) == 0;
+
+	x = ( ( x - y * splat4( kDP1 ) ) - y * splat4( kDP2 ) ) - y * splat4( kDP3 );
+	float4 z = x * x;
+
+#ifdef SIMD_FAST_SINCOS
+	float4 c = ( splat4( -1.388731625493765e-3f ) * z + splat4( 4.166664568298827e-2f ) ) * z * z - z * splat4( 0.5f ) + splat4( 1.0f );
+	float4 s = ( splat4( 8.3321608736e-3f ) * z - splat4( 1.6666654611e-1f ) ) * z * x + x;
+#else
+	float4 c = ( ( splat4( 2.443315711809948e-5f ) * z - splat4( 1.388731625493765e-3f ) ) * z + splat4( 4.166664568298827e-2f ) ) * z * z - z * splat4( 0.5f ) + splat4( 1.0f );
+	float4 s = ( ( splat4( -1.9515295891e-4f ) * z + splat4( 8.3321608736e-3f ) ) * z - splat4( 1.6666654611e-1f ) ) * z * x + x;
+#endif
+
+	*sinOut = (float4)( (int4)select4( sinPoly, s, c ) ^ sinSign );
+	*cosOut = (float4)( (int4)select4( sinPoly, c, s ) ^ cosSign );
+}
+
+#endif
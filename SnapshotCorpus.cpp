@@ -0,0 +1,67 @@
+#include "SnapshotCorpus.h"
+#include "Logger.h"
+#include <cerrno>
+#include <cstring>
+
+const size_t kCorpusBufferBytes = 4 << 20;
+
+bool CorpusWriter::Open( const char* path, uint32_t snapshotBytes, uint32_t maxSnapshots )
+{
+	m_file = fopen( path, "wb" );
+	if ( !m_file )
+	{
+		LOG_ERROR( "Could not open corpus %s: %s", path, strerror( errno ) );
+		return false;
+	}
+
+	m_buffer = new char[ kCorpusBufferBytes ];
+	setvbuf( m_file, m_buffer, _IOFBF, kCorpusBufferBytes );
+	m_snapshotBytes = snapshotBytes;
+	m_remaining = maxSnapshots;
+
+	CorpusHeader header;
+	memset( &header, 0, sizeof(header) );
+	header.magic = kCorpusMagic;
+	header.version = kCorpusVersion;
+	header.snapshotBytes = snapshotBytes;
+	fwrite( &header, sizeof(header), 1, m_file );
+
+	LOG_INFO( "Capturing up to %u snapshots to %s", maxSnapshots, path );
+	return true;
+}
+
+void CorpusWriter::Close()
+{
+	if ( m_file )
+	{
+		fclose( m_file );
+		m_file = nullptr;
+		delete[] m_buffer;
+		m_buffer = nullptr;
+	}
+}
+
+void CorpusWriter::Append( uint64_t tick, uint32_t client, const uint8_t* delta )
+{
+	if ( !m_file || m_remaining == 0 )
+	{
+		return;
+	}
+
+	CorpusRecord record;
+	memset( &record, 0, sizeof(record) );
+	record.tick = tick;
+	record.client = client;
+	if ( fwrite( &record, sizeof(record), 1, m_file ) != 1 || fwrite( delta, m_snapshotBytes, 1, m_file ) != 1 )
+	{
+		LOG_ERROR( "Could not write corpus, stopping capture: %s", strerror( errno ) );
+		m_remaining = 0;
+		return;
+	}
+
+	if ( --m_remaining == 0 )
+	{
+		LOG_INFO( "Corpus capture complete" );
+		fflush( m_file );
+	}
+}
@@ -0,0 +1,47 @@
+#ifndef SNAPSHOT_CORPUS_H
+#define SNAPSHOT_CORPUS_H
+
+#include <cstdint>
+#include <cstdio>
+
+// A capture of the exact delta buffers the server hands to the snapshot
+// compressor, so codecs can be compared offline on real traffic. The file is
+// a header followed by one record per snapshot sent, each record followed by
+// the snapshotBytes delta.
+
+const uint32_t kCorpusMagic = 0x50524F43; // "CORP"
+const uint32_t kCorpusVersion = 1;
+
+struct CorpusHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t snapshotBytes;
+	uint32_t reserved;
+};
+
+struct CorpusRecord
+{
+	uint64_t tick;
+	uint32_t client; // Player slot, so per-connection codecs can be replayed per client
+	uint32_t reserved;
+};
+
+// Appends from the server tick through a large stdio buffer. Capturing is a
+// diagnostic mode; it stops by itself once maxSnapshots have been written.
+class CorpusWriter
+{
+public:
+	bool Open( const char* path, uint32_t snapshotBytes, uint32_t maxSnapshots );
+	void Close();
+
+	void Append( uint64_t tick, uint32_t client, const uint8_t* delta );
+
+private:
+	FILE* m_file;
+	char* m_buffer;
+	uint32_t m_snapshotBytes;
+	uint32_t m_remaining;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include "SnapshotRate.h"
+#include "NetStats.h"
+
+#include <cstring>
+
+const float kRateIncrease = 4.0f; // Snapshots per second gained per second of clear sending
+const float kRateCut = 0.75f;
+const float kThroughputMargin = 0.9f; // Of the measured throughput a cut aims for
+const float kQueueDelayTarget = 0.05f; // Seconds of snapshots the queue may hold beyond one round trip
+const float kRttTolerance = 0.05f; // Seconds a round trip may grow past the best before it counts as queueing
+const double kCutHold = 1.0; // A ping interval, so the round trip is measured again before the next cut
+const double kThroughputWindow = 0.5;
+const float kThroughputGain = 0.25f;
+const float kSizeGain = 0.125f;
+const float kBurstSeconds = 0.5f; // Of budget the token bucket holds
+const float kScheduleSlack = 0.0005f; // So tick-sized steps summing to just under an interval still send
+
+static float Clamp( float value, float low, float high )
+{
+	return value < low ? low : value > high ? high : value;
+}
+
+void SnapshotRate::Initialize( const SnapshotRateLimits& limits, float initialRate )
+{
+	memset( this, 0, sizeof(*this) );
+	m_limits = limits;
+	m_rate = Clamp( initialRate, limits.minRate, limits.maxRate );
+	m_tokens = limits.budget * kBurstSeconds;
+	m_queued = -1;
+}
+
+bool SnapshotRate::Due( float dt )
+{
+	m_time += dt;
+	m_timer += dt;
+	if ( m_limits.budget > 0.0f )
+	{
+		float burst = m_limits.budget * kBurstSeconds;
+		m_tokens += m_limits.budget * dt;
+		m_tokens = m_tokens > burst ? burst : m_tokens;
+	}
+
+	if ( m_timer + kScheduleSlack < 1.0f / m_rate )
+	{
+		return false;
+	}
+	return m_limits.budget <= 0.0f || m_tokens >= 0.0f;
+}
+
+void SnapshotRate::OnSent( uint32_t bytes, int queued, float rtt )
+{
+	// Keep the phase against the tick, but don't catch up on time the budget held back
+	float interval = 1.0f / m_rate;
+	m_timer -= interval;
+	m_timer = m_timer > interval ? 0.0f : m_timer;
+	if ( m_limits.budget > 0.0f )
+	{
+		m_tokens -= bytes;
+	}
+
+	m_sent += bytes;
+	m_snapshotBytes = m_snapshotBytes ? m_snapshotBytes + ( bytes - m_snapshotBytes ) * kSizeGain : bytes;
+	m_queued = queued;
+	if ( rtt > 0.0f )
+	{
+		m_minRtt = m_minRtt && m_minRtt < rtt ? m_minRtt : rtt;
+	}
+
+	bool congested = false;
+	if ( queued >= 0 )
+	{
+		// Whatever has left the queue has been acknowledged by the client
+		uint64_t drained = m_sent - queued;
+		if ( !m_sampleTime )
+		{
+			m_sampleTime = m_time;
+			m_sampleDrained = drained;
+		}
+		else if ( m_time - m_sampleTime >= kThroughputWindow )
+		{
+			float throughput = ( drained - m_sampleDrained ) / ( m_time - m_sampleTime );
+			m_throughput = m_throughput ? m_throughput + ( throughput - m_throughput ) * kThroughputGain : throughput;
+			m_sampleTime = m_time;
+			m_sampleDrained = drained;
+		}
+
+		// The snapshot just sent, plus a round trip's worth in flight, plus a little slack
+		float allowed = bytes + m_rate * m_snapshotBytes * ( m_minRtt + kQueueDelayTarget );
+		congested = queued > allowed;
+	}
+	if ( rtt > 0.0f && rtt > m_minRtt * 2.0f + kRttTolerance )
+	{
+		congested = true;
+	}
+
+	if ( !congested )
+	{
+		m_rate += kRateIncrease * interval;
+	}
+	else if ( m_time >= m_holdUntil )
+	{
+		Decrease();
+	}
+
+	float ceiling = m_limits.maxRate;
+	if ( m_limits.budget > 0.0f && m_limits.budget < ceiling * m_snapshotBytes )
+	{
+		ceiling = m_limits.budget / m_snapshotBytes;
+	}
+	m_rate = Clamp( m_rate, m_limits.minRate, ceiling > m_limits.minRate ? ceiling : m_limits.minRate );
+}
+
+void SnapshotRate::OnBlocked()
+{
+	// Wait a whole interval before offering the socket another
+	m_timer = 0.0f;
+	if ( m_time >= m_holdUntil )
+	{
+		Decrease();
+	}
+}
+
+void SnapshotRate::Decrease()
+{
+	m_rate *= kRateCut;
+	if ( m_throughput > 0.0f && m_snapshotBytes > 0.0f )
+	{
+		float sustainable = m_throughput * kThroughputMargin / m_snapshotBytes;
+		m_rate = sustainable < m_rate ? sustainable : m_rate;
+	}
+	m_rate = Clamp( m_rate, m_limits.minRate, m_limits.maxRate );
+	m_holdUntil = m_time + kCutHold + m_minRtt;
+	m_cuts++;
+}
+
+void SnapshotRate::WriteStats( StatsWriter* writer ) const
+{
+	writer->Printf( "{\"hz\":%.1f,\"budget\":%.0f,\"throughput\":%.0f,\"snapshotBytes\":%.0f,\"queued\":%d,\"minRtt\":%.4f,\"cuts\":%u}",
+		m_rate, m_limits.budget, m_throughput, m_snapshotBytes, m_queued, m_minRtt, m_cuts );
+}
@@ -0,0 +1,64 @@
+#ifndef SNAPSHOT_RATE_H
+#define SNAPSHOT_RATE_H
+
+#include <cstdint>
+
+class StatsWriter;
+
+// Bounds every client's snapshot rate floats between
+struct SnapshotRateLimits
+{
+	float minRate; // Snapshots per second
+	float maxRate;
+	float budget; // Bytes per second per client, 0 for unlimited
+};
+
+const SnapshotRateLimits kDefaultSnapshotRateLimits = { 2.0f, 30.0f, 64.0f * 1024.0f };
+
+// Decides when a client gets its next snapshot. The rate climbs a little with
+// every snapshot the connection takes in its stride and is cut back when it
+// doesn't: when the socket's send queue holds more than the link should have
+// in flight, when the round trip grows well past the best seen, or when a
+// send is refused outright. A cut goes straight to the throughput the
+// connection was measured draining, and a token bucket holds the bytes sent
+// to the budget whatever the rate, so one large snapshot delays the next
+// rather than being dropped. Time is the server's simulated time, so a replay
+// schedules snapshots the same way every run.
+class SnapshotRate
+{
+public:
+	void Initialize( const SnapshotRateLimits& limits, float initialRate );
+
+	// Advances time by dt; true if a snapshot should be sent this tick
+	bool Due( float dt );
+
+	// A snapshot of bytes went out. queued is what the socket still holds
+	// afterwards, -1 if unknown, and rtt the latest round trip, 0 if unknown.
+	void OnSent( uint32_t bytes, int queued, float rtt );
+
+	// The socket had no room for a snapshot
+	void OnBlocked();
+
+	float Rate() const { return m_rate; }
+	void WriteStats( StatsWriter* writer ) const;
+
+private:
+	void Decrease();
+
+	SnapshotRateLimits m_limits;
+	double m_time;
+	float m_rate;
+	float m_timer; // Since the last snapshot
+	float m_tokens; // Bytes the budget allows before the next snapshot waits
+	float m_snapshotBytes; // Smoothed size of a snapshot
+	float m_minRtt;
+	float m_throughput; // Smoothed bytes per second the socket drained, 0 until measured
+	double m_holdUntil; // No cut before this, so one backlog isn't punished twice
+	double m_sampleTime;
+	uint64_t m_sampleDrained;
+	uint64_t m_sent; // Every byte handed to the socket
+	int m_queued;
+	uint32_t m_cuts;
+};
+
+#endif
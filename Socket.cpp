@@ -1,19 +1,84 @@
 #include "Socket.h"
+#include "Tracer.h"
+#include "Logger.h"
 #include <cerrno>
+#include <chrono>
 #include <cstring>
 #include <cstdio>
 #include <cstdlib>
 #include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#include <linux/sockios.h>
+#endif
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+// Large enough that a whole snapshot frame at LargeCapacity fits in the kernel
+// buffers, which socket_recv_msg relies on to see complete frames
+const int kSocketBufferSize = 1 << 20;
+const int kSendTimeoutMs = 1000; // To finish a frame socket_send_msg has started
+
+static void socket_set_buffer_sizes( int sock )
+{
+	int size = kSocketBufferSize;
+	setsockopt( sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+	setsockopt( sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size) );
+}
+
 int socket_client_connect( const char* hostname, uint16_t port )
 {
-	int optVal = 1;
-	socklen_t optLen = sizeof(optVal);
+	return socket_client_connect_shard( hostname, port, 0, 0 );
+}
+
+// Binds the client end to a free port p with p % shardCount == shard
+static int socket_bind_shard_port( int sock, uint32_t shard, uint32_t shardCount )
+{
+	const uint32_t kPortFirst = 49152;
+	const uint32_t kPortCount = 65536 - kPortFirst;
+
+	uint32_t start = rand() % kPortCount;
+	for ( uint32_t i = 0; i < kPortCount; i++ )
+	{
+		uint32_t port = kPortFirst + ( start + i ) % kPortCount;
+		if ( port % shardCount != shard )
+		{
+			continue;
+		}
+
+		sockaddr_in local;
+		memset( &local, 0, sizeof(local) );
+		local.sin_family = AF_INET;
+		local.sin_addr.s_addr = htonl( INADDR_ANY );
+		local.sin_port = htons( port );
+		if ( bind( sock, (sockaddr*)&local, sizeof(local) ) == 0 )
+		{
+			return 0;
+		}
+		if ( errno != EADDRINUSE )
+		{
+			break;
+		}
+	}
+	return -1;
+}
+
+int socket_client_connect_shard( const char* hostname, uint16_t port, uint32_t shard, uint32_t shardCount )
+{
 	int result;
 
 	addrinfo hints;
@@ -30,14 +95,20 @@ int socket_client_connect( const char* hostname, uint16_t port )
 	int sock = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
 	if ( sock == -1 )
 	{
-		printf( "Error opening socket\n" );
+		LOG_ERROR( "Error opening socket" );
+		exit( -1 );
+		return -1;
+	}
+	if ( shardCount > 1 && socket_bind_shard_port( sock, shard, shardCount ) != 0 )
+	{
+		LOG_ERROR( "Could not bind a port for shard %u: %s", shard, strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
 	result = connect( sock, res->ai_addr, res->ai_addrlen );
 	if ( result != 0 )
 	{
-		printf( "Error connecting to server: %s\n", strerror( errno ) );
+		LOG_ERROR( "Error connecting to server: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
@@ -45,25 +116,29 @@ int socket_client_connect( const char* hostname, uint16_t port )
 	freeaddrinfo( res );
 
 	int enable = 1;
-	result = setsockopt( sock, SOL_SOCKET, TCP_NODELAY, &enable, sizeof(enable) );
+	result = setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable) );
 	if ( result != 0 )
 	{
-		printf( "Could not set sockopt: %s\n", strerror( errno ) );
+		LOG_ERROR( "Could not set sockopt: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
 
-	result = setsockopt( sock, SOL_SOCKET, SO_NOSIGPIPE, &optVal, optLen );
+#ifdef SO_NOSIGPIPE
+	int optVal = 1;
+	result = setsockopt( sock, SOL_SOCKET, SO_NOSIGPIPE, &optVal, sizeof(optVal) );
 	if ( result != 0 )
 	{
-		printf( "Could not set SO_NOSIGPIPE: %s\n", strerror( errno ) );
+		LOG_ERROR( "Could not set SO_NOSIGPIPE: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
+#endif
 
+	socket_set_buffer_sizes( sock );
 	fcntl( sock, F_SETFL, O_NONBLOCK );
 
-	printf( "Connected!\n" );
+	LOG_INFO( "Connected!" );
 
 	return sock;
 }
@@ -89,7 +164,7 @@ int socket_server_create_listener( uint16_t port )
 	int listener = socket( res->ai_family, res->ai_socktype, res->ai_protocol );
 	if ( listener < 0 )
 	{
-		printf( "Could not open listener: %s\n", strerror( errno ) );
+		LOG_ERROR( "Could not open listener: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
@@ -97,7 +172,7 @@ int socket_server_create_listener( uint16_t port )
 	result = setsockopt( listener, SOL_SOCKET, SO_REUSEPORT, &optVal, optLen );
 	if ( result != 0 )
 	{
-		printf( "Could not set SO_REUSEPORT: %s\n", strerror( errno ) );
+		LOG_ERROR( "Could not set SO_REUSEPORT: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
@@ -112,6 +187,41 @@ int socket_server_create_listener( uint16_t port )
 	return listener;
 }
 
+int socket_server_steer_by_source_port( int listener, uint32_t shardCount )
+{
+#if defined( SO_ATTACH_REUSEPORT_CBPF )
+	// Runs on the SYN, so the only thing to go on is the packet headers. The
+	// source port sits right after the IP header, whose length depends on the
+	// version (and on options for v4). The result indexes the reuseport group;
+	// anything out of range falls back to the kernel's hash.
+	sock_filter code[] =
+	{
+		BPF_STMT( BPF_LD | BPF_B | BPF_ABS, (uint32_t)SKF_NET_OFF ),
+		BPF_STMT( BPF_ALU | BPF_RSH | BPF_K, 4 ),
+		BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, 6, 3, 0 ),
+		BPF_STMT( BPF_LDX | BPF_B | BPF_MSH, (uint32_t)SKF_NET_OFF ),
+		BPF_STMT( BPF_LD | BPF_H | BPF_IND, (uint32_t)SKF_NET_OFF ),
+		BPF_JUMP( BPF_JMP | BPF_JA, 1, 0, 0 ),
+		BPF_STMT( BPF_LD | BPF_H | BPF_ABS, (uint32_t)SKF_NET_OFF + 40 ),
+		BPF_STMT( BPF_ALU | BPF_MOD | BPF_K, shardCount ),
+		BPF_STMT( BPF_RET | BPF_A, 0 ),
+	};
+
+	sock_fprog program;
+	program.len = sizeof(code) / sizeof(code[ 0 ]);
+	program.filter = code;
+	if ( setsockopt( listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program) ) != 0 )
+	{
+		LOG_ERROR( "Could not attach reuseport program: %s", strerror( errno ) );
+		return -1;
+	}
+	return 0;
+#else
+	LOG_WARNING( "Reuseport steering isn't supported on this platform" );
+	return -1;
+#endif
+}
+
 int socket_server_accept( int listener )
 {
 	int optVal = 1;
@@ -125,79 +235,254 @@ int socket_server_accept( int listener )
 	{
 		if ( errno != EAGAIN && errno != EWOULDBLOCK )
 		{
-			printf( "Could not open socket: %s\n", strerror( errno ) );
+			LOG_ERROR( "Could not open socket: %s", strerror( errno ) );
 			exit( -1 );
 		}
 		return -1;
 	}
 
-	result = setsockopt( sock, SOL_SOCKET, TCP_NODELAY, &optVal, optLen );
+	result = setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &optVal, optLen );
 	if ( result != 0 )
 	{
-		printf( "Could not set TCP_NODELAY: %s\n", strerror( errno ) );
+		LOG_ERROR( "Could not set TCP_NODELAY: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
 
+#ifdef SO_NOSIGPIPE
 	result = setsockopt( sock, SOL_SOCKET, SO_NOSIGPIPE, &optVal, optLen );
 	if ( result != 0 )
 	{
-		printf( "Could not set SO_NOSIGPIPE: %s\n", strerror( errno ) );
+		LOG_ERROR( "Could not set SO_NOSIGPIPE: %s", strerror( errno ) );
 		exit( -1 );
 		return -1;
 	}
+#endif
 
+	socket_set_buffer_sizes( sock );
 	fcntl( sock, F_SETFL, O_NONBLOCK );
 
 	return sock;
 }
 
+// Writes as much of msg as the socket takes right now. Returns the bytes
+// written, 0 if it took none, or -1 after closing the socket on error.
+static ssize_t socket_send_some( int sock, msghdr* msg )
+{
+	ssize_t bytes = sendmsg( sock, msg, kSendFlags );
+	if ( bytes < 0 )
+	{
+		if ( errno == EAGAIN || errno == EWOULDBLOCK )
+		{
+			return 0;
+		}
+
+		LOG_ERROR( "Error sending, closing socket: %s", strerror( errno ) );
+		close( sock );
+		return -1;
+	}
+	return bytes;
+}
+
+static void socket_frame_msg( msghdr* msg, iovec* iov, uint32_t* header, const void* data, uint32_t length )
+{
+	iov[ 0 ].iov_base = header;
+	iov[ 0 ].iov_len = sizeof(*header);
+	iov[ 1 ].iov_base = (void*)data;
+	iov[ 1 ].iov_len = length;
+
+	memset( msg, 0, sizeof(*msg) );
+	msg->msg_iov = iov;
+	msg->msg_iovlen = 2;
+}
+
 int socket_send_msg( int sock, const void* data, uint32_t length )
 {
-	uint16_t sendLength = length + sizeof(uint16_t);
-	uint8_t msg[ sendLength ];
+	uint64_t traceStart = TraceEnabled() ? TraceNow() : 0;
 
-	*(uint16_t*)msg = length;
-	memcpy( msg + sizeof(uint16_t), data, length );
+	uint32_t header = length;
+	iovec iov[ 2 ];
+	msghdr msg;
+	socket_frame_msg( &msg, iov, &header, data, length );
 
-	int bytes = send( sock, msg, sendLength, 0 );
-	if ( bytes != sendLength && errno != EAGAIN && errno != EWOULDBLOCK )
+	ssize_t bytes = socket_send_some( sock, &msg );
+	if ( bytes <= 0 )
 	{
-		printf( "Error sending, closing socket: %s\n", strerror( errno ) );
-		close( sock );
-		return -1;
+		return (int)bytes;
 	}
 
+	// Once any of a frame is on the wire the rest has to follow or the stream is
+	// corrupt, so wait for the socket to drain a partial write. The timeout is
+	// for the whole frame, so a peer reading a trickle can't hold us forever.
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( kSendTimeoutMs );
+	size_t remaining = sizeof(header) + length - bytes;
+	while ( remaining )
+	{
+		while ( msg.msg_iovlen && (size_t)bytes >= msg.msg_iov->iov_len )
+		{
+			bytes -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + bytes;
+		msg.msg_iov->iov_len -= bytes;
+
+		int waitMs = (int)std::chrono::duration_cast< std::chrono::milliseconds >( deadline - std::chrono::steady_clock::now() ).count();
+		pollfd pfd = { sock, POLLOUT, 0 };
+		if ( waitMs <= 0 || poll( &pfd, 1, waitMs ) <= 0 )
+		{
+			LOG_ERROR( "Timed out completing send, closing socket" );
+			close( sock );
+			return -1;
+		}
+
+		bytes = socket_send_some( sock, &msg );
+		if ( bytes < 0 )
+		{
+			return -1;
+		}
+		remaining -= bytes;
+	}
+
+	if ( traceStart )
+	{
+		TraceSpan( "socket send", traceStart, TraceNow(), length );
+	}
+	return length;
+}
+
+int socket_send_msg_backlogged( int sock, const void* data, uint32_t length, uint8_t* backlog, uint32_t* pending )
+{
+	uint64_t traceStart = TraceEnabled() ? TraceNow() : 0;
+
+	uint32_t header = length;
+	iovec iov[ 2 ];
+	msghdr msg;
+	socket_frame_msg( &msg, iov, &header, data, length );
+
+	ssize_t bytes = socket_send_some( sock, &msg );
+	if ( bytes <= 0 )
+	{
+		return (int)bytes;
+	}
+
+	// Whatever the socket didn't take is set aside for socket_send_backlog
+	*pending = sizeof(header) + length - bytes;
+	if ( *pending && (size_t)bytes < sizeof(header) )
+	{
+		memcpy( backlog, (uint8_t*)&header + bytes, sizeof(header) - bytes );
+		memcpy( backlog + sizeof(header) - bytes, data, length );
+	}
+	else if ( *pending )
+	{
+		memcpy( backlog, (const uint8_t*)data + ( bytes - sizeof(header) ), *pending );
+	}
+
+	if ( traceStart )
+	{
+		TraceSpan( "socket send", traceStart, TraceNow(), length );
+	}
 	return length;
 }
 
+int socket_send_backlog( int sock, uint8_t* backlog, uint32_t* pending )
+{
+	if ( !*pending )
+	{
+		return 0;
+	}
+
+	iovec iov;
+	iov.iov_base = backlog;
+	iov.iov_len = *pending;
+	msghdr msg;
+	memset( &msg, 0, sizeof(msg) );
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	ssize_t bytes = socket_send_some( sock, &msg );
+	if ( bytes < 0 )
+	{
+		return -1;
+	}
+	*pending -= bytes;
+	memmove( backlog, backlog + bytes, *pending );
+	return *pending;
+}
+
 int socket_recv_msg( int sock, void* dataOut, uint32_t maxLength )
 {
-	uint16_t bufLength = maxLength + sizeof(uint16_t);
-	uint8_t buf[ bufLength ];
-	
-	int recvd = recv( sock, buf, bufLength, MSG_PEEK );
-	if ( recvd >= (int)sizeof(uint16_t) )
+	uint64_t traceStart = TraceEnabled() ? TraceNow() : 0;
+
+	uint32_t length;
+	int recvd = recv( sock, &length, sizeof(length), MSG_PEEK );
+	if ( recvd == (int)sizeof(length) )
 	{
-		uint32_t length = *(uint16_t*)buf;
-		uint32_t msgLength = length + sizeof(uint16_t);
+		if ( length > maxLength )
+		{
+			LOG_ERROR( "Message of %u bytes exceeds buffer of %u, closing socket", length, maxLength );
+			close( sock );
+			return -1;
+		}
 
-		if ( recvd < msgLength )
+		// Only consume the frame once all of it has arrived
+		int available = 0;
+		if ( ioctl( sock, FIONREAD, &available ) != 0 || available < (int)( sizeof(length) + length ) )
 		{
 			return 0;
 		}
 
-		recvd = recv( sock, buf, msgLength, 0 );
-		if ( recvd != msgLength )
+		recv( sock, &length, sizeof(length), 0 );
+		recvd = recv( sock, dataOut, length, 0 );
+		if ( recvd != (int)length )
 		{
 			close( sock );
 			return -1;
 		}
 
-		memcpy( dataOut, buf + sizeof(uint16_t), length );
+		if ( traceStart )
+		{
+			TraceSpan( "socket recv", traceStart, TraceNow(), length );
+		}
+		return length;
+	}
+	else if ( recvd == 0 || ( recvd == -1 && errno != EAGAIN && errno != EWOULDBLOCK ) )
+	{
+		close( sock );
+		return -1;
+	}
+	else
+	{
+		return 0;
+	}
+}
+
+int socket_peek_msg( int sock, void* dataOut, uint32_t maxLength )
+{
+	uint32_t length;
+	int recvd = recv( sock, &length, sizeof(length), MSG_PEEK );
+	if ( recvd == (int)sizeof(length) )
+	{
+		int available = 0;
+		if ( ioctl( sock, FIONREAD, &available ) != 0 || available < (int)( sizeof(length) + length ) )
+		{
+			return 0;
+		}
+
+		iovec parts[ 2 ];
+		parts[ 0 ].iov_base = &length;
+		parts[ 0 ].iov_len = sizeof(length);
+		parts[ 1 ].iov_base = dataOut;
+		parts[ 1 ].iov_len = length < maxLength ? length : maxLength;
+
+		msghdr msg;
+		memset( &msg, 0, sizeof(msg) );
+		msg.msg_iov = parts;
+		msg.msg_iovlen = 2;
+		recvmsg( sock, &msg, MSG_PEEK );
 		return length;
 	}
-	else if ( recvd == -1 && errno != EAGAIN && errno != EWOULDBLOCK )
+	else if ( recvd == 0 || ( recvd == -1 && errno != EAGAIN && errno != EWOULDBLOCK ) )
 	{
 		close( sock );
 		return -1;
@@ -207,3 +492,21 @@ int socket_recv_msg( int sock, void* dataOut, uint32_t maxLength )
 		return 0;
 	}
 }
+
+int socket_send_queue_bytes( int sock )
+{
+	int queued = -1;
+#if defined( SIOCOUTQ )
+	if ( ioctl( sock, SIOCOUTQ, &queued ) != 0 )
+	{
+		queued = -1;
+	}
+#elif defined( SO_NWRITE )
+	socklen_t length = sizeof(queued);
+	if ( getsockopt( sock, SOL_SOCKET, SO_NWRITE, &queued, &length ) != 0 )
+	{
+		queued = -1;
+	}
+#endif
+	return queued;
+}
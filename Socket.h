@@ -4,5 +4,42 @@ int socket_client_connect( const char* hostname, uint16_t port );
 int socket_server_create_listener( uint16_t port );
 int socket_server_accept( int listener );
 
+// Sharding across server processes that share a port through SO_REUSEPORT. A
+// connection is steered to listener ( source port % shardCount ) in the order
+// the listeners joined the group, so shards must be started in order. The
+// client picks its source port to land on the shard it wants. Steering needs
+// Linux; elsewhere it fails and connections are spread by the kernel's hash.
+// It is only a hint, so shards must still check where each client meant to go:
+// a NAT between client and server rewrites the source port, and closing a
+// listener moves the last one in the group into its place, so a shard that
+// crashes or restarts reorders the group and every shard is steered anew.
+int socket_client_connect_shard( const char* hostname, uint16_t port, uint32_t shard, uint32_t shardCount );
+int socket_server_steer_by_source_port( int listener, uint32_t shardCount );
+
+// Messages are framed with a 32-bit length. send returns the payload length once
+// the whole frame is written, 0 if the socket couldn't take any of it, or -1 on
+// error. recv returns the payload length, 0 if no complete frame has arrived yet,
+// or -1 on error or disconnect. Both close the socket on error.
+// send blocks for up to a second to finish a frame it has started, so it suits
+// small messages on an otherwise idle socket.
 int socket_send_msg( int sock, const void* data, uint32_t length );
-int socket_recv_msg( int sock, void* dataOut, uint32_t length );
+int socket_recv_msg( int sock, void* dataOut, uint32_t maxLength );
+
+// Returns as socket_recv_msg does but leaves the frame in the socket, copying
+// no more than maxLength bytes of the payload; a longer frame isn't an error.
+int socket_peek_msg( int sock, void* dataOut, uint32_t maxLength );
+
+// Sends without ever blocking. Whatever part of a frame the socket doesn't
+// take is copied to backlog, which must hold length plus the 4-byte header,
+// and *pending is set to its size; until socket_send_backlog has brought
+// *pending to 0 nothing else may be sent on the socket. Returns as
+// socket_send_msg does, counting a backlogged frame as written.
+int socket_send_msg_backlogged( int sock, const void* data, uint32_t length, uint8_t* backlog, uint32_t* pending );
+
+// Sends what the socket takes of a backlog. Returns the bytes still pending, or
+// -1 after closing the socket on error.
+int socket_send_backlog( int sock, uint8_t* backlog, uint32_t* pending );
+
+// Bytes written but not yet acknowledged by the peer, or -1 if the platform
+// can't tell
+int socket_send_queue_bytes( int sock );
@@ -0,0 +1,191 @@
+#include "Tracer.h"
+#include "Logger.h"
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <unistd.h>
+
+std::atomic< bool > g_traceEnabled( false );
+
+const uint32_t kTraceBufferEvents = 1 << 16;
+const uint32_t kMaxTraceThreads = 256;
+const double kDefaultTraceSeconds = 5.0;
+
+struct TraceEvent
+{
+	const char* name;
+	uint64_t start;
+	uint64_t duration;
+	int64_t bytes;
+};
+
+// Only the owning thread writes. It resets the buffer itself when it sees a new
+// capture's generation, and publishes each event by storing count with release,
+// so WriteCapture can read everything below an acquired count while the thread
+// keeps recording. Slots are never reused within a capture: once the buffer is
+// full count keeps climbing but the event is dropped.
+struct TraceBuffer
+{
+	uint32_t thread;
+	std::atomic< uint32_t > generation;
+	std::atomic< uint64_t > count;
+	TraceEvent events[ kTraceBufferEvents ];
+};
+
+static std::mutex s_registryMutex;
+static TraceBuffer* s_buffers[ kMaxTraceThreads ];
+static uint32_t s_bufferCount = 0;
+static thread_local TraceBuffer* t_buffer = nullptr;
+static std::atomic< uint32_t > s_generation( 0 ); // Bumped by every TraceStart
+
+static volatile sig_atomic_t s_startRequested = 0;
+static uint64_t s_captureStart = 0;
+static uint64_t s_captureEnd = 0;
+static uint32_t s_captureIndex = 0;
+
+static TraceBuffer* RegisterThread()
+{
+	std::lock_guard< std::mutex > lock( s_registryMutex );
+	if ( s_bufferCount == kMaxTraceThreads )
+	{
+		return nullptr;
+	}
+
+	TraceBuffer* buffer = new TraceBuffer;
+	buffer->thread = s_bufferCount;
+	buffer->generation.store( 0, std::memory_order_relaxed );
+	buffer->count.store( 0, std::memory_order_relaxed );
+	s_buffers[ s_bufferCount++ ] = buffer;
+	return buffer;
+}
+
+void TraceSpan( const char* name, uint64_t startNs, uint64_t endNs, int64_t bytes )
+{
+	if ( !TraceEnabled() )
+	{
+		return;
+	}
+
+	if ( !t_buffer )
+	{
+		t_buffer = RegisterThread();
+		if ( !t_buffer )
+		{
+			return;
+		}
+	}
+
+	uint32_t generation = s_generation.load( std::memory_order_acquire );
+	if ( t_buffer->generation.load( std::memory_order_relaxed ) != generation )
+	{
+		t_buffer->count.store( 0, std::memory_order_relaxed );
+		t_buffer->generation.store( generation, std::memory_order_release );
+	}
+
+	uint64_t count = t_buffer->count.load( std::memory_order_relaxed );
+	if ( count < kTraceBufferEvents )
+	{
+		TraceEvent* event = &t_buffer->events[ count ];
+		event->name = name;
+		event->start = startNs;
+		event->duration = endNs - startNs;
+		event->bytes = bytes;
+	}
+	t_buffer->count.store( count + 1, std::memory_order_release );
+}
+
+static void TraceSignalHandler( int )
+{
+	s_startRequested = 1;
+}
+
+void TraceInstallSignalHandler()
+{
+	signal( SIGUSR2, TraceSignalHandler );
+}
+
+void TraceStart( double seconds )
+{
+	// Threads still recording own their buffers, so each clears its own the
+	// next time it records rather than having it cleared under it
+	s_generation.fetch_add( 1, std::memory_order_release );
+	s_captureStart = TraceNow();
+	s_captureEnd = s_captureStart + (uint64_t)( seconds * 1e9 );
+	g_traceEnabled.store( true, std::memory_order_release );
+	LOG_INFO( "Tracing for %.1f s", seconds );
+}
+
+static void WriteCapture()
+{
+	char path[ 64 ];
+	snprintf( path, sizeof(path), "trace_%d_%u.json", (int)getpid(), s_captureIndex++ );
+	FILE* file = fopen( path, "w" );
+	if ( !file )
+	{
+		LOG_ERROR( "Could not write %s: %s", path, strerror( errno ) );
+		return;
+	}
+
+	fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+	bool first = true;
+
+	uint32_t generation = s_generation.load( std::memory_order_relaxed );
+	std::lock_guard< std::mutex > lock( s_registryMutex );
+	for ( uint32_t i = 0; i < s_bufferCount; i++ )
+	{
+		// Threads that haven't recorded since the capture started still hold the last one
+		const TraceBuffer* buffer = s_buffers[ i ];
+		if ( buffer->generation.load( std::memory_order_acquire ) != generation )
+		{
+			continue;
+		}
+
+		uint64_t count = buffer->count.load( std::memory_order_acquire );
+		if ( count == 0 )
+		{
+			continue;
+		}
+		if ( count > kTraceBufferEvents )
+		{
+			LOG_WARNING( "Trace thread %u dropped %llu spans after filling its buffer", buffer->thread, (unsigned long long)( count - kTraceBufferEvents ) );
+			count = kTraceBufferEvents;
+		}
+
+		fprintf( file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}", first ? "" : ",\n", buffer->thread, buffer->thread );
+		first = false;
+
+		for ( uint64_t e = 0; e < count; e++ )
+		{
+			const TraceEvent& event = buffer->events[ e ];
+			// Spans can start a little before the capture did
+			fprintf( file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+				event.name, buffer->thread, (int64_t)( event.start - s_captureStart ) / 1000.0, event.duration / 1000.0 );
+			if ( event.bytes >= 0 )
+			{
+				fprintf( file, ",\"args\":{\"bytes\":%lld}", (long long)event.bytes );
+			}
+			fprintf( file, "}" );
+		}
+	}
+
+	fprintf( file, "\n]}\n" );
+	fclose( file );
+	LOG_INFO( "Wrote %s", path );
+}
+
+void TracePoll()
+{
+	if ( TraceEnabled() && TraceNow() >= s_captureEnd )
+	{
+		g_traceEnabled.store( false, std::memory_order_relaxed );
+		WriteCapture();
+	}
+
+	if ( s_startRequested && !TraceEnabled() )
+	{
+		s_startRequested = 0;
+		TraceStart( kDefaultTraceSeconds );
+	}
+}
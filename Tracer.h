@@ -0,0 +1,65 @@
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Timeline capture for diagnosing hitches. While a capture is running every
+// traced span is appended to a buffer owned by the thread that recorded it, so
+// recording takes no locks; when the capture window closes the buffers are
+// written out as Chrome trace-event JSON, which chrome://tracing and the
+// Perfetto UI both open. Outside a capture a span costs one relaxed load.
+//
+// Captures start and end from TracePoll on the main loop. Other threads, such
+// as the client's render thread, may keep recording across the start and the
+// write: each thread clears its own buffer when it first records in a new
+// capture, and the write takes only the spans already published. A span still
+// being recorded as the capture closes is left out. Each thread keeps the first
+// 65536 spans of a capture and drops the rest.
+
+extern std::atomic< bool > g_traceEnabled;
+
+inline bool TraceEnabled()
+{
+	return g_traceEnabled.load( std::memory_order_relaxed );
+}
+
+inline uint64_t TraceNow()
+{
+	return std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Name must outlive the capture; string literals are the intended use. A
+// negative bytes leaves the argument off the event.
+void TraceSpan( const char* name, uint64_t startNs, uint64_t endNs, int64_t bytes = -1 );
+
+// Traces the enclosing scope
+class TraceScope
+{
+public:
+	explicit TraceScope( const char* name ) : m_name( name ), m_start( TraceEnabled() ? TraceNow() : 0 ) {}
+	~TraceScope()
+	{
+		if ( m_start && TraceEnabled() )
+		{
+			TraceSpan( m_name, m_start, TraceNow() );
+		}
+	}
+
+private:
+	const char* m_name;
+	uint64_t m_start;
+};
+
+// SIGUSR2 starts a capture of the default window at the next TracePoll
+void TraceInstallSignalHandler();
+
+// Starts a capture that runs for the given number of seconds
+void TraceStart( double seconds );
+
+// Call once per frame from the main loop. Writes trace_<pid>_<n>.json to the
+// working directory when a capture finishes.
+void TracePoll();
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+// Hands the newest of a stream of values from one producer thread to one
+// consumer thread without locks. Of the three slots the producer writes one,
+// the consumer reads another, and the third holds the latest published value
+// between them. Publish and Acquire each swap their own slot with that middle
+// one, so neither side ever waits on the other; values the consumer is too
+// slow to take are overwritten by newer ones.
+template< class T >
+class TripleBuffer
+{
+public:
+	TripleBuffer() : m_middle( 1 ), m_write( 0 ), m_read( 2 ) {}
+
+	// Producer only
+	T* WriteSlot() { return &m_slots[ m_write ]; }
+	void Publish()
+	{
+		m_write = m_middle.exchange( m_write | kFresh, std::memory_order_acq_rel ) & kIndexMask;
+	}
+
+	// Consumer only. Takes the newest published value if there's one it hasn't
+	// seen yet; otherwise returns false and ReadSlot keeps the last one.
+	bool Acquire()
+	{
+		if ( !( m_middle.load( std::memory_order_relaxed ) & kFresh ) )
+		{
+			return false;
+		}
+		m_read = m_middle.exchange( m_read, std::memory_order_acq_rel ) & kIndexMask;
+		return true;
+	}
+	const T* ReadSlot() const { return &m_slots[ m_read ]; }
+
+private:
+	static const uint32_t kIndexMask = 3;
+	static const uint32_t kFresh = 4; // Set in m_middle until the consumer takes it
+
+	T m_slots[ 3 ];
+	std::atomic< uint32_t > m_middle;
+	uint32_t m_write;
+	uint32_t m_read;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef BENCH_STATE_H
+#define BENCH_STATE_H
+
+#include <cstdlib>
+#include <cstring>
+#include "Game.h"
+
+// Synthetic game states for the render benches: aliveFraction of every
+// entity array filled with entities scattered over the playfield
+
+inline float RandomRange( float extent )
+{
+	return extent * ( rand() / (float)RAND_MAX * 2.0f - 1.0f );
+}
+
+template< class Capacity >
+void FillState( GameState< Capacity >* state, float aliveFraction )
+{
+	memset( state, 0, sizeof(*state) );
+	for ( uint32_t i = 0; i < Capacity::kMaxShips * aliveFraction; i++ )
+	{
+		uint32_t ship = state->ships.Allocate();
+		state->ships.Clear( ship );
+		state->ships.id[ ship ] = i + 1;
+		state->ships.positionX[ ship ] = RandomRange( kWidthUnits );
+		state->ships.positionY[ ship ] = RandomRange( kHeightUnits );
+		state->ships.SetRotation( ship, RandomRange( M_PI ) );
+		state->ships.local[ ship ] = i == 0;
+	}
+	for ( uint32_t i = 0; i < Capacity::kMaxAsteroids * aliveFraction; i++ )
+	{
+		uint32_t asteroid = state->asteroids.Allocate();
+		state->asteroids.positionX[ asteroid ] = RandomRange( kWidthUnits );
+		state->asteroids.positionY[ asteroid ] = RandomRange( kHeightUnits );
+		state->asteroids.rotation[ asteroid ] = RandomRange( M_PI );
+		state->asteroids.size[ asteroid ] = kAsteroidSizeMin + kAsteroidSizeRange * rand() / (float)RAND_MAX;
+	}
+	for ( uint32_t i = 0; i < Capacity::kMaxLasers * aliveFraction; i++ )
+	{
+		uint32_t laser = state->lasers.Allocate();
+		state->lasers.positionX[ laser ] = RandomRange( kWidthUnits );
+		state->lasers.positionY[ laser ] = RandomRange( kHeightUnits );
+	}
+}
+
+#endif
@@ -0,0 +1,470 @@
+// Replays a snapshot corpus captured with `asteroids -s -corpus <file>` through
+// candidate snapshot codecs and reports compression ratio plus encode and
+// decode throughput, so changes to snapshot encoding can be judged on real
+// traffic. Every codec's output is decoded and checked against the input.
+//
+// Usage: bench_codecs <corpus> [maxSnapshots]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "SnapshotCorpus.h"
+#include "lz4.h"
+
+const uint32_t kPasses = 5;
+const uint32_t kMaxClients = 256;
+
+struct Snapshot
+{
+	uint32_t client;
+	const uint8_t* delta;
+	uint8_t* encoded;
+	uint32_t encodedBytes;
+};
+
+double NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+//-----------
+// Codecs
+//-----------
+
+// Encode and Decode see each client's snapshots in the order they were sent,
+// so codecs may keep per-client history the way a connection could
+class Codec
+{
+public:
+	virtual ~Codec() {}
+	virtual const char* Name() const = 0;
+	virtual void Reset( uint32_t snapshotBytes ) { m_bytes = snapshotBytes; }
+	virtual uint32_t Bound() const { return LZ4_compressBound( m_bytes ); }
+	virtual uint32_t Encode( uint32_t client, const uint8_t* delta, uint8_t* out ) = 0;
+	virtual bool Decode( uint32_t client, const uint8_t* in, uint32_t inBytes, uint8_t* delta ) = 0;
+
+protected:
+	uint32_t m_bytes;
+};
+
+class Lz4Fast : public Codec
+{
+public:
+	explicit Lz4Fast( int acceleration ) : m_acceleration( acceleration )
+	{
+		snprintf( m_name, sizeof(m_name), "lz4 fast a=%d", acceleration );
+	}
+	const char* Name() const { return m_acceleration == 1 ? "lz4 default" : m_name; }
+
+	uint32_t Encode( uint32_t, const uint8_t* delta, uint8_t* out )
+	{
+		return LZ4_compress_fast( (const char*)delta, (char*)out, m_bytes, Bound(), m_acceleration );
+	}
+	bool Decode( uint32_t, const uint8_t* in, uint32_t inBytes, uint8_t* delta )
+	{
+		return LZ4_decompress_safe( (const char*)in, (char*)delta, inBytes, m_bytes ) == (int)m_bytes;
+	}
+
+private:
+	int m_acceleration;
+	char m_name[ 32 ];
+};
+
+// The compressor's hash table lives in a caller-owned state instead of on the stack
+class Lz4ExtState : public Codec
+{
+public:
+	Lz4ExtState() : m_state( new uint8_t[ LZ4_sizeofState() ] ) {}
+	~Lz4ExtState() { delete[] m_state; }
+	const char* Name() const { return "lz4 extState"; }
+
+	uint32_t Encode( uint32_t, const uint8_t* delta, uint8_t* out )
+	{
+		return LZ4_compress_fast_extState( m_state, (const char*)delta, (char*)out, m_bytes, Bound(), 1 );
+	}
+	bool Decode( uint32_t, const uint8_t* in, uint32_t inBytes, uint8_t* delta )
+	{
+		return LZ4_decompress_safe( (const char*)in, (char*)delta, inBytes, m_bytes ) == (int)m_bytes;
+	}
+
+private:
+	uint8_t* m_state;
+};
+
+// One LZ4 stream per connection, so each delta can reference the previous
+// one. Both ends double buffer, since LZ4 needs the last block to stay put.
+class Lz4Stream : public Codec
+{
+public:
+	Lz4Stream() : m_encodeBuffers( nullptr ), m_decodeBuffers( nullptr ) {}
+	~Lz4Stream() { delete[] m_encodeBuffers; delete[] m_decodeBuffers; }
+	const char* Name() const { return "lz4 stream"; }
+
+	void Reset( uint32_t snapshotBytes )
+	{
+		Codec::Reset( snapshotBytes );
+		delete[] m_encodeBuffers;
+		delete[] m_decodeBuffers;
+		m_encodeBuffers = new uint8_t[ kMaxClients * 2 * snapshotBytes ];
+		m_decodeBuffers = new uint8_t[ kMaxClients * 2 * snapshotBytes ];
+		for ( uint32_t i = 0; i < kMaxClients; i++ )
+		{
+			LZ4_resetStream( &m_encoders[ i ] );
+			LZ4_setStreamDecode( &m_decoders[ i ], nullptr, 0 );
+			m_encodeFlip[ i ] = 0;
+			m_decodeFlip[ i ] = 0;
+		}
+	}
+
+	uint32_t Encode( uint32_t client, const uint8_t* delta, uint8_t* out )
+	{
+		uint8_t* block = m_encodeBuffers + ( client * 2 + m_encodeFlip[ client ] ) * m_bytes;
+		m_encodeFlip[ client ] ^= 1;
+		memcpy( block, delta, m_bytes );
+		return LZ4_compress_fast_continue( &m_encoders[ client ], (const char*)block, (char*)out, m_bytes, Bound(), 1 );
+	}
+	bool Decode( uint32_t client, const uint8_t* in, uint32_t inBytes, uint8_t* delta )
+	{
+		uint8_t* block = m_decodeBuffers + ( client * 2 + m_decodeFlip[ client ] ) * m_bytes;
+		m_decodeFlip[ client ] ^= 1;
+		if ( LZ4_decompress_safe_continue( &m_decoders[ client ], (const char*)in, (char*)block, inBytes, m_bytes ) != (int)m_bytes )
+		{
+			return false;
+		}
+		memcpy( delta, block, m_bytes );
+		return true;
+	}
+
+private:
+	LZ4_stream_t m_encoders[ kMaxClients ];
+	LZ4_streamDecode_t m_decoders[ kMaxClients ];
+	uint8_t m_encodeFlip[ kMaxClients ];
+	uint8_t m_decodeFlip[ kMaxClients ];
+	uint8_t* m_encodeBuffers;
+	uint8_t* m_decodeBuffers;
+};
+
+static uint8_t* PutVarint( uint8_t* out, uint32_t value )
+{
+	while ( value >= 0x80 )
+	{
+		*out++ = (uint8_t)( value | 0x80 );
+		value >>= 7;
+	}
+	*out++ = (uint8_t)value;
+	return out;
+}
+
+static const uint8_t* GetVarint( const uint8_t* in, const uint8_t* end, uint32_t* value )
+{
+	*value = 0;
+	for ( uint32_t shift = 0; in < end && shift < 35; shift += 7 )
+	{
+		uint8_t byte = *in++;
+		*value |= ( byte & 0x7F ) << shift;
+		if ( !( byte & 0x80 ) )
+		{
+			return in;
+		}
+	}
+	return nullptr;
+}
+
+// Deltas are mostly zero; store them as (zero run, literal run, literals)
+// triples, optionally LZ4 compressing the result
+class Sparse : public Codec
+{
+public:
+	explicit Sparse( bool lz4 ) : m_lz4( lz4 ), m_scratch( nullptr ) {}
+	~Sparse() { delete[] m_scratch; }
+	const char* Name() const { return m_lz4 ? "sparse + lz4" : "sparse"; }
+
+	void Reset( uint32_t snapshotBytes )
+	{
+		Codec::Reset( snapshotBytes );
+		delete[] m_scratch;
+		m_scratch = new uint8_t[ SparseBound() ];
+	}
+	uint32_t Bound() const { return LZ4_compressBound( SparseBound() ); }
+
+	uint32_t Encode( uint32_t, const uint8_t* delta, uint8_t* out )
+	{
+		uint8_t* sparse = m_lz4 ? m_scratch : out;
+		uint8_t* write = sparse;
+		uint32_t i = 0;
+		while ( i < m_bytes )
+		{
+			uint32_t zeros = i;
+			while ( i < m_bytes && delta[ i ] == 0 )
+			{
+				i++;
+			}
+			uint32_t literals = i;
+			while ( i < m_bytes && delta[ i ] != 0 )
+			{
+				i++;
+			}
+			write = PutVarint( write, literals - zeros );
+			write = PutVarint( write, i - literals );
+			memcpy( write, delta + literals, i - literals );
+			write += i - literals;
+		}
+
+		uint32_t sparseBytes = write - sparse;
+		if ( !m_lz4 )
+		{
+			return sparseBytes;
+		}
+		return LZ4_compress_default( (const char*)sparse, (char*)out, sparseBytes, Bound() );
+	}
+
+	bool Decode( uint32_t, const uint8_t* in, uint32_t inBytes, uint8_t* delta )
+	{
+		const uint8_t* read = in;
+		const uint8_t* end = in + inBytes;
+		if ( m_lz4 )
+		{
+			int sparseBytes = LZ4_decompress_safe( (const char*)in, (char*)m_scratch, inBytes, SparseBound() );
+			if ( sparseBytes < 0 )
+			{
+				return false;
+			}
+			read = m_scratch;
+			end = m_scratch + sparseBytes;
+		}
+
+		uint32_t i = 0;
+		while ( read < end )
+		{
+			uint32_t zeros;
+			uint32_t literals;
+			read = GetVarint( read, end, &zeros );
+			read = read ? GetVarint( read, end, &literals ) : nullptr;
+			if ( !read || i + zeros + literals > m_bytes || literals > (uint32_t)( end - read ) )
+			{
+				return false;
+			}
+			memset( delta + i, 0, zeros );
+			i += zeros;
+			memcpy( delta + i, read, literals );
+			i += literals;
+			read += literals;
+		}
+		return i == m_bytes;
+	}
+
+private:
+	// Worst case alternates single zero and non-zero bytes
+	uint32_t SparseBound() const { return m_bytes * 2 + 16; }
+
+	bool m_lz4;
+	uint8_t* m_scratch;
+};
+
+// Groups byte 0 of every 4-byte field, then byte 1, and so on, so the
+// slow-changing exponent bytes of floats end up next to each other
+class Shuffle : public Codec
+{
+public:
+	Shuffle() : m_scratch( nullptr ) {}
+	~Shuffle() { delete[] m_scratch; }
+	const char* Name() const { return "shuffle4 + lz4"; }
+
+	void Reset( uint32_t snapshotBytes )
+	{
+		Codec::Reset( snapshotBytes );
+		delete[] m_scratch;
+		m_scratch = new uint8_t[ snapshotBytes ];
+	}
+
+	uint32_t Encode( uint32_t, const uint8_t* delta, uint8_t* out )
+	{
+		uint32_t words = m_bytes / 4;
+		for ( uint32_t w = 0; w < words; w++ )
+		{
+			for ( uint32_t b = 0; b < 4; b++ )
+			{
+				m_scratch[ b * words + w ] = delta[ w * 4 + b ];
+			}
+		}
+		memcpy( m_scratch + words * 4, delta + words * 4, m_bytes - words * 4 );
+		return LZ4_compress_default( (const char*)m_scratch, (char*)out, m_bytes, Bound() );
+	}
+
+	bool Decode( uint32_t, const uint8_t* in, uint32_t inBytes, uint8_t* delta )
+	{
+		if ( LZ4_decompress_safe( (const char*)in, (char*)m_scratch, inBytes, m_bytes ) != (int)m_bytes )
+		{
+			return false;
+		}
+		uint32_t words = m_bytes / 4;
+		for ( uint32_t w = 0; w < words; w++ )
+		{
+			for ( uint32_t b = 0; b < 4; b++ )
+			{
+				delta[ w * 4 + b ] = m_scratch[ b * words + w ];
+			}
+		}
+		memcpy( delta + words * 4, m_scratch + words * 4, m_bytes - words * 4 );
+		return true;
+	}
+
+private:
+	uint8_t* m_scratch;
+};
+
+//-----------
+// Harness
+//-----------
+
+// Best of kPasses for each direction. A codec with per-client history is reset
+// before every pass so encoder and decoder histories line up.
+void Run( Codec* codec, std::vector< Snapshot >& snapshots, uint32_t snapshotBytes, uint8_t* arena )
+{
+	double bestEncode = 0.0;
+	double bestDecode = 0.0;
+	uint64_t encodedTotal = 0;
+	bool ok = true;
+	uint8_t* decoded = new uint8_t[ snapshotBytes ];
+
+	for ( uint32_t pass = 0; pass < kPasses && ok; pass++ )
+	{
+		codec->Reset( snapshotBytes );
+
+		uint8_t* out = arena;
+		encodedTotal = 0;
+		double start = NowNs();
+		for ( size_t i = 0; i < snapshots.size(); i++ )
+		{
+			Snapshot& snapshot = snapshots[ i ];
+			snapshot.encoded = out;
+			snapshot.encodedBytes = codec->Encode( snapshot.client, snapshot.delta, out );
+			out += snapshot.encodedBytes;
+			encodedTotal += snapshot.encodedBytes;
+		}
+		double encodeNs = NowNs() - start;
+
+		start = NowNs();
+		for ( size_t i = 0; i < snapshots.size(); i++ )
+		{
+			const Snapshot& snapshot = snapshots[ i ];
+			ok &= codec->Decode( snapshot.client, snapshot.encoded, snapshot.encodedBytes, decoded );
+		}
+		double decodeNs = NowNs() - start;
+
+		// Checked outside the timed loop; decoding again must reproduce the input
+		codec->Reset( snapshotBytes );
+		for ( size_t i = 0; i < snapshots.size() && ok; i++ )
+		{
+			Snapshot& snapshot = snapshots[ i ];
+			uint32_t encodedBytes = codec->Encode( snapshot.client, snapshot.delta, out );
+			ok = codec->Decode( snapshot.client, out, encodedBytes, decoded ) && memcmp( decoded, snapshot.delta, snapshotBytes ) == 0;
+		}
+
+		double rawBytes = (double)snapshots.size() * snapshotBytes;
+		bestEncode = pass == 0 || rawBytes / encodeNs > bestEncode ? rawBytes / encodeNs : bestEncode;
+		bestDecode = pass == 0 || rawBytes / decodeNs > bestDecode ? rawBytes / decodeNs : bestDecode;
+	}
+
+	double ratio = (double)snapshots.size() * snapshotBytes / encodedTotal;
+	printf( "%-16s %8.2f %12.0f %12.0f %10.1f%s\n", codec->Name(), ratio, bestEncode * 1000.0, bestDecode * 1000.0,
+		(double)encodedTotal / snapshots.size(), ok ? "" : "  ROUND TRIP FAILED" );
+
+	delete[] decoded;
+}
+
+int main( int argc, char* argv[] )
+{
+	if ( argc < 2 )
+	{
+		printf( "Usage: bench_codecs <corpus> [maxSnapshots]\n" );
+		return -1;
+	}
+	uint32_t maxSnapshots = argc > 2 ? atoi( argv[ 2 ] ) : 5000;
+
+	FILE* file = fopen( argv[ 1 ], "rb" );
+	if ( !file )
+	{
+		printf( "Could not open %s\n", argv[ 1 ] );
+		return -1;
+	}
+
+	CorpusHeader header;
+	if ( fread( &header, sizeof(header), 1, file ) != 1 || header.magic != kCorpusMagic || header.version != kCorpusVersion )
+	{
+		printf( "%s is not a snapshot corpus\n", argv[ 1 ] );
+		return -1;
+	}
+
+	uint32_t snapshotBytes = header.snapshotBytes;
+	std::vector< Snapshot > snapshots;
+	std::vector< uint8_t* > deltas;
+	CorpusRecord record;
+	while ( snapshots.size() < maxSnapshots && fread( &record, sizeof(record), 1, file ) == 1 )
+	{
+		uint8_t* delta = new uint8_t[ snapshotBytes ];
+		if ( fread( delta, snapshotBytes, 1, file ) != 1 )
+		{
+			delete[] delta;
+			break;
+		}
+
+		Snapshot snapshot;
+		snapshot.client = record.client % kMaxClients;
+		snapshot.delta = delta;
+		snapshot.encoded = nullptr;
+		snapshot.encodedBytes = 0;
+		snapshots.push_back( snapshot );
+		deltas.push_back( delta );
+	}
+	fclose( file );
+
+	if ( snapshots.empty() )
+	{
+		printf( "%s holds no snapshots\n", argv[ 1 ] );
+		return -1;
+	}
+
+	Codec* codecs[] =
+	{
+		new Lz4Fast( 1 ),
+		new Lz4Fast( 2 ),
+		new Lz4Fast( 4 ),
+		new Lz4Fast( 8 ),
+		new Lz4Fast( 16 ),
+		new Lz4Fast( 32 ),
+		new Lz4ExtState(),
+		new Lz4Stream(),
+		new Sparse( false ),
+		new Sparse( true ),
+		new Shuffle(),
+	};
+	const uint32_t codecCount = sizeof(codecs) / sizeof(codecs[ 0 ]);
+
+	// Room for the worst case of any codec on every snapshot
+	uint32_t bound = 0;
+	for ( uint32_t c = 0; c < codecCount; c++ )
+	{
+		codecs[ c ]->Reset( snapshotBytes );
+		bound = codecs[ c ]->Bound() > bound ? codecs[ c ]->Bound() : bound;
+	}
+	uint8_t* arena = new uint8_t[ (size_t)bound * ( snapshots.size() + 1 ) ];
+
+	printf( "%zu snapshots of %u bytes, best of %u passes\n", snapshots.size(), snapshotBytes, kPasses );
+	printf( "%-16s %8s %12s %12s %10s\n", "codec", "ratio", "encode MB/s", "decode MB/s", "avg bytes" );
+	for ( uint32_t c = 0; c < codecCount; c++ )
+	{
+		Run( codecs[ c ], snapshots, snapshotBytes, arena );
+		delete codecs[ c ];
+	}
+
+	delete[] arena;
+	for ( size_t i = 0; i < deltas.size(); i++ )
+	{
+		delete[] deltas[ i ];
+	}
+	return 0;
+}
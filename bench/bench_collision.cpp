@@ -0,0 +1,181 @@
+// Measures the spatial hash collision pass at entity counts well above the
+// game's caps, against a brute-force all-pairs check of the same tests.
+//
+// Usage: bench_collision
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Collision.h"
+
+const float kDt = 1.0f / 60.0f;
+const uint32_t kTicks = 300;
+const uint32_t kShips = 256;
+
+float Random( float lo, float hi )
+{
+	return lo + ( hi - lo ) * ( rand() / (float)RAND_MAX );
+}
+
+double NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+// Reference: every laser against every asteroid and ship, every ship against
+// every asteroid
+template< uint32_t NA, uint32_t NL >
+uint32_t AllPairs( const ShipArray< kShips >& ships, const AsteroidArray< NA >& asteroids, const LaserArray< NL >& lasers, float dt )
+{
+	uint32_t hits = 0;
+	for ( uint32_t k = 0; k < lasers.count; k++ )
+	{
+		uint32_t i = lasers.dense[ k ];
+		float dx = lasers.velocityX[ i ] * dt;
+		float dy = lasers.velocityY[ i ] * dt;
+		float x = lasers.positionX[ i ] - dx;
+		float y = lasers.positionY[ i ] - dy;
+		float best = 2.0f;
+		for ( uint32_t a = 0; a < asteroids.count; a++ )
+		{
+			uint32_t j = asteroids.dense[ a ];
+			float t = SweptCircle( dx, dy, WrapDelta( asteroids.positionX[ j ] - x, kWidthUnits ),
+				WrapDelta( asteroids.positionY[ j ] - y, kHeightUnits ), AsteroidRadius( asteroids.size[ j ] ) );
+			if ( t >= 0.0f && t < best ) { best = t; }
+		}
+		for ( uint32_t s = 0; s < ships.count; s++ )
+		{
+			uint32_t j = ships.dense[ s ];
+			if ( ships.id[ j ] == lasers.owner[ i ] ) { continue; }
+			float t = SweptCircle( dx, dy, WrapDelta( ships.positionX[ j ] - x, kWidthUnits ),
+				WrapDelta( ships.positionY[ j ] - y, kHeightUnits ), kShipRadius );
+			if ( t >= 0.0f && t < best ) { best = t; }
+		}
+		hits += best <= 1.0f;
+	}
+
+	for ( uint32_t s = 0; s < ships.count; s++ )
+	{
+		uint32_t i = ships.dense[ s ];
+		for ( uint32_t a = 0; a < asteroids.count; a++ )
+		{
+			uint32_t j = asteroids.dense[ a ];
+			float cx = WrapDelta( asteroids.positionX[ j ] - ships.positionX[ i ], kWidthUnits );
+			float cy = WrapDelta( asteroids.positionY[ j ] - ships.positionY[ i ], kHeightUnits );
+			float r = kShipRadius + AsteroidRadius( asteroids.size[ j ] );
+			if ( cx * cx + cy * cy <= r * r )
+			{
+				hits++;
+				break;
+			}
+		}
+	}
+	return hits;
+}
+
+template< uint32_t NA, uint32_t NL >
+void Run( bool allPairs )
+{
+	ShipArray< kShips >* ships = new ShipArray< kShips >();
+	AsteroidArray< NA >* asteroids = new AsteroidArray< NA >();
+	LaserArray< NL >* lasers = new LaserArray< NL >();
+	CollisionSystem< kShips, NA, NL >* collision = new CollisionSystem< kShips, NA, NL >();
+	collision->Initialize();
+
+	srand( 1 );
+	for ( uint32_t i = 0; i < kShips; i++ )
+	{
+		uint32_t s = ships->Allocate();
+		ships->Clear( s );
+		ships->id[ s ] = s + 1;
+		ships->positionX[ s ] = Random( -kWidthUnits, kWidthUnits );
+		ships->positionY[ s ] = Random( -kHeightUnits, kHeightUnits );
+		ships->SetRotation( s, Random( -M_PI, M_PI ) );
+	}
+	for ( uint32_t i = 0; i < NA; i++ )
+	{
+		uint32_t a = asteroids->Allocate();
+		asteroids->Clear( a );
+		asteroids->positionX[ a ] = Random( -kWidthUnits, kWidthUnits );
+		asteroids->positionY[ a ] = Random( -kHeightUnits, kHeightUnits );
+		asteroids->velocityX[ a ] = Random( -3.0f, 3.0f );
+		asteroids->velocityY[ a ] = Random( -3.0f, 3.0f );
+		// Scaled down so thousands of them don't blanket the whole world
+		asteroids->size[ a ] = Random( kAsteroidSizeMin, kAsteroidSizeMin + kAsteroidSizeRange ) * 0.1f;
+	}
+
+	float accel[ kShips ];
+	float turn[ kShips ];
+	for ( uint32_t i = 0; i < kShips; i++ )
+	{
+		accel[ i ] = 1.0f;
+		turn[ i ] = ( i & 1 ) ? 1.0f : -1.0f;
+	}
+
+	double total = 0.0;
+	double worst = 0.0;
+	double bruteTotal = 0.0;
+	uint32_t hits = 0;
+	uint32_t bruteHits = 0;
+	for ( uint32_t tick = 0; tick < kTicks; tick++ )
+	{
+		// Keep the laser population topped up as old ones leave the world
+		while ( lasers->count < NL )
+		{
+			uint32_t l = lasers->Allocate();
+			uint32_t s = ships->dense[ rand() % ships->count ];
+			lasers->Clear( l );
+			lasers->positionX[ l ] = Random( -kWidthUnits, kWidthUnits );
+			lasers->positionY[ l ] = Random( -kHeightUnits, kHeightUnits );
+			float rotation = Random( -M_PI, M_PI );
+			lasers->velocityX[ l ] = sinf( rotation ) * kLaserSpeed;
+			lasers->velocityY[ l ] = cosf( rotation ) * kLaserSpeed;
+			lasers->life[ l ] = kLaserLifeTime;
+			lasers->owner[ l ] = ships->id[ s ];
+		}
+
+		ships->Update( kDt, accel, turn );
+		asteroids->Update( kDt );
+		lasers->Update( kDt );
+
+		double start = NowNs();
+		collision->Update( *ships, *asteroids, *lasers, kDt );
+		double elapsed = NowNs() - start;
+		total += elapsed;
+		worst = std::max( worst, elapsed );
+		hits += collision->CollisionCount();
+
+		if ( allPairs )
+		{
+			start = NowNs();
+			bruteHits += AllPairs( *ships, *asteroids, *lasers, kDt );
+			bruteTotal += NowNs() - start;
+		}
+	}
+
+	printf( "asteroids %5u lasers %5u ships %3u  grid %8.1f us/tick (worst %8.1f)  hits %6u",
+		NA, NL, kShips, total / kTicks / 1000.0, worst / 1000.0, hits );
+	if ( allPairs )
+	{
+		printf( "  all-pairs %9.1f us/tick  hits %6u", bruteTotal / kTicks / 1000.0, bruteHits );
+	}
+	printf( "\n" );
+
+	delete ships;
+	delete asteroids;
+	delete lasers;
+	delete collision;
+}
+
+int main()
+{
+	printf( "%u ticks at %.4f s\n", kTicks, kDt );
+	Run< 1024, 1024 >( true );
+	Run< 2048, 2048 >( true );
+	Run< 4096, 4096 >( false );
+	Run< 8192, 8192 >( false );
+	return 0;
+}
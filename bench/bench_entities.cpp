@@ -0,0 +1,283 @@
+// Compares the structure-of-arrays entity kernels in Game.h against the
+// array-of-structs loops they replaced, at capacities well above the game's.
+//
+// Usage: bench_entities [capacity] [aliveFraction]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Entity.h"
+
+const float kDt = 1.0f / 60.0f;
+const uint32_t kIterations = 200;
+
+//-----------
+// Array-of-structs reference
+//-----------
+
+struct AosShip
+{
+	void Update( double dt, float accel, float turn );
+
+	ShipId id;
+	bool alive;
+	vec2 position;
+	vec2 velocity;
+	float rotation;
+	float rotationVelocity;
+	bool local;
+};
+
+struct AosAsteroid
+{
+	bool alive;
+	vec2 position;
+	float rotation;
+	vec2 velocity;
+	float size;
+};
+
+struct AosLaser
+{
+	void Update( double dt );
+
+	bool alive;
+	vec2 position;
+	float rotation;
+	double life;
+};
+
+void AosShip::Update( double dt, float accel, float turn )
+{
+	if ( !alive )
+	{
+		return;
+	}
+
+	vec2 dir( sinf(rotation), cosf(rotation) );
+
+	velocity += dir * accel * kShipAcceleration * dt;
+	velocity *= 0.99f;
+	if ( length( velocity ) < 0.001f )
+	{
+		velocity = vec2( 0.0f, 0.0f );
+	}
+
+	rotationVelocity += kShipRotateSpeed * turn * dt;
+	rotationVelocity *= 0.98f;
+	if ( fabs( rotationVelocity ) < 0.001f )
+	{
+		rotationVelocity = 0.0f;
+	}
+
+	position += velocity * dt;
+	rotation += rotationVelocity * dt;
+	
+	if( position.x < -kWidthUnits ) { position.x += kWidthUnits * 2; }
+	if( position.x > kWidthUnits ) { position.x -= kWidthUnits * 2; }
+	if( position.y < -kHeightUnits ) { position.y += kHeightUnits * 2; }
+	if( position.y > kHeightUnits ) { position.y -= kHeightUnits * 2; }
+}
+
+void AosLaser::Update( double dt )
+{
+	if ( !alive )
+	{
+		return;
+	}
+
+	life -= dt;
+	if ( life <= 0.0 )
+	{
+		alive = false;
+		return;
+	}
+	
+	vec2 direction( sinf(rotation), cosf(rotation) ); 
+	position += direction * kLaserSpeed * dt;
+	
+	if( position.x < -kWidthUnits ) { alive = false; }
+	if( position.x > kWidthUnits ) { alive = false; }
+	if( position.y < -kHeightUnits ) { alive = false; }
+	if( position.y > kHeightUnits ) { alive = false; }
+}
+
+//-----------
+// Harness
+//-----------
+
+float Random( float lo, float hi )
+{
+	return lo + ( hi - lo ) * ( rand() / (float)RAND_MAX );
+}
+
+double NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void Report( const char* name, uint32_t capacity, double aosNs, double soaNs )
+{
+	double entities = (double)capacity * kIterations;
+	printf( "%-10s %8u  aos %8.3f ent/ns  soa %8.3f ent/ns  (%.2fx)\n",
+		name, capacity, entities / aosNs, entities / soaNs, aosNs / soaNs );
+}
+
+template< uint32_t N >
+void Run( float aliveFraction )
+{
+	AosShip* aosShips = new AosShip[ N ];
+	AosAsteroid* aosAsteroids = new AosAsteroid[ N ];
+	AosLaser* aosLasers = new AosLaser[ N ];
+	ShipArray< N >* ships = new ShipArray< N >();
+	AsteroidArray< N >* asteroids = new AsteroidArray< N >();
+	LaserArray< N >* lasers = new LaserArray< N >();
+	float* accel = new float[ N ];
+	float* turn = new float[ N ];
+
+	for ( uint32_t i = 0; i < N; i++ )
+	{
+		ships->Allocate();
+		asteroids->Allocate();
+		lasers->Allocate();
+	}
+
+	srand( 1 );
+	for ( uint32_t i = 0; i < N; i++ )
+	{
+		bool alive = Random( 0.0f, 1.0f ) < aliveFraction;
+		vec2 position( Random( -kWidthUnits, kWidthUnits ), Random( -kHeightUnits, kHeightUnits ) );
+		vec2 velocity( Random( -3.0f, 3.0f ), Random( -3.0f, 3.0f ) );
+		float rotation = Random( -M_PI, M_PI );
+		accel[ i ] = (float)( rand() % 3 - 1 );
+		turn[ i ] = (float)( rand() % 3 - 1 );
+
+		AosShip& aosShip = aosShips[ i ];
+		aosShip = AosShip();
+		aosShip.alive = alive;
+		aosShip.position = position;
+		aosShip.velocity = velocity;
+		aosShip.rotation = rotation;
+
+		AosAsteroid& aosAsteroid = aosAsteroids[ i ];
+		aosAsteroid = AosAsteroid();
+		aosAsteroid.alive = alive;
+		aosAsteroid.position = position;
+		aosAsteroid.velocity = velocity;
+		aosAsteroid.rotation = rotation;
+
+		// Long-lived lasers so the population doesn't drain during the run
+		AosLaser& aosLaser = aosLasers[ i ];
+		aosLaser.alive = alive;
+		aosLaser.position = vec2( 0.0f, 0.0f );
+		aosLaser.rotation = rotation;
+		aosLaser.life = 1000.0;
+
+		ships->Clear( i );
+		asteroids->Clear( i );
+		lasers->Clear( i );
+		ships->positionX[ i ] = asteroids->positionX[ i ] = position.x;
+		ships->positionY[ i ] = asteroids->positionY[ i ] = position.y;
+		ships->velocityX[ i ] = asteroids->velocityX[ i ] = velocity.x;
+		ships->velocityY[ i ] = asteroids->velocityY[ i ] = velocity.y;
+		ships->SetRotation( i, rotation );
+		asteroids->rotation[ i ] = rotation;
+		lasers->velocityX[ i ] = sinf( rotation ) * kLaserSpeed;
+		lasers->velocityY[ i ] = cosf( rotation ) * kLaserSpeed;
+		lasers->life[ i ] = 1000.0f;
+
+		if ( !alive )
+		{
+			ships->Free( i );
+			asteroids->Free( i );
+			lasers->Free( i );
+		}
+	}
+
+	double start = NowNs();
+	for ( uint32_t it = 0; it < kIterations; it++ )
+	{
+		for ( uint32_t i = 0; i < N; i++ )
+		{
+			aosShips[ i ].Update( kDt, accel[ i ], turn[ i ] );
+		}
+	}
+	double aosShipNs = NowNs() - start;
+
+	start = NowNs();
+	for ( uint32_t it = 0; it < kIterations; it++ )
+	{
+		ships->Update( kDt, accel, turn );
+	}
+	Report( "ships", N, aosShipNs, NowNs() - start );
+
+	start = NowNs();
+	for ( uint32_t it = 0; it < kIterations; it++ )
+	{
+		for ( uint32_t i = 0; i < N; i++ )
+		{
+			AosAsteroid* asteroid = &aosAsteroids[ i ];
+			if ( !asteroid->alive )
+			{
+				continue;
+			}
+			
+			asteroid->rotation += kDt;
+			asteroid->position += asteroid->velocity * kDt;
+			
+			if( asteroid->position.x < -kWidthUnits ) { asteroid->position.x += kWidthUnits * 2; }
+			if( asteroid->position.x > kWidthUnits ) { asteroid->position.x -= kWidthUnits * 2; }
+			if( asteroid->position.y < -kHeightUnits ) { asteroid->position.y += kHeightUnits * 2; }
+			if( asteroid->position.y > kHeightUnits ) { asteroid->position.y -= kHeightUnits * 2; }
+		}
+	}
+	double aosAsteroidNs = NowNs() - start;
+
+	start = NowNs();
+	for ( uint32_t it = 0; it < kIterations; it++ )
+	{
+		asteroids->Update( kDt );
+	}
+	Report( "asteroids", N, aosAsteroidNs, NowNs() - start );
+
+	start = NowNs();
+	for ( uint32_t it = 0; it < kIterations; it++ )
+	{
+		for ( uint32_t i = 0; i < N; i++ )
+		{
+			aosLasers[ i ].Update( kDt );
+		}
+	}
+	double aosLaserNs = NowNs() - start;
+
+	start = NowNs();
+	for ( uint32_t it = 0; it < kIterations; it++ )
+	{
+		lasers->Update( kDt );
+	}
+	Report( "lasers", N, aosLaserNs, NowNs() - start );
+
+	delete[] aosShips;
+	delete[] aosAsteroids;
+	delete[] aosLasers;
+	delete ships;
+	delete asteroids;
+	delete lasers;
+	delete[] accel;
+	delete[] turn;
+}
+
+int main( int argc, char* argv[] )
+{
+	float aliveFraction = argc > 1 ? atof( argv[ 1 ] ) : 0.75f;
+
+	printf( "alive fraction %.2f, %u iterations\n", aliveFraction, kIterations );
+	Run< 128 >( aliveFraction );
+	Run< 1024 >( aliveFraction );
+	Run< 16384 >( aliveFraction );
+	Run< 65536 >( aliveFraction );
+
+	return 0;
+}
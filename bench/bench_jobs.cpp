@@ -0,0 +1,166 @@
+// Measures how the chunked entity update scales across the job system, from a
+// single thread up to one per core, and checks every thread count produces the
+// same state as the serial kernels.
+//
+// Usage: bench_jobs [maxThreads]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Entity.h"
+#include "JobSystem.h"
+
+const float kDt = 1.0f / 60.0f;
+const uint32_t kTicks = 200;
+const uint32_t kWordsPerChunk = 4;
+
+const uint32_t kShips = 4096;
+const uint32_t kAsteroids = 65536;
+const uint32_t kLasers = 65536;
+
+struct World
+{
+	ShipArray< kShips > ships;
+	AsteroidArray< kAsteroids > asteroids;
+	LaserArray< kLasers > lasers;
+	float accel[ kShips ];
+	float turn[ kShips ];
+	uint32_t expired[ LaserArray< kLasers >::kWords ];
+};
+
+float Random( float lo, float hi )
+{
+	return lo + ( hi - lo ) * ( rand() / (float)RAND_MAX );
+}
+
+void Populate( World* world )
+{
+	memset( world, 0, sizeof(*world) );
+	srand( 1 );
+
+	for ( uint32_t i = 0; i < kShips; i++ )
+	{
+		uint32_t s = world->ships.Allocate();
+		world->ships.Clear( s );
+		world->ships.positionX[ s ] = Random( -kWidthUnits, kWidthUnits );
+		world->ships.positionY[ s ] = Random( -kHeightUnits, kHeightUnits );
+		world->ships.SetRotation( s, Random( -M_PI, M_PI ) );
+		world->accel[ s ] = rand() % 2;
+		world->turn[ s ] = rand() % 3 - 1.0f;
+	}
+
+	for ( uint32_t i = 0; i < kAsteroids; i++ )
+	{
+		uint32_t a = world->asteroids.Allocate();
+		world->asteroids.positionX[ a ] = Random( -kWidthUnits, kWidthUnits );
+		world->asteroids.positionY[ a ] = Random( -kHeightUnits, kHeightUnits );
+		world->asteroids.velocityX[ a ] = Random( -3.0f, 3.0f );
+		world->asteroids.velocityY[ a ] = Random( -3.0f, 3.0f );
+		world->asteroids.size[ a ] = Random( kAsteroidSizeMin, kAsteroidSizeMin + kAsteroidSizeRange );
+	}
+
+	// Lasers expire throughout the run so the deferred free path gets exercised
+	for ( uint32_t i = 0; i < kLasers; i++ )
+	{
+		uint32_t l = world->lasers.Allocate();
+		float angle = Random( -M_PI, M_PI );
+		world->lasers.positionX[ l ] = Random( -kWidthUnits, kWidthUnits );
+		world->lasers.positionY[ l ] = Random( -kHeightUnits, kHeightUnits );
+		world->lasers.velocityX[ l ] = sinf( angle ) * kLaserSpeed;
+		world->lasers.velocityY[ l ] = cosf( angle ) * kLaserSpeed;
+		world->lasers.life[ l ] = Random( 0.0f, kLaserLifeTime );
+	}
+}
+
+void ShipJob( void* data, uint32_t begin, uint32_t end )
+{
+	World* world = (World*)data;
+	world->ships.UpdateWords( kDt, world->accel, world->turn, begin, end );
+}
+
+void AsteroidJob( void* data, uint32_t begin, uint32_t end )
+{
+	World* world = (World*)data;
+	world->asteroids.UpdateWords( kDt, begin, end );
+}
+
+void LaserJob( void* data, uint32_t begin, uint32_t end )
+{
+	World* world = (World*)data;
+	world->lasers.UpdateWords( kDt, begin, end, world->expired );
+}
+
+void TickSerial( World* world )
+{
+	world->ships.Update( kDt, world->accel, world->turn );
+	world->asteroids.Update( kDt );
+	world->lasers.Update( kDt );
+}
+
+void TickJobs( World* world, JobSystem* jobs )
+{
+	jobs->ParallelFor( world->ships.UsedWords(), kWordsPerChunk, &ShipJob, world );
+
+	JobCounter counter( 0 );
+	jobs->Submit( &counter, world->asteroids.UsedWords(), kWordsPerChunk, &AsteroidJob, world );
+	jobs->Submit( &counter, world->lasers.UsedWords(), kWordsPerChunk, &LaserJob, world );
+	jobs->Wait( &counter );
+	world->lasers.ReleaseExpired( world->expired );
+}
+
+int main( int argc, char* argv[] )
+{
+	uint32_t maxThreads = argc > 1 ? atoi( argv[ 1 ] ) : std::thread::hardware_concurrency();
+	if ( maxThreads == 0 )
+	{
+		maxThreads = 1;
+	}
+
+	World* reference = new World();
+	World* world = new World();
+
+	Populate( reference );
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for ( uint32_t t = 0; t < kTicks; t++ )
+	{
+		TickSerial( reference );
+	}
+	double serialMs = std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - start ).count() / kTicks;
+
+	printf( "%u ships, %u asteroids, %u lasers, %u ticks\n", kShips, kAsteroids, kLasers, kTicks );
+	printf( "%-8s %10s %10s %10s\n", "threads", "ms/tick", "speedup", "matches" );
+	printf( "%-8s %10.3f %10s %10s\n", "serial", serialMs, "1.00", "-" );
+
+	for ( uint32_t threads = 1; threads <= maxThreads; threads = threads < maxThreads && threads * 2 > maxThreads ? maxThreads : threads * 2 )
+	{
+		JobSystem* jobs = new JobSystem();
+		jobs->Initialize( threads );
+
+		Populate( world );
+		start = std::chrono::steady_clock::now();
+		for ( uint32_t t = 0; t < kTicks; t++ )
+		{
+			TickJobs( world, jobs );
+		}
+		double ms = std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - start ).count() / kTicks;
+
+		bool matches = memcmp( &world->ships, &reference->ships, sizeof(world->ships) ) == 0 &&
+			memcmp( &world->asteroids, &reference->asteroids, sizeof(world->asteroids) ) == 0 &&
+			memcmp( &world->lasers, &reference->lasers, sizeof(world->lasers) ) == 0;
+		printf( "%-8u %10.3f %10.2f %10s\n", threads, ms, serialMs / ms, matches ? "yes" : "NO" );
+
+		jobs->Shutdown();
+		delete jobs;
+
+		if ( threads == maxThreads )
+		{
+			break;
+		}
+	}
+
+	delete world;
+	delete reference;
+	return 0;
+}
@@ -0,0 +1,140 @@
+// Compares the CPU side of building a frame for instanced rendering against
+// the per-entity uniform-and-draw loop it replaced, on synthetic states at
+// both capacity policies. No GL context is needed: the per-entity path builds
+// its matrices and counts the calls it would have made, and the instanced path
+// packs its instance buffer. GL calls per frame stand in for driver cost.
+//
+// Usage: bench_render [aliveFraction]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Render.h"
+#include "BenchState.h"
+
+const uint32_t kIterations = 2000;
+
+double NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+//-----------
+// Per-entity reference
+//-----------
+
+struct GLCalls
+{
+	uint32_t draws;
+	uint32_t uniforms;
+	float ( *matrices )[ 3 ][ 3 ]; // Where each uniform upload would have copied from
+};
+
+void ToMatrix( float scale, float sinA, float cosA, const vec2& translation, float outMatrix[3][3] )
+{
+	outMatrix[0][0] = cosA * scale; outMatrix[1][0] = sinA * scale; outMatrix[2][0] = translation.x;
+	outMatrix[0][1] = -sinA * scale; outMatrix[1][1] = cosA * scale; outMatrix[2][1] = translation.y;
+	outMatrix[0][2] = 0.0f; outMatrix[1][2] = 0.0f; outMatrix[2][2] = 1.0f;
+}
+
+// A colour and a matrix uniform plus a draw per ship, a matrix and a draw per
+// asteroid and laser
+template< class Capacity >
+void PerEntityFrame( const GameState< Capacity >& state, GLCalls* calls )
+{
+	uint32_t n = 0;
+	const ShipArray< Capacity::kMaxShips >& ships = state.ships;
+	for ( uint32_t k = 0; k < ships.count; k++ )
+	{
+		uint32_t i = ships.dense[ k ];
+		ToMatrix( 1.0f, ships.directionX[ i ], ships.directionY[ i ], vec2( ships.positionX[ i ], ships.positionY[ i ] ), calls->matrices[ n++ ] );
+		calls->uniforms += 2;
+		calls->draws++;
+	}
+
+	const AsteroidArray< Capacity::kMaxAsteroids >& asteroids = state.asteroids;
+	calls->uniforms++;
+	float4 sinA, cosA;
+	for ( uint32_t k = 0; k < asteroids.count; k++ )
+	{
+		uint32_t i = asteroids.dense[ k ];
+		if ( k % 4 == 0 )
+		{
+			float4 rotation = splat4( 0.0f );
+			for ( uint32_t l = 0; l < 4 && k + l < asteroids.count; l++ )
+			{
+				rotation[ l ] = asteroids.rotation[ asteroids.dense[ k + l ] ];
+			}
+			SinCos4( rotation, &sinA, &cosA );
+		}
+		ToMatrix( asteroids.size[ i ], sinA[ k % 4 ], cosA[ k % 4 ], vec2( asteroids.positionX[ i ], asteroids.positionY[ i ] ), calls->matrices[ n++ ] );
+		calls->uniforms++;
+		calls->draws++;
+	}
+
+	const LaserArray< Capacity::kMaxLasers >& lasers = state.lasers;
+	calls->uniforms++;
+	for ( uint32_t k = 0; k < lasers.count; k++ )
+	{
+		uint32_t i = lasers.dense[ k ];
+		ToMatrix( 0.5f, sinf( 0.5f ), cosf( 0.5f ), vec2( lasers.positionX[ i ], lasers.positionY[ i ] ), calls->matrices[ n++ ] );
+		calls->uniforms++;
+		calls->draws++;
+	}
+}
+
+//-----------
+// Harness
+//-----------
+
+template< class Capacity >
+void Run( const char* name, float aliveFraction )
+{
+	GameState< Capacity >* state = new GameState< Capacity >();
+	FillState( state, aliveFraction );
+	const uint32_t kMaxEntities = Capacity::kMaxShips + Capacity::kMaxAsteroids + Capacity::kMaxLasers;
+	RenderInstance* instances = new RenderInstance[ kMaxEntities ];
+
+	GLCalls calls;
+	memset( &calls, 0, sizeof(calls) );
+	calls.matrices = new float[ kMaxEntities ][ 3 ][ 3 ];
+	double start = NowNs();
+	for ( uint32_t i = 0; i < kIterations; i++ )
+	{
+		PerEntityFrame( *state, &calls );
+	}
+	double perEntityNs = ( NowNs() - start ) / kIterations;
+
+	RenderBatches batches;
+	start = NowNs();
+	for ( uint32_t i = 0; i < kIterations; i++ )
+	{
+		PackInstances( *state, instances, &batches );
+	}
+	double instancedNs = ( NowNs() - start ) / kIterations;
+
+	// One upload and one attribute setup plus a draw per non-empty batch
+	uint32_t instancedDraws = ( batches.ships.count > 0 ) + ( batches.asteroids.count > 0 ) + ( batches.lasers.count > 0 );
+	uint32_t instanceCount = batches.lasers.first + batches.lasers.count;
+
+	printf( "%-10s %6u entities\n", name, instanceCount );
+	printf( "  per-entity  %6u draws %6u uniforms %8.2f us/frame\n", calls.draws / kIterations, calls.uniforms / kIterations, perEntityNs / 1000.0 );
+	printf( "  instanced   %6u draws %6u uploads  %8.2f us/frame (%u bytes)\n", instancedDraws, 1, instancedNs / 1000.0,
+		instanceCount * (uint32_t)sizeof(RenderInstance) );
+
+	delete[] calls.matrices;
+	delete[] instances;
+	delete state;
+}
+
+int main( int argc, char* argv[] )
+{
+	float aliveFraction = argc > 1 ? atof( argv[ 1 ] ) : 1.0f;
+	srand( 1 );
+
+	Run< StandardCapacity >( "standard", aliveFraction );
+	Run< LargeCapacity >( "large", aliveFraction );
+	return 0;
+}
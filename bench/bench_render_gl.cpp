@@ -0,0 +1,318 @@
+// Drives Render through a real GL context with no window or display, so the
+// client's render path can be timed on machines without a GPU. The context is
+// offscreen (CGL on macOS, EGL surfaceless elsewhere, which Mesa backs with
+// llvmpipe) and draws into a framebuffer object. Frames come from synthetic
+// states at a range of entity counts, or from every tick of a replay recorded
+// with `asteroids -s -record <file>`.
+//
+// Submission is the time spent inside Render, which is what the client's
+// thread pays; frame time adds a glFinish, so it includes the driver and
+// rasterising the frame.
+//
+// Usage: bench_render_gl [-frames N] [-size WxH] [-replay <file>]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#if defined( __APPLE__ )
+#include <OpenGL/OpenGL.h>
+#include <OpenGL/gl3.h>
+#else
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GL_GLEXT_PROTOTYPES
+#include <GL/glcorearb.h>
+#endif
+
+#include "Render.h"
+#include "BenchState.h"
+#include "Replay.h"
+#include "JobSystem.h"
+
+const uint32_t kDefaultFrames = 500;
+const uint32_t kWarmupFrames = 10;
+
+double NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+//-----------
+// Offscreen context
+//-----------
+
+bool CreateOffscreenContext( int width, int height )
+{
+#if defined( __APPLE__ )
+	CGLPixelFormatAttribute attributes[] = {
+		kCGLPFAOpenGLProfile, (CGLPixelFormatAttribute)kCGLOGLPVersion_3_2_Core,
+		kCGLPFAAllowOfflineRenderers,
+		(CGLPixelFormatAttribute)0
+	};
+	CGLPixelFormatObj pixelFormat;
+	GLint formats;
+	CGLContextObj context;
+	if ( CGLChoosePixelFormat( attributes, &pixelFormat, &formats ) != kCGLNoError || !pixelFormat )
+	{
+		printf( "No pixel format for a 3.2 core context\n" );
+		return false;
+	}
+	CGLError error = CGLCreateContext( pixelFormat, nullptr, &context );
+	CGLDestroyPixelFormat( pixelFormat );
+	if ( error != kCGLNoError || CGLSetCurrentContext( context ) != kCGLNoError )
+	{
+		printf( "Failed to create a GL context\n" );
+		return false;
+	}
+#else
+	// Surfaceless needs no window system at all; fall back to the default
+	// display where the extension isn't there
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+	if ( getPlatformDisplay )
+	{
+		display = getPlatformDisplay( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr );
+	}
+	if ( display == EGL_NO_DISPLAY )
+	{
+		display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+	}
+
+	EGLint major, minor;
+	if ( display == EGL_NO_DISPLAY || !eglInitialize( display, &major, &minor ) || !eglBindAPI( EGL_OPENGL_API ) )
+	{
+		printf( "Failed to initialize EGL: 0x%x\n", eglGetError() );
+		return false;
+	}
+
+	const EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext( display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, contextAttributes );
+	if ( context == EGL_NO_CONTEXT || !eglMakeCurrent( display, EGL_NO_SURFACE, EGL_NO_SURFACE, context ) )
+	{
+		printf( "Failed to create a 3.3 core context: 0x%x\n", eglGetError() );
+		return false;
+	}
+#endif
+
+	// Neither context has a default framebuffer, so render into our own
+	GLuint framebuffer, colorBuffer;
+	glGenFramebuffers( 1, &framebuffer );
+	glBindFramebuffer( GL_FRAMEBUFFER, framebuffer );
+	glGenRenderbuffers( 1, &colorBuffer );
+	glBindRenderbuffer( GL_RENDERBUFFER, colorBuffer );
+	glRenderbufferStorage( GL_RENDERBUFFER, GL_RGBA8, width, height );
+	glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer );
+	if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+	{
+		printf( "Offscreen framebuffer is incomplete\n" );
+		return false;
+	}
+	glViewport( 0, 0, width, height );
+
+	printf( "%s, %s, %dx%d\n", glGetString( GL_RENDERER ), glGetString( GL_VERSION ), width, height );
+	return true;
+}
+
+//-----------
+// Timing
+//-----------
+
+struct FrameTimes
+{
+	std::vector< double > submitNs;
+	std::vector< double > frameNs;
+	uint64_t instances;
+	uint64_t drawCalls;
+
+	FrameTimes() : instances( 0 ), drawCalls( 0 ) {}
+};
+
+template< class Capacity >
+void TimeFrame( const GameState< Capacity >& state, int width, int height, FrameTimes* times )
+{
+	double start = NowNs();
+	RenderStats stats = Render( state, width, height );
+	double submitted = NowNs();
+	glFinish();
+	double finished = NowNs();
+
+	times->submitNs.push_back( submitted - start );
+	times->frameNs.push_back( finished - start );
+	times->instances += stats.instances;
+	times->drawCalls += stats.drawCalls;
+}
+
+double Percentile( std::vector< double >* samples, double fraction )
+{
+	std::sort( samples->begin(), samples->end() );
+	return ( *samples )[ (size_t)( fraction * ( samples->size() - 1 ) ) ];
+}
+
+double Mean( const std::vector< double >& samples )
+{
+	double sum = 0.0;
+	for ( size_t i = 0; i < samples.size(); i++ )
+	{
+		sum += samples[ i ];
+	}
+	return sum / samples.size();
+}
+
+void PrintTimes( const char* name, FrameTimes* times )
+{
+	size_t frames = times->frameNs.size();
+	if ( !frames )
+	{
+		return;
+	}
+	if ( glGetError() != GL_NO_ERROR )
+	{
+		printf( "%s: GL errors while rendering\n", name );
+	}
+
+	// Means are taken before sorting so they don't depend on it
+	double submitMean = Mean( times->submitNs );
+	double frameMean = Mean( times->frameNs );
+	printf( "%-16s %6llu entities %3llu draws | submit %8.1f %8.1f %8.1f | frame %8.1f %8.1f %8.1f\n", name,
+		(unsigned long long)( times->instances / frames ), (unsigned long long)( times->drawCalls / frames ),
+		submitMean / 1000.0, Percentile( &times->submitNs, 0.5 ) / 1000.0, Percentile( &times->submitNs, 0.99 ) / 1000.0,
+		frameMean / 1000.0, Percentile( &times->frameNs, 0.5 ) / 1000.0, Percentile( &times->frameNs, 0.99 ) / 1000.0 );
+}
+
+//-----------
+// Synthetic states
+//-----------
+
+// Asteroids keep spinning between frames so the instance data changes the way
+// it does in a game
+template< class Capacity >
+void RunSynthetic( const char* capacityName, uint32_t frames, int width, int height )
+{
+	const float kFractions[] = { 0.125f, 0.25f, 0.5f, 1.0f };
+
+	GameState< Capacity >* state = new GameState< Capacity >();
+	for ( uint32_t f = 0; f < sizeof(kFractions) / sizeof(kFractions[ 0 ]); f++ )
+	{
+		srand( 1 );
+		FillState( state, kFractions[ f ] );
+
+		FrameTimes times;
+		for ( uint32_t i = 0; i < kWarmupFrames + frames; i++ )
+		{
+			for ( uint32_t k = 0; k < state->asteroids.count; k++ )
+			{
+				state->asteroids.rotation[ state->asteroids.dense[ k ] ] += 0.01f;
+			}
+			if ( i == kWarmupFrames )
+			{
+				times = FrameTimes();
+			}
+			TimeFrame( *state, width, height, &times );
+		}
+
+		char name[ 32 ];
+		snprintf( name, sizeof(name), "%s %5.1f%%", capacityName, kFractions[ f ] * 100.0f );
+		PrintTimes( name, &times );
+	}
+	delete state;
+}
+
+//-----------
+// Recorded states
+//-----------
+
+// Renders the server's state after every recorded tick, up to frames of them
+// past the warmup
+template< class Capacity >
+int RunReplay( const char* path, uint32_t frames, int width, int height )
+{
+	JobSystem* jobs = new JobSystem();
+	jobs->Initialize( 1 );
+
+	ReplayPlayer< Capacity >* player = new ReplayPlayer< Capacity >();
+	if ( !player->Open( path, jobs ) || !player->Seek( 0 ) )
+	{
+		jobs->Shutdown();
+		return -1;
+	}
+
+	FrameTimes times;
+	uint64_t firstTick = player->Tick();
+	for ( uint32_t i = 0; i < kWarmupFrames + frames && player->Step(); i++ )
+	{
+		if ( i == kWarmupFrames )
+		{
+			times = FrameTimes();
+		}
+		TimeFrame( player->State(), width, height, &times );
+	}
+
+	char name[ 32 ];
+	snprintf( name, sizeof(name), "ticks %llu-%llu", (unsigned long long)firstTick, (unsigned long long)player->Tick() );
+	PrintTimes( name, &times );
+
+	player->Close();
+	jobs->Shutdown();
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	uint32_t frames = kDefaultFrames;
+	int width = 1024;
+	int height = 768;
+	const char* replayPath = nullptr;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		if ( strcmp( "-frames", argv[ i ] ) == 0 && i + 1 < argc )
+		{
+			frames = atoi( argv[ ++i ] );
+		}
+		else if ( strcmp( "-size", argv[ i ] ) == 0 && i + 1 < argc && sscanf( argv[ i + 1 ], "%dx%d", &width, &height ) == 2 )
+		{
+			i++;
+		}
+		else if ( strcmp( "-replay", argv[ i ] ) == 0 && i + 1 < argc )
+		{
+			replayPath = argv[ ++i ];
+		}
+		else
+		{
+			printf( "Usage: bench_render_gl [-frames N] [-size WxH] [-replay <file>]\n" );
+			return 1;
+		}
+	}
+
+	if ( !CreateOffscreenContext( width, height ) || !RenderInit() )
+	{
+		return 1;
+	}
+
+	printf( "times in us as mean, p50, p99\n" );
+	if ( replayPath )
+	{
+		// The recording's capacity policy decides which state it replays into
+		ReplayReader reader;
+		if ( !reader.Open( replayPath ) )
+		{
+			return 1;
+		}
+		bool large = reader.Header().maxShips == LargeCapacity::kMaxShips;
+		reader.Close();
+		return large ? RunReplay< LargeCapacity >( replayPath, frames, width, height ) : RunReplay< StandardCapacity >( replayPath, frames, width, height );
+	}
+
+	RunSynthetic< StandardCapacity >( "standard", frames, width, height );
+	RunSynthetic< LargeCapacity >( "large", frames, width, height );
+	return 0;
+}
@@ -0,0 +1,177 @@
+// Accuracy and throughput of SinCos4 against libm, and the per-frame cost of
+// laser and ship updates that recompute direction every tick versus the cached
+// direction vectors in Entity.h. Build with -DSIMD_FAST_SINCOS to measure the
+// bounded-accuracy polynomial.
+//
+// Usage: bench_trig
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "Entity.h"
+
+const float kDt = 1.0f / 60.0f;
+const uint32_t kFrames = 200;
+
+float Random( float lo, float hi )
+{
+	return lo + ( hi - lo ) * ( rand() / (float)RAND_MAX );
+}
+
+double NowNs()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+void Accuracy()
+{
+	double sinError = 0.0;
+	double cosError = 0.0;
+	for ( double a = -8000.0; a < 8000.0; a += 0.00731 )
+	{
+		float4 s, c;
+		SinCos4( splat4( (float)a ), &s, &c );
+		sinError = fmax( sinError, fabs( s[ 0 ] - sin( (float)a ) ) );
+		cosError = fmax( cosError, fabs( c[ 0 ] - cos( (float)a ) ) );
+	}
+	printf( "SinCos4 max abs error over [-8000, 8000]: sin %.3g cos %.3g\n", sinError, cosError );
+}
+
+void Throughput()
+{
+	const uint32_t kCount = 1 << 16;
+	float* angles = new float[ kCount ];
+	float* sines = new float[ kCount ];
+	float* cosines = new float[ kCount ];
+	for ( uint32_t i = 0; i < kCount; i++ )
+	{
+		angles[ i ] = Random( -M_PI, M_PI );
+	}
+
+	double start = NowNs();
+	for ( uint32_t f = 0; f < kFrames; f++ )
+	{
+		for ( uint32_t i = 0; i < kCount; i++ )
+		{
+			sines[ i ] = sinf( angles[ i ] );
+			cosines[ i ] = cosf( angles[ i ] );
+		}
+	}
+	double libmNs = ( NowNs() - start ) / ( (double)kFrames * kCount );
+
+	start = NowNs();
+	for ( uint32_t f = 0; f < kFrames; f++ )
+	{
+		for ( uint32_t i = 0; i < kCount; i += 4 )
+		{
+			float4 s, c;
+			SinCos4( load4( &angles[ i ] ), &s, &c );
+			store4( &sines[ i ], s );
+			store4( &cosines[ i ], c );
+		}
+	}
+	double simdNs = ( NowNs() - start ) / ( (double)kFrames * kCount );
+
+	printf( "sin+cos per angle: libm %.2f ns  SinCos4 %.2f ns  (%.1fx)\n", libmNs, simdNs, libmNs / simdNs );
+
+	delete[] angles;
+	delete[] sines;
+	delete[] cosines;
+}
+
+// Laser update as it was before directions were cached: rotation is kept per
+// laser and turned into a direction with libm every tick
+template< uint32_t N >
+void LasersFromRotation( LaserArray< N >* lasers, const float* rotation, float dt )
+{
+	for ( uint32_t k = 0; k < lasers->count; k++ )
+	{
+		uint32_t i = lasers->dense[ k ];
+		lasers->positionX[ i ] += sinf( rotation[ i ] ) * kLaserSpeed * dt;
+		lasers->positionY[ i ] += cosf( rotation[ i ] ) * kLaserSpeed * dt;
+	}
+}
+
+template< uint32_t N >
+void Lasers()
+{
+	LaserArray< N >* lasers = new LaserArray< N >();
+	float* rotation = new float[ N ];
+	for ( uint32_t i = 0; i < N; i++ )
+	{
+		uint32_t l = lasers->Allocate();
+		lasers->Clear( l );
+		rotation[ l ] = Random( -M_PI, M_PI );
+		lasers->velocityX[ l ] = sinf( rotation[ l ] ) * kLaserSpeed;
+		lasers->velocityY[ l ] = cosf( rotation[ l ] ) * kLaserSpeed;
+		lasers->life[ l ] = 1000.0f;
+	}
+
+	double start = NowNs();
+	for ( uint32_t f = 0; f < kFrames; f++ )
+	{
+		LasersFromRotation( lasers, rotation, 0.0f );
+	}
+	double recomputeUs = ( NowNs() - start ) / kFrames / 1000.0;
+
+	// Zero dt keeps every laser in bounds so the population stays constant
+	start = NowNs();
+	for ( uint32_t f = 0; f < kFrames; f++ )
+	{
+		lasers->Update( 0.0f );
+	}
+	double cachedUs = ( NowNs() - start ) / kFrames / 1000.0;
+
+	printf( "lasers %6u  per-tick sin/cos %8.1f us/frame  cached velocity %8.1f us/frame\n", N, recomputeUs, cachedUs );
+
+	delete lasers;
+	delete[] rotation;
+}
+
+template< uint32_t N >
+void Ships( float turningFraction )
+{
+	ShipArray< N >* ships = new ShipArray< N >();
+	float* accel = new float[ N ];
+	float* turn = new float[ N ];
+	for ( uint32_t i = 0; i < N; i++ )
+	{
+		uint32_t s = ships->Allocate();
+		ships->Clear( s );
+		ships->SetRotation( s, Random( -M_PI, M_PI ) );
+		accel[ s ] = 1.0f;
+		turn[ s ] = Random( 0.0f, 1.0f ) < turningFraction ? 1.0f : 0.0f;
+	}
+
+	double start = NowNs();
+	for ( uint32_t f = 0; f < kFrames; f++ )
+	{
+		ships->Update( kDt, accel, turn );
+	}
+	double us = ( NowNs() - start ) / kFrames / 1000.0;
+
+	printf( "ships  %6u  %3.0f%% turning %8.1f us/frame\n", N, turningFraction * 100.0f, us );
+
+	delete ships;
+	delete[] accel;
+	delete[] turn;
+}
+
+int main()
+{
+	srand( 1 );
+#ifdef SIMD_FAST_SINCOS
+	printf( "SIMD_FAST_SINCOS\n" );
+#endif
+	Accuracy();
+	Throughput();
+	Lasers< 1024 >();
+	Lasers< 16384 >();
+	Lasers< 65536 >();
+	Ships< 16384 >( 0.0f );
+	Ships< 16384 >( 0.1f );
+	Ships< 16384 >( 1.0f );
+	return 0;
+}
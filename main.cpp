@@ -4,294 +4,296 @@
 #include <cstdlib>
 #include <cassert>
 #include <chrono>
+#include <atomic>
+#include <thread>
 #include <unistd.h>
 
 #include <SDL.h>
-#include <OpenGL/gl3.h>
 
 #include "Game.h"
+#include "RoomManager.h"
+#include "Render.h"
+#include "TripleBuffer.h"
+#include "Replay.h"
+#include "SnapshotCorpus.h"
+#include "Logger.h"
+#include "NetStats.h"
+#include "Profiler.h"
+#include "Tracer.h"
 #include "Socket.h"
 
 const double kFrameTime = 1.0 / 60.0;
+const uint32_t kCorpusSnapshots = 20000;
 #define DEFAULT_PORT 7777
 
-GLint g_colorLocation = -1;
-
 //-----------
 // Render
 //-----------
 
-bool CreateProgram( GLuint* program )
-{
-	assert(program != nullptr);
-	
-	const char* vertexShaderString = "\
-	#version 330\n \
-	layout(location = 0) in vec3 position; \
-	uniform mat3 model; \
-	uniform vec2 invFrameSize; \
-	void main() \
-	{ \
-	vec2 pos = invFrameSize * ( model * vec3( position.xy, 1.0 ) ).xy; \
-	gl_Position = vec4( pos, 0.0, 1.0 ); \
-	}";
-	
-	const char* pixelShaderString = "\
-	#version 330\n \
-	out vec4 outputColor; \
-	uniform vec3 color; \
-	void main() \
-	{ \
-	outputColor = vec4( color, 1.0f ); \
-	} ";
-	
-	GLint success;
-	GLchar errorsBuf[256];
-	GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-	GLuint ps = glCreateShader(GL_FRAGMENT_SHADER);
-	GLuint prgm = glCreateProgram();
-	
-	glShaderSource(vs, 1, &vertexShaderString, NULL);
-	glCompileShader(vs);
-	glGetShaderiv(vs, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(vs, sizeof(errorsBuf), 0, errorsBuf);
-		printf("Vertex Shader Errors:\n%s", errorsBuf);
-		return false;
-	}
-	
-	glShaderSource(ps, 1, &pixelShaderString, NULL);
-	glCompileShader(ps);
-	glGetShaderiv(ps, GL_COMPILE_STATUS, &success);
-	if (!success)
-	{
-		glGetShaderInfoLog(ps, sizeof(errorsBuf), 0, errorsBuf);
-		printf("Pixel Shader Errors:\n%s", errorsBuf);
-		return false;
-	}
-	
-	glAttachShader(prgm, vs);
-	glAttachShader(prgm, ps);
-	glLinkProgram(prgm);
-	glGetProgramiv(prgm, GL_LINK_STATUS, &success);
-	if (!success)
-	{
-		glGetProgramInfoLog(prgm, sizeof(errorsBuf), 0, errorsBuf);
-		printf("Program Link Errors:\n%s", errorsBuf);
-		return false;
-	}
+const uint32_t kRenderIdleUs = 1000;
 
-	g_colorLocation = glGetUniformLocation(	prgm, "color" );
-	
-	*program = prgm;
-	
-	return true;
-}
-
-bool RenderInit( SDL_Window* window )
+SDL_GLContext CreateRenderContext( SDL_Window* window )
 {
 	SDL_GL_SetAttribute( SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE );
 	SDL_GL_SetAttribute( SDL_GL_CONTEXT_MAJOR_VERSION, 3 );
-	SDL_GL_SetAttribute( SDL_GL_CONTEXT_MINOR_VERSION, 2 );
+	SDL_GL_SetAttribute( SDL_GL_CONTEXT_MINOR_VERSION, 3 ); // Instanced attributes
 	SDL_GL_SetAttribute( SDL_GL_DOUBLEBUFFER, 1 );
-	SDL_GL_CreateContext( window );
+	SDL_GLContext context = SDL_GL_CreateContext( window );
 	
 	// Enable VSync
 	SDL_GL_SetSwapInterval( 1 );
 	
-	GLuint program = -1;
-	CreateProgram( &program );
-	assert( program != -1 );
-	glUseProgram( program );
-	
-	GLuint vao;
-	glGenVertexArrays( 1, &vao );
-	glBindVertexArray( vao );
-	
-	GLuint shipVB;
-	glGenBuffers( 1, &shipVB );
-	glBindBuffer( GL_ARRAY_BUFFER, shipVB );
-	
-	glEnableVertexAttribArray( 0 );
-	glBindBuffer( GL_ARRAY_BUFFER, shipVB );
-	glVertexAttribPointer( 0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0 );
-	
-	static const GLfloat verts[] = {
-		// Ship
-		0.0f, 1.0f, 1.0f,
-		-0.3f, 0.0f, 1.0f,
-		-0.3f, 0.0f, 1.0f,
-		0.0f,  0.2f, 1.0f,
-		0.0f,  0.2f, 1.0f,
-		0.3f,  0.0f, 1.0f,
-		0.3f,  0.0f, 1.0f,
-		0.0f, 1.0f, 1.0f,
-		
-		// Asteroid 0
-		-0.5f, -0.5f, 1.0f,
-		-0.5f,  0.5f, 1.0f,
-		-0.5f,  0.5f, 1.0f,
-		0.5f,  0.5f, 1.0f,
-		0.5f,  0.5f, 1.0f,
-		0.5f, -0.5f, 1.0f,
-		0.5f, -0.5f, 1.0f,
-		-0.5f, -0.5f, 1.0f,
-	};
-	
-	glBufferData( GL_ARRAY_BUFFER, sizeof( verts ), verts, GL_STATIC_DRAW );
-	
-	return true;
-}
+	bool ok = RenderInit();
+	assert( ok );
 
-void ToMatrix( float scale, float rotationRad, const vec2& translation, float outMatrix[3][3] )
-{
-	float cosA = cosf( rotationRad );
-	float sinA = sinf( rotationRad );
-	
-	outMatrix[0][0] = cosA * scale; outMatrix[1][0] = sinA * scale; outMatrix[2][0] = translation.x;
-	outMatrix[0][1] = -sinA * scale; outMatrix[1][1] = cosA * scale; outMatrix[2][1] = translation.y;
-	outMatrix[0][2] = 0.0f; outMatrix[1][2] = 0.0f; outMatrix[2][2] = 1.0f;
+	// The render thread makes it current for itself
+	SDL_GL_MakeCurrent( window, nullptr );
+	return context;
 }
 
-void Render( const GameState& gameState, SDL_Window* window )
+// Draws and presents on its own thread, so waiting on vsync in the swap never
+// holds up the main loop that ticks the game and services the socket. The main
+// loop publishes a frame after every update; the render thread draws the
+// newest one it finds and skips any that arrived while it was presenting.
+class RenderThread
 {
-	glClearColor( 0.0, 0.0, 0.0, 1.0 );
-	glClear( GL_COLOR_BUFFER_BIT );
-	
-	int width, height;
-	SDL_GetWindowSize( window, &width, &height );
-	vec2 invFrameSize( kGameScale/width, kGameScale/height );
-	
-	glUniform2fv( 0, 1, &invFrameSize.x );
-	
-	// Draw the ship
-	for( uint32_t i = 0; i < kGameMaxShips; i++ )
+public:
+	RenderThread() : m_window( nullptr ), m_context( nullptr ), m_running( false ), m_frames( nullptr ) {}
+
+	void Start( SDL_Window* window, SDL_GLContext context )
 	{
-		const Ship& ship = gameState.ships[ i ];
-		if( !ship.alive ) { continue; }
-		
-		if ( ship.local )
-		{
-			float color[ 3 ] = { 0.0f, 1.0f, 0.0f };
-			glUniform3fv( g_colorLocation, 1, color );
-		}
-		else
-		{
-			float color[ 3 ] = { 1.0f, 1.0f, 1.0f };
-			glUniform3fv( g_colorLocation, 1, color );
-		}
+		m_window = window;
+		m_context = context;
+		m_frames = new TripleBuffer< RenderFrame >();
+		m_running = true;
+		m_thread = std::thread( &RenderThread::Main, this );
+	}
 
-		float modelMat[ 3 ][ 3 ];
-		ToMatrix( 1.0, ship.rotation, ship.position, modelMat );
-		
-		glUniformMatrix3fv( 1, 1, GL_FALSE, &modelMat[0][0] );
-		glDrawArrays( GL_LINES, 0, 8 ); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	void Stop()
+	{
+		m_running = false;
+		m_thread.join();
+		delete m_frames;
+		m_frames = nullptr;
 	}
 
-	// Draw asteriods
-	float asteroidColor[ 3 ] = { 1.0f, 1.0f, 1.0f };
-	glUniform3fv( g_colorLocation, 1, asteroidColor );
-	for( uint32_t i = 0; i < kGameMaxAsteroids; i++ )
+	template< class Capacity >
+	void Submit( const GameState< Capacity >& gameState, int width, int height )
 	{
-		const Asteroid& asteroid = gameState.asteroids[ i ];
-		if( !asteroid.alive ) { continue; }
-		
-		float modelMat[ 3 ][ 3 ];
-		ToMatrix( asteroid.size, asteroid.rotation, asteroid.position, modelMat );
-		
-		glUniformMatrix3fv( 1, 1, GL_FALSE, &modelMat[0][0] );
-		glDrawArrays( GL_LINES, 8, 8 );
+		BuildFrame( gameState, width, height, m_frames->WriteSlot() );
+		m_frames->Publish();
 	}
 
-	// Draw lasers
-	float laserColor[ 3 ] = { 1.0f, 1.0f, 1.0f };
-	glUniform3fv( g_colorLocation, 1, laserColor );
-	for( uint32_t i = 0; i < kGameMaxLasers; i++ )
+private:
+	void Main()
 	{
-		const Laser& laser = gameState.lasers[ i ];
-		if( !laser.alive ) { continue; }
-		
-		float modelMat[ 3 ][ 3 ];
-		ToMatrix( 0.5f, 0.5f, laser.position, modelMat );
-		
-		glUniformMatrix3fv( 1, 1, GL_FALSE, &modelMat[0][0] );
-		glDrawArrays( GL_LINES, 8, 8 );
+		SDL_GL_MakeCurrent( m_window, m_context );
+		while ( m_running )
+		{
+			if ( !m_frames->Acquire() )
+			{
+				usleep( kRenderIdleUs );
+				continue;
+			}
+
+			DrawFrame( *m_frames->ReadSlot() );
+
+			ProfileScope swapScope( kProfileClientSwap );
+			SDL_GL_SwapWindow( m_window );
+		}
+		SDL_GL_MakeCurrent( m_window, nullptr );
 	}
-}
+
+	SDL_Window* m_window;
+	SDL_GLContext m_context;
+	std::atomic< bool > m_running;
+	TripleBuffer< RenderFrame >* m_frames;
+	std::thread m_thread;
+};
 
 //-----------
 // Main
 //-----------
 
-int main( int argc, char* argv[] )
+struct Options
 {
-	GameClient* client = nullptr;
-	GameServer* server = nullptr;
+	bool serverMode;
+	bool headlessMode;
+	const char* hostname;
+	uint16_t port;
+	uint32_t threads;
+	uint32_t playersPerRoom; // 0 runs a single match
+	uint32_t shard;
+	uint32_t shardCount;
+	uint32_t room; // Client only, kAnyRoom to take any free seat
+	double profileInterval; // Seconds between profile dumps, 0 for SIGUSR1 only
+	double traceSeconds; // Length of a trace capture taken at startup, 0 for none
+	const char* statsPath; // Unix socket serving network stats, null for none
+	const char* recordPath; // Server only, records a replay of the match
+	const char* corpusPath; // Server only, captures snapshot deltas for bench_codecs
+	uint32_t maxRewindTicks; // Server only, how far back lag compensation reaches
+	SnapshotRateLimits snapshotRate; // Server only
+	uint32_t snapshotEntityBytes; // Server only, 0 for no limit
+	const char* replayPath; // Replays a recording headlessly instead of running a game
+	uint64_t replayFrom;
+};
 
-	GameState gameState;
-	memset( &gameState, 0, sizeof(gameState) );
+// Plays a recording back as fast as the simulation runs, then prints the
+// profile so builds can be compared on the same match
+template< class Capacity >
+int Replay( Options options )
+{
+	JobSystem* jobs = new JobSystem();
+	jobs->Initialize( options.threads );
 
-	bool serverMode = false;
-	bool headlessMode = true;
-	const char* hostname = "localhost";
-	uint16_t port = DEFAULT_PORT;
-	for ( uint32_t i = 1; i < argc; i++ )
+	ReplayPlayer< Capacity >* player = new ReplayPlayer< Capacity >();
+	if ( !player->Open( options.replayPath, jobs ) || !player->Seek( options.replayFrom ) )
 	{
-		if ( strcmp( "-s", argv[ i ] ) == 0 )
-		{
-			serverMode = true;
-		}
-		else if ( strcmp( "-h", argv[ i ] ) == 0 )
+		jobs->Shutdown();
+		return -1;
+	}
+
+	// Profile only the playback, not the seek
+	ProfileReset();
+	uint64_t firstTick = player->Tick();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	while ( player->Step() )
+	{
+	}
+	double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+
+	uint64_t ticks = player->Tick() - firstTick;
+	printf( "replayed ticks %llu-%llu on %u threads in %.3f s, %.0f ticks/s\n", (unsigned long long)firstTick, (unsigned long long)player->Tick(),
+		jobs->ThreadCount(), seconds, ticks / seconds );
+	printf( "%u keyframes checked, %u diverged\n", player->KeyframesChecked(), player->Mismatches() );
+	ProfileDump( stdout );
+
+	uint32_t mismatches = player->Mismatches();
+	player->Close();
+	jobs->Shutdown();
+	return mismatches ? 1 : 0;
+}
+
+template< class Capacity >
+int Run( Options options )
+{
+	if ( options.replayPath )
+	{
+		return Replay< Capacity >( options );
+	}
+
+	GameClient< Capacity >* client = nullptr;
+	GameServer< Capacity >* server = nullptr;
+	RoomManager< Capacity >* rooms = nullptr;
+	ReplayRecorder* recorder = nullptr;
+	CorpusWriter* corpus = nullptr;
+	JobSystem* jobs = nullptr;
+
+	StatsServer* stats = nullptr;
+
+	GameState< Capacity >* gameState = new GameState< Capacity >();
+	memset( gameState, 0, sizeof(*gameState) );
+
+	// Socket and game errors are logged from the tick, so keep stdio off it
+	LogStart( stdout );
+
+	bool serverMode = options.serverMode;
+	bool headlessMode = options.headlessMode;
+	const char* hostname = options.hostname;
+	uint16_t port = options.port;
+	
+	if ( serverMode )
+	{
+		printf( "server start on port %hu\n", port );
+
+		int listener = socket_server_create_listener( port );
+		if ( options.shardCount > 1 )
 		{
-			headlessMode = false;
+			printf( "server is shard %u of %u\n", options.shard, options.shardCount );
+			socket_server_steer_by_source_port( listener, options.shardCount );
 		}
-		else if ( strcmp( "-a", argv[ i ] ) == 0 )
+
+		jobs = new JobSystem();
+		if ( options.playersPerRoom || options.shardCount > 1 )
 		{
-			if ( i + 1 >= argc )
-			{
-				printf( "Specify a hostname\n" );
-				return -1;
-			}
-			hostname = argv[ i + 1 ];
+			// Each room is one job, so pin workers to keep rooms on warm cores
+			jobs->Initialize( options.threads, true );
+			printf( "server hosting rooms of %u on %u threads\n", options.playersPerRoom, jobs->ThreadCount() );
+
+			rooms = new RoomManager< Capacity >();
+			rooms->Initialize( listener, options.playersPerRoom, jobs, options.shard, options.shardCount );
+			rooms->SetMaxRewind( options.maxRewindTicks );
+			rooms->SetSnapshotRateLimits( options.snapshotRate );
+			rooms->SetSnapshotEntityBytes( options.snapshotEntityBytes );
+			headlessMode = true;
 		}
-		else if ( strcmp( "-p", argv[ i ] ) == 0 )
+		else
 		{
-			if ( i + 1 >= argc )
+			jobs->Initialize( options.threads );
+			printf( "server simulating on %u threads\n", jobs->ThreadCount() );
+
+			server = new GameServer< Capacity >();
+			server->Initialize( listener, gameState, jobs );
+			server->SetMaxRewind( options.maxRewindTicks );
+			server->SetSnapshotRateLimits( options.snapshotRate );
+			server->SetSnapshotEntityBytes( options.snapshotEntityBytes );
+
+			if ( options.recordPath )
 			{
-				printf( "Specify a port number\n" );
-				return -1;
+				recorder = new ReplayRecorder();
+				if ( recorder->Open( options.recordPath, sizeof(ServerKeyframe< Capacity >), Capacity::kMaxShips ) )
+				{
+					server->SetRecorder( recorder );
+				}
 			}
-			port = atoi( argv[ i + 1 ] );
-			if ( port == 0 )
+
+			if ( options.corpusPath )
 			{
-				printf( "Invalid port specified\n" );
-				return -1;
+				corpus = new CorpusWriter();
+				if ( corpus->Open( options.corpusPath, sizeof(GameState< Capacity >), kCorpusSnapshots ) )
+				{
+					server->SetCorpus( corpus );
+				}
 			}
 		}
 	}
-	
-	if ( serverMode )
-	{
-		printf( "server start on port %hu\n", port );
-
-		int listener = socket_server_create_listener( port );
-		server = new GameServer();
-		server->Initialize( listener, &gameState );
-	}
 	else
 	{
 		printf( "client start on %s:%hu\n", hostname, port );
 
-		int sock = socket_client_connect( hostname, port );
-		client = new GameClient();
-		client->Initialize( sock, &gameState );
+		int sock;
+		if ( options.room != kAnyRoom )
+		{
+			sock = ConnectToRoom( hostname, port, options.room, options.shardCount );
+			if ( sock < 0 )
+			{
+				return -1;
+			}
+		}
+		else
+		{
+			sock = socket_client_connect( hostname, port );
+		}
+
+		client = new GameClient< Capacity >();
+		client->Initialize( sock, gameState );
 
 		headlessMode = false;
 	}
-	
+
+	if ( options.statsPath )
+	{
+		stats = new StatsServer();
+		if ( !stats->Initialize( options.statsPath ) )
+		{
+			delete stats;
+			stats = nullptr;
+		}
+	}
+
 	SDL_Window* window = nullptr;
 	SDL_Surface* screenSurface = nullptr;
+	RenderThread* renderThread = nullptr;
 	if ( !headlessMode )
 	{
 		if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
@@ -310,11 +312,21 @@ int main( int argc, char* argv[] )
 		SDL_SetWindowTitle( window, name );
 		screenSurface = SDL_GetWindowSurface( window );
 
-		RenderInit( window );
+		renderThread = new RenderThread();
+		renderThread->Start( window, CreateRenderContext( window ) );
 	}
 	
+	ProfileInstallSignalHandler();
+	ProfileSetDumpInterval( options.profileInterval );
+	TraceInstallSignalHandler();
+	if ( options.traceSeconds > 0.0 )
+	{
+		TraceStart( options.traceSeconds );
+	}
+
 	std::chrono::steady_clock::time_point prevTime = std::chrono::steady_clock::now();
 	double sleepTime = 0.0;
+	double targetFrameTime = rooms ? kFrameTime / RoomManager< Capacity >::kTickPhases : kFrameTime;
 
 	bool run = true;
 	while ( run )
@@ -355,19 +367,61 @@ int main( int argc, char* argv[] )
 			server->Update( dt );
 		}
 
+		if ( rooms )
+		{
+			rooms->Update( dt );
+		}
+
+		ProfilePoll( stdout );
+		TracePoll();
+
+		if ( stats )
+		{
+			int reader = stats->Accept();
+			if ( reader != -1 )
+			{
+				StatsWriter writer;
+				if ( client )
+				{
+					writer.Printf( "{\"client\":" );
+					client->WriteStats( &writer );
+				}
+				else
+				{
+					writer.Printf( "{\"rooms\":[" );
+					if ( server )
+					{
+						writer.Printf( "{\"room\":0,\"players\":" );
+						server->WriteStats( &writer );
+						writer.Printf( "}" );
+					}
+					if ( rooms )
+					{
+						rooms->WriteStats( &writer );
+					}
+					writer.Printf( "]" );
+				}
+				writer.Printf( ",\"logDropped\":%llu}\n", (unsigned long long)LogDropped() );
+				stats->Reply( reader, writer );
+			}
+			stats->Flush();
+		}
+
 		if ( client )
 		{
 			client->Update( dt );
 		}
 
-		// Draw game state
+		// Hand the game state to the render thread
 		if ( !headlessMode )
 		{
-			Render( gameState, window );
-			SDL_GL_SwapWindow( window );
+			TraceScope renderScope( "render" );
+			int width, height;
+			SDL_GetWindowSize( window, &width, &height );
+			renderThread->Submit( *gameState, width, height );
 		}
 
-		sleepTime += ( kFrameTime - dt );
+		sleepTime += ( targetFrameTime - dt );
 		if ( sleepTime > 0.0 )
 		{
 			usleep( sleepTime * 1000000.0 );
@@ -376,9 +430,272 @@ int main( int argc, char* argv[] )
 	
 	if ( !headlessMode )
 	{
+		renderThread->Stop();
+		delete renderThread;
 		SDL_DestroyWindow( window );
 		SDL_Quit();
 	}
+
+	if ( stats )
+	{
+		stats->Shutdown();
+	}
+
+	if ( recorder )
+	{
+		recorder->Close();
+	}
+
+	if ( corpus )
+	{
+		corpus->Close();
+	}
+
+	if ( rooms )
+	{
+		rooms->Shutdown();
+	}
+
+	if ( jobs )
+	{
+		jobs->Shutdown();
+	}
+
+	LogStop();
 	
 	return 0;
 }
+
+int main( int argc, char* argv[] )
+{
+	Options options;
+	options.serverMode = false;
+	options.headlessMode = true;
+	options.hostname = "localhost";
+	options.port = DEFAULT_PORT;
+	options.threads = 0;
+	options.playersPerRoom = 0;
+	options.shard = 0;
+	options.shardCount = 1;
+	options.room = kAnyRoom;
+	options.profileInterval = 0.0;
+	options.traceSeconds = 0.0;
+	options.statsPath = nullptr;
+	options.recordPath = nullptr;
+	options.corpusPath = nullptr;
+	options.maxRewindTicks = kDefaultMaxRewindTicks;
+	options.snapshotRate = kDefaultSnapshotRateLimits;
+	options.snapshotEntityBytes = kDefaultSnapshotEntityBytes;
+	options.replayPath = nullptr;
+	options.replayFrom = 0;
+	bool largeMode = false;
+	for ( uint32_t i = 1; i < argc; i++ )
+	{
+		if ( strcmp( "-s", argv[ i ] ) == 0 )
+		{
+			options.serverMode = true;
+		}
+		else if ( strcmp( "-h", argv[ i ] ) == 0 )
+		{
+			options.headlessMode = false;
+		}
+		else if ( strcmp( "-l", argv[ i ] ) == 0 )
+		{
+			largeMode = true;
+		}
+		else if ( strcmp( "-a", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a hostname\n" );
+				return -1;
+			}
+			options.hostname = argv[ i + 1 ];
+		}
+		else if ( strcmp( "-j", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a thread count\n" );
+				return -1;
+			}
+			options.threads = atoi( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-r", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify the players per room\n" );
+				return -1;
+			}
+			options.playersPerRoom = atoi( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-shard", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a shard index\n" );
+				return -1;
+			}
+			options.shard = atoi( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-shards", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a shard count\n" );
+				return -1;
+			}
+			options.shardCount = atoi( argv[ i + 1 ] );
+			if ( options.shardCount == 0 )
+			{
+				printf( "Invalid shard count specified\n" );
+				return -1;
+			}
+		}
+		else if ( strcmp( "-room", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a room id\n" );
+				return -1;
+			}
+			options.room = atoi( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-profile", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a profile dump interval in seconds\n" );
+				return -1;
+			}
+			options.profileInterval = atof( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-trace", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a trace capture length in seconds\n" );
+				return -1;
+			}
+			options.traceSeconds = atof( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-stats", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a stats socket path\n" );
+				return -1;
+			}
+			options.statsPath = argv[ i + 1 ];
+		}
+		else if ( strcmp( "-record", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a replay file to record to\n" );
+				return -1;
+			}
+			options.recordPath = argv[ i + 1 ];
+		}
+		else if ( strcmp( "-corpus", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a file to capture snapshots to\n" );
+				return -1;
+			}
+			options.corpusPath = argv[ i + 1 ];
+		}
+		else if ( strcmp( "-rewind", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify how many milliseconds lag compensation may rewind\n" );
+				return -1;
+			}
+			options.maxRewindTicks = (uint32_t)( atof( argv[ i + 1 ] ) / 1000.0 / kFrameTime + 0.5 );
+		}
+		else if ( strcmp( "-minrate", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc || atof( argv[ i + 1 ] ) <= 0.0 )
+			{
+				printf( "Specify the fewest snapshots a second a client is sent\n" );
+				return -1;
+			}
+			options.snapshotRate.minRate = atof( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-maxrate", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc || atof( argv[ i + 1 ] ) <= 0.0 )
+			{
+				printf( "Specify the most snapshots a second a client is sent\n" );
+				return -1;
+			}
+			options.snapshotRate.maxRate = atof( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-budget", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify how many kilobytes a second of snapshots a client may be sent, 0 for no limit\n" );
+				return -1;
+			}
+			options.snapshotRate.budget = atof( argv[ i + 1 ] ) * 1024.0f;
+		}
+		else if ( strcmp( "-packet", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify how many bytes of entity updates one snapshot may carry, 0 for no limit\n" );
+				return -1;
+			}
+			options.snapshotEntityBytes = atoi( argv[ i + 1 ] );
+		}
+		else if ( strcmp( "-replay", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a replay file to play\n" );
+				return -1;
+			}
+			options.replayPath = argv[ i + 1 ];
+		}
+		else if ( strcmp( "-from", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a tick to start the replay from\n" );
+				return -1;
+			}
+			options.replayFrom = strtoull( argv[ i + 1 ], nullptr, 10 );
+		}
+		else if ( strcmp( "-p", argv[ i ] ) == 0 )
+		{
+			if ( i + 1 >= argc )
+			{
+				printf( "Specify a port number\n" );
+				return -1;
+			}
+			options.port = atoi( argv[ i + 1 ] );
+			if ( options.port == 0 )
+			{
+				printf( "Invalid port specified\n" );
+				return -1;
+			}
+		}
+	}
+
+	if ( options.snapshotRate.minRate > options.snapshotRate.maxRate )
+	{
+		printf( "The minimum snapshot rate is above the maximum\n" );
+		return -1;
+	}
+
+	
+	if ( largeMode )
+	{
+		return Run< LargeCapacity >( options );
+	}
+	return Run< StandardCapacity >( options );
+}
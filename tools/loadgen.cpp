@@ -0,0 +1,634 @@
+// Headless load generator: runs many scripted bot clients against a server
+// from one process, speaking the same protocol as GameClient, and reports
+// throughput and latency once a second.
+//
+// Usage: loadgen [-a host] [-p port] [-n bots] [-r botsPerSecond] [-t seconds]
+//                [-thrust duty] [-turn seconds] [-fire duty] [-l]
+//
+// -thrust and -fire are the fraction of each cycle the bot holds the key down,
+// -turn is how long it turns one way before switching, 0 to never turn. -l
+// speaks the LargeCapacity snapshot layout.
+//
+// Snapshot interval is the gap between snapshots; it stays at the server's sync
+// interval until the server falls behind. Fire latency is the time from a bot
+// pressing fire to a snapshot showing its new laser.
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include "Game.h"
+#include "Socket.h"
+
+const double kInputInterval = 0.1; // Matches the client's idle resend rate
+const double kTickInterval = 1.0 / 60.0;
+const double kThrustPeriod = 2.0;
+const double kFirePeriod = 1.0;
+const int kMaxWaitMs = 5;
+
+//-----------
+// Event loop
+//-----------
+
+// Readiness notifications keyed by bot index: epoll on Linux, kqueue elsewhere.
+// A socket is watched for writability while it connects, then for reads.
+class EventLoop
+{
+public:
+	static const uint32_t kMaxEvents = 256;
+
+	bool Initialize()
+	{
+#ifdef __linux__
+		m_fd = epoll_create1( 0 );
+#else
+		m_fd = kqueue();
+#endif
+		return m_fd >= 0;
+	}
+
+	void Watch( int sock, uint32_t bot, bool connecting )
+	{
+#ifdef __linux__
+		epoll_event event;
+		memset( &event, 0, sizeof(event) );
+		event.events = connecting ? EPOLLOUT : EPOLLIN;
+		event.data.u32 = bot;
+		epoll_ctl( m_fd, connecting ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, sock, &event );
+#else
+		struct kevent event;
+		EV_SET( &event, sock, connecting ? EVFILT_WRITE : EVFILT_READ, EV_ADD | ( connecting ? EV_ONESHOT : 0 ), 0, 0, (void*)(uintptr_t)bot );
+		kevent( m_fd, &event, 1, nullptr, 0, nullptr );
+#endif
+	}
+
+	// Returns the number of ready bots written to botsOut
+	uint32_t Wait( int timeoutMs, uint32_t* botsOut )
+	{
+#ifdef __linux__
+		epoll_event events[ kMaxEvents ];
+		int count = epoll_wait( m_fd, events, kMaxEvents, timeoutMs );
+		for ( int i = 0; i < count; i++ )
+		{
+			botsOut[ i ] = events[ i ].data.u32;
+		}
+#else
+		struct kevent events[ kMaxEvents ];
+		timespec timeout = { 0, timeoutMs * 1000000L };
+		int count = kevent( m_fd, nullptr, 0, events, kMaxEvents, &timeout );
+		for ( int i = 0; i < count; i++ )
+		{
+			botsOut[ i ] = (uint32_t)(uintptr_t)events[ i ].udata;
+		}
+#endif
+		return count > 0 ? count : 0;
+	}
+
+private:
+	int m_fd;
+};
+
+//-----------
+// Stats
+//-----------
+
+// Millisecond buckets, anything past the last bucket is clamped into it
+struct Histogram
+{
+	static const uint32_t kBuckets = 2000;
+
+	void Clear() { memset( this, 0, sizeof(*this) ); }
+
+	void Add( double seconds )
+	{
+		uint32_t ms = seconds < 0.0 ? 0 : (uint32_t)( seconds * 1000.0 );
+		buckets[ ms < kBuckets ? ms : kBuckets - 1 ]++;
+		count++;
+		max = seconds > max ? seconds : max;
+	}
+
+	void Merge( const Histogram& other )
+	{
+		for ( uint32_t i = 0; i < kBuckets; i++ )
+		{
+			buckets[ i ] += other.buckets[ i ];
+		}
+		count += other.count;
+		max = other.max > max ? other.max : max;
+	}
+
+	double Percentile( double p ) const
+	{
+		uint64_t target = (uint64_t)ceil( count * p );
+		uint64_t seen = 0;
+		for ( uint32_t i = 0; i < kBuckets; i++ )
+		{
+			seen += buckets[ i ];
+			if ( seen >= target && seen > 0 )
+			{
+				return i;
+			}
+		}
+		return 0.0;
+	}
+
+	uint64_t buckets[ kBuckets ];
+	uint64_t count;
+	double max;
+};
+
+struct Stats
+{
+	void Clear() { memset( this, 0, sizeof(*this) ); }
+
+	void Merge( const Stats& other )
+	{
+		snapshots += other.snapshots;
+		bytesReceived += other.bytesReceived;
+		bytesSent += other.bytesSent;
+		connects += other.connects;
+		failures += other.failures;
+		snapshotInterval.Merge( other.snapshotInterval );
+		fireLatency.Merge( other.fireLatency );
+	}
+
+	uint64_t snapshots;
+	uint64_t bytesReceived;
+	uint64_t bytesSent;
+	uint32_t connects;
+	uint32_t failures;
+	Histogram snapshotInterval;
+	Histogram fireLatency;
+};
+
+//-----------
+// Bots
+//-----------
+
+enum BotState
+{
+	kBotIdle,
+	kBotConnecting,
+	kBotConnected,
+	kBotClosed,
+};
+
+struct Bot
+{
+	int socket;
+	BotState state;
+	double phase; // Offset into the input patterns so bots don't move in lockstep
+	double nextSend;
+	double lastSnapshot;
+	double firePressedAt; // Negative while no press is waiting to be seen
+	Input input;
+	uint8_t* prev; // Last decoded snapshot, the baseline for the next delta
+};
+
+struct Options
+{
+	const char* hostname;
+	uint16_t port;
+	uint32_t bots;
+	double rampRate;
+	double duration;
+	double thrustDuty;
+	double turnPeriod;
+	double fireDuty;
+};
+
+double Now()
+{
+	return std::chrono::duration< double >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+int StartConnect( const addrinfo* address )
+{
+	int sock = socket( address->ai_family, address->ai_socktype, address->ai_protocol );
+	if ( sock < 0 )
+	{
+		return -1;
+	}
+
+	int enable = 1;
+	setsockopt( sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable) );
+#ifdef SO_NOSIGPIPE
+	setsockopt( sock, SOL_SOCKET, SO_NOSIGPIPE, &enable, sizeof(enable) );
+#endif
+	fcntl( sock, F_SETFL, O_NONBLOCK );
+
+	if ( connect( sock, address->ai_addr, address->ai_addrlen ) != 0 && errno != EINPROGRESS )
+	{
+		close( sock );
+		return -1;
+	}
+	return sock;
+}
+
+void ScriptInput( const Options& options, double t, Input* input )
+{
+	input->accel = fmod( t, kThrustPeriod ) < options.thrustDuty * kThrustPeriod ? 1 : 0;
+	input->turn = 0;
+	if ( options.turnPeriod > 0.0 )
+	{
+		input->turn = ( (int64_t)( t / options.turnPeriod ) % 2 ) ? 1 : -1;
+	}
+	input->fire = fmod( t, kFirePeriod ) < options.fireDuty * kFirePeriod ? 1 : 0;
+}
+
+void CloseBot( Bot* bot, Stats* stats )
+{
+	if ( bot->socket != -1 )
+	{
+		close( bot->socket );
+		bot->socket = -1;
+	}
+	bot->state = kBotClosed;
+	stats->failures++;
+}
+
+template< class Capacity >
+class LoadGenerator
+{
+public:
+	typedef GameState< Capacity > State;
+
+	int Run( const Options& options )
+	{
+		m_options = options;
+
+		addrinfo hints;
+		memset( &hints, 0, sizeof(hints) );
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+
+		char portStr[ 6 ];
+		sprintf( portStr, "%hu", options.port );
+		if ( getaddrinfo( options.hostname, portStr, &hints, &m_address ) != 0 )
+		{
+			printf( "Could not resolve %s\n", options.hostname );
+			return -1;
+		}
+
+		if ( !m_loop.Initialize() )
+		{
+			printf( "Could not create event loop: %s\n", strerror( errno ) );
+			return -1;
+		}
+
+		m_bots = new Bot[ options.bots ];
+		memset( m_bots, 0, sizeof(Bot) * options.bots );
+		for ( uint32_t i = 0; i < options.bots; i++ )
+		{
+			m_bots[ i ].socket = -1;
+			m_bots[ i ].phase = 10.0 * ( rand() / (double)RAND_MAX );
+		}
+
+		printf( "%u bots against %s:%hu, ramping at %.0f/s for %.0f s\n", options.bots, options.hostname, options.port, options.rampRate, options.duration );
+		printf( "%6s %6s %6s %8s %9s %9s %22s %22s\n", "time", "bots", "fails", "snaps/s", "rx KB/s", "tx KB/s", "interval p50/p99/max", "fire p50/p99/max" );
+
+		m_interval.Clear();
+		m_total.Clear();
+		double start = Now();
+		double nextReport = start + 1.0;
+		uint32_t started = 0;
+		for ( double now = start; now - start < options.duration; now = Now() )
+		{
+			uint32_t due = (uint32_t)( ( now - start ) * options.rampRate ) + 1;
+			for ( ; started < options.bots && started < due; started++ )
+			{
+				Connect( started, now );
+			}
+
+			uint32_t ready[ EventLoop::kMaxEvents ];
+			uint32_t count = m_loop.Wait( kMaxWaitMs, ready );
+			now = Now();
+			for ( uint32_t i = 0; i < count; i++ )
+			{
+				Service( ready[ i ], now );
+			}
+
+			for ( uint32_t i = 0; i < started; i++ )
+			{
+				SendInput( i, now );
+			}
+
+			if ( now >= nextReport )
+			{
+				Report( now - start, now - nextReport + 1.0 );
+				m_total.Merge( m_interval );
+				m_interval.Clear();
+				nextReport += 1.0;
+			}
+		}
+
+		m_total.Merge( m_interval );
+		printf( "total: %llu snapshots, %.1f MB received, %.1f MB sent, %u connected, %u failed\n",
+			(unsigned long long)m_total.snapshots, m_total.bytesReceived / 1e6, m_total.bytesSent / 1e6, m_total.connects, m_total.failures );
+		printf( "snapshot interval ms p50 %.0f p99 %.0f max %.0f\n",
+			m_total.snapshotInterval.Percentile( 0.5 ), m_total.snapshotInterval.Percentile( 0.99 ), m_total.snapshotInterval.max * 1000.0 );
+		printf( "fire latency ms p50 %.0f p99 %.0f max %.0f\n",
+			m_total.fireLatency.Percentile( 0.5 ), m_total.fireLatency.Percentile( 0.99 ), m_total.fireLatency.max * 1000.0 );
+
+		for ( uint32_t i = 0; i < options.bots; i++ )
+		{
+			if ( m_bots[ i ].socket != -1 )
+			{
+				close( m_bots[ i ].socket );
+			}
+			delete[] m_bots[ i ].prev;
+		}
+		delete[] m_bots;
+		freeaddrinfo( m_address );
+		return 0;
+	}
+
+private:
+	void Connect( uint32_t index, double now )
+	{
+		Bot* bot = &m_bots[ index ];
+		bot->socket = StartConnect( m_address );
+		if ( bot->socket < 0 )
+		{
+			CloseBot( bot, &m_interval );
+			return;
+		}
+
+		bot->state = kBotConnecting;
+		bot->lastSnapshot = -1.0;
+		bot->firePressedAt = -1.0;
+		bot->nextSend = now;
+		m_loop.Watch( bot->socket, index, true );
+	}
+
+	void Service( uint32_t index, double now )
+	{
+		Bot* bot = &m_bots[ index ];
+		if ( bot->state == kBotConnecting )
+		{
+			int error = 0;
+			socklen_t length = sizeof(error);
+			getsockopt( bot->socket, SOL_SOCKET, SO_ERROR, &error, &length );
+			if ( error != 0 )
+			{
+				CloseBot( bot, &m_interval );
+				return;
+			}
+
+			bot->state = kBotConnected;
+			bot->prev = new uint8_t[ sizeof(State) ];
+			memset( bot->prev, 0, sizeof(State) );
+			m_loop.Watch( bot->socket, index, false );
+			m_interval.connects++;
+			return;
+		}
+
+		while ( bot->state == kBotConnected )
+		{
+			int recvd = socket_recv_msg( bot->socket, m_message, sizeof(m_message) );
+			if ( recvd == -1 )
+			{
+				bot->socket = -1;
+				CloseBot( bot, &m_interval );
+			}
+			if ( recvd <= 0 )
+			{
+				break;
+			}
+
+			m_interval.bytesReceived += recvd + sizeof(uint32_t);
+			SnapshotHeader header;
+			memcpy( &header, m_message, sizeof(header) );
+			if ( recvd < (int)sizeof(header) || LZ4_decompress_safe( (const char*)m_message + sizeof(header), (char*)m_diff, recvd - (int)sizeof(header), sizeof(State) ) != sizeof(State) )
+			{
+				CloseBot( bot, &m_interval );
+				break;
+			}
+			for ( uint32_t b = 0; b < sizeof(State); b++ )
+			{
+				bot->prev[ b ] ^= m_diff[ b ];
+			}
+			bot->input.viewTick = header.tick;
+
+			m_interval.snapshots++;
+			if ( bot->lastSnapshot >= 0.0 )
+			{
+				m_interval.snapshotInterval.Add( now - bot->lastSnapshot );
+			}
+			bot->lastSnapshot = now;
+
+			if ( bot->firePressedAt >= 0.0 && SawNewLaser( (const State*)bot->prev, now - bot->firePressedAt ) )
+			{
+				m_interval.fireLatency.Add( now - bot->firePressedAt );
+				bot->firePressedAt = -1.0;
+			}
+
+			// Echo pings at once, as the game client does, so the server's RTT is honest
+			if ( header.ping )
+			{
+				bot->input.pong = header.ping;
+				int bytes = socket_send_msg( bot->socket, &bot->input, sizeof(bot->input) );
+				if ( bytes < 0 )
+				{
+					bot->socket = -1;
+					CloseBot( bot, &m_interval );
+					break;
+				}
+				m_interval.bytesSent += bytes + sizeof(uint32_t);
+			}
+		}
+	}
+
+	// A laser fired after the press has more life left than the time since the
+	// press would allow for one fired before it
+	bool SawNewLaser( const State* state, double sincePress )
+	{
+		const ShipArray< Capacity::kMaxShips >& ships = state->ships;
+		ShipId self = 0;
+		for ( uint32_t k = 0; k < ships.count; k++ )
+		{
+			if ( ships.local[ ships.dense[ k ] ] )
+			{
+				self = ships.id[ ships.dense[ k ] ];
+			}
+		}
+
+		const LaserArray< Capacity::kMaxLasers >& lasers = state->lasers;
+		for ( uint32_t k = 0; k < lasers.count; k++ )
+		{
+			uint32_t i = lasers.dense[ k ];
+			if ( self && lasers.owner[ i ] == self && lasers.life[ i ] > kLaserLifeTime - sincePress )
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void SendInput( uint32_t index, double now )
+	{
+		Bot* bot = &m_bots[ index ];
+		if ( bot->state != kBotConnected )
+		{
+			return;
+		}
+
+		Input input;
+		memset( &input, 0, sizeof(input) );
+		ScriptInput( m_options, now + bot->phase, &input );
+		input.pong = bot->input.pong;
+		input.viewTick = bot->input.viewTick;
+		input.tick = (uint32_t)( now / kTickInterval );
+
+		// Like the client: changes go out straight away, held controls every tick
+		// and idle ones at the resend rate
+		bool pressedFire = input.fire && !bot->input.fire;
+		bool changed = input.accel != bot->input.accel || input.turn != bot->input.turn || input.fire != bot->input.fire;
+		bool held = input.accel || input.turn || input.fire;
+		if ( !changed && !( held && input.tick != bot->input.tick ) && now < bot->nextSend )
+		{
+			return;
+		}
+
+		bot->input = input;
+		bot->nextSend = now + kInputInterval;
+
+		int bytes = socket_send_msg( bot->socket, &input, sizeof(input) );
+		if ( bytes < 0 )
+		{
+			bot->socket = -1;
+			CloseBot( bot, &m_interval );
+			return;
+		}
+		if ( bytes > 0 )
+		{
+			m_interval.bytesSent += bytes + sizeof(uint32_t);
+			// A press the server didn't turn into a laser (the fire timer was still
+			// running, or it hit something straight away) is dropped, not carried over
+			if ( pressedFire )
+			{
+				bot->firePressedAt = now;
+			}
+		}
+	}
+
+	void Report( double elapsed, double seconds )
+	{
+		uint32_t connected = 0;
+		for ( uint32_t i = 0; i < m_options.bots; i++ )
+		{
+			connected += m_bots[ i ].state == kBotConnected;
+		}
+
+		char interval[ 32 ];
+		char fire[ 32 ];
+		snprintf( interval, sizeof(interval), "%.0f/%.0f/%.0f", m_interval.snapshotInterval.Percentile( 0.5 ), m_interval.snapshotInterval.Percentile( 0.99 ), m_interval.snapshotInterval.max * 1000.0 );
+		snprintf( fire, sizeof(fire), "%.0f/%.0f/%.0f", m_interval.fireLatency.Percentile( 0.5 ), m_interval.fireLatency.Percentile( 0.99 ), m_interval.fireLatency.max * 1000.0 );
+		printf( "%6.0f %6u %6u %8.0f %9.1f %9.1f %22s %22s\n", elapsed, connected, m_total.failures + m_interval.failures,
+			m_interval.snapshots / seconds, m_interval.bytesReceived / 1024.0 / seconds, m_interval.bytesSent / 1024.0 / seconds, interval, fire );
+		fflush( stdout );
+	}
+
+	Options m_options;
+	addrinfo* m_address;
+	EventLoop m_loop;
+	Bot* m_bots;
+	Stats m_interval;
+	Stats m_total;
+
+	// Shared by every bot since the loop decodes one snapshot at a time
+	uint8_t m_diff[ sizeof(State) ];
+	uint8_t m_message[ sizeof(SnapshotHeader) + LZ4_COMPRESSBOUND( sizeof(State) ) ];
+};
+
+int main( int argc, char* argv[] )
+{
+	Options options;
+	options.hostname = "localhost";
+	options.port = 7777;
+	options.bots = 100;
+	options.rampRate = 50.0;
+	options.duration = 30.0;
+	options.thrustDuty = 0.5;
+	options.turnPeriod = 1.5;
+	options.fireDuty = 0.3;
+	bool largeMode = false;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		bool hasValue = i + 1 < argc;
+		if ( strcmp( "-l", argv[ i ] ) == 0 )
+		{
+			largeMode = true;
+		}
+		else if ( hasValue && strcmp( "-a", argv[ i ] ) == 0 )
+		{
+			options.hostname = argv[ ++i ];
+		}
+		else if ( hasValue && strcmp( "-p", argv[ i ] ) == 0 )
+		{
+			options.port = atoi( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-n", argv[ i ] ) == 0 )
+		{
+			options.bots = atoi( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-r", argv[ i ] ) == 0 )
+		{
+			options.rampRate = atof( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-t", argv[ i ] ) == 0 )
+		{
+			options.duration = atof( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-thrust", argv[ i ] ) == 0 )
+		{
+			options.thrustDuty = atof( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-turn", argv[ i ] ) == 0 )
+		{
+			options.turnPeriod = atof( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-fire", argv[ i ] ) == 0 )
+		{
+			options.fireDuty = atof( argv[ ++i ] );
+		}
+		else
+		{
+			printf( "Unknown or incomplete option %s\n", argv[ i ] );
+			return -1;
+		}
+	}
+
+	if ( options.bots == 0 || options.rampRate <= 0.0 )
+	{
+		printf( "Need at least one bot and a positive ramp rate\n" );
+		return -1;
+	}
+
+	signal( SIGPIPE, SIG_IGN );
+
+	if ( largeMode )
+	{
+		LoadGenerator< LargeCapacity >* generator = new LoadGenerator< LargeCapacity >();
+		return generator->Run( options );
+	}
+	LoadGenerator< StandardCapacity >* generator = new LoadGenerator< StandardCapacity >();
+	return generator->Run( options );
+}
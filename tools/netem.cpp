@@ -0,0 +1,697 @@
+// Network condition emulator: a loopback proxy that sits between clients and a
+// server and adds delay, jitter, loss, reordering and a bandwidth cap to each
+// direction, so sync behaviour can be measured on a bad link from one machine.
+//
+// Usage: netem [-l listenPort] [-a host] [-p port] [-up conditions]
+//              [-down conditions] [-both conditions] [-script file]
+//              [-seed n] [-t seconds]
+//
+// Point clients (or loadgen) at the listen port; up is client to server, down
+// is server to client. Conditions are comma separated key=value pairs:
+//
+//   delay=ms     one way delay
+//   jitter=ms    delay varies uniformly by up to this much either way
+//   loss=%       frames that are lost
+//   reorder=%    frames that arrive out of order
+//   rate=kbit/s  bandwidth cap for each connection, 0 for none
+//   rto=ms       retransmission timeout a loss costs, 200 by default
+//
+// The game speaks TCP, so the proxy emulates what TCP makes of a bad link
+// rather than what the link does to packets. A lost frame is retransmitted and
+// arrives an rto late, a reordered one arrives an extra delay late, and either
+// way the frames behind it wait, as they would in the receiver's TCP buffer.
+// Over the bandwidth cap frames queue, and once a direction has
+// kMaxQueuedBytes queued the proxy stops reading so the sender sees its socket
+// fill up.
+//
+// A script changes conditions during a run. Each line is a time in seconds, a
+// direction (up, down or both) and the conditions that change:
+//
+//   # Two seconds of heavy loss, then back to a clean link
+//   0   both delay=40,jitter=5
+//   10  both loss=20
+//   12  both loss=0
+//
+// Once a second the proxy prints each direction's frame rate, throughput, mean
+// frame size and the delay it added, so runs can be compared with loadgen's
+// latency figures.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Socket.h"
+
+const double kReportInterval = 1.0;
+const uint32_t kMaxQueuedBytes = 256 * 1024;
+const uint32_t kMaxFrameBytes = 16 * 1024 * 1024;
+const uint32_t kReadBytes = 64 * 1024;
+
+#ifdef MSG_NOSIGNAL
+const int kSendFlags = MSG_NOSIGNAL;
+#else
+const int kSendFlags = 0;
+#endif
+
+double NowSeconds()
+{
+	return std::chrono::duration< double >( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+//-----------
+// Conditions
+//-----------
+
+// Times in seconds, loss and reorder as fractions
+struct Conditions
+{
+	double delay;
+	double jitter;
+	double loss;
+	double reorder;
+	double rate; // Bits per second, 0 for no cap
+	double rto;
+};
+
+enum Direction
+{
+	kDirectionUp = 1,
+	kDirectionDown = 2,
+	kDirectionBoth = kDirectionUp | kDirectionDown,
+};
+
+// Changes only the keys named in text
+bool ParseConditions( const char* text, Conditions* conditions )
+{
+	char buffer[ 256 ];
+	snprintf( buffer, sizeof(buffer), "%s", text );
+	for ( char* item = strtok( buffer, ", \t\r\n" ); item; item = strtok( nullptr, ", \t\r\n" ) )
+	{
+		char* equals = strchr( item, '=' );
+		if ( !equals )
+		{
+			printf( "Expected key=value, got %s\n", item );
+			return false;
+		}
+		*equals = '\0';
+		double value = atof( equals + 1 );
+
+		if ( strcmp( "delay", item ) == 0 )
+		{
+			conditions->delay = value / 1000.0;
+		}
+		else if ( strcmp( "jitter", item ) == 0 )
+		{
+			conditions->jitter = value / 1000.0;
+		}
+		else if ( strcmp( "loss", item ) == 0 )
+		{
+			conditions->loss = value / 100.0;
+		}
+		else if ( strcmp( "reorder", item ) == 0 )
+		{
+			conditions->reorder = value / 100.0;
+		}
+		else if ( strcmp( "rate", item ) == 0 )
+		{
+			conditions->rate = value * 1000.0;
+		}
+		else if ( strcmp( "rto", item ) == 0 )
+		{
+			conditions->rto = value / 1000.0;
+		}
+		else
+		{
+			printf( "Unknown condition %s\n", item );
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ParseDirection( const char* text, uint32_t* direction )
+{
+	if ( strcmp( "up", text ) == 0 )
+	{
+		*direction = kDirectionUp;
+	}
+	else if ( strcmp( "down", text ) == 0 )
+	{
+		*direction = kDirectionDown;
+	}
+	else if ( strcmp( "both", text ) == 0 )
+	{
+		*direction = kDirectionBoth;
+	}
+	else
+	{
+		printf( "Unknown direction %s\n", text );
+		return false;
+	}
+	return true;
+}
+
+struct ScriptStep
+{
+	double time;
+	uint32_t direction;
+	char conditions[ 256 ];
+};
+
+bool LoadScript( const char* path, std::vector< ScriptStep >* steps )
+{
+	FILE* file = fopen( path, "r" );
+	if ( !file )
+	{
+		printf( "Could not open script %s: %s\n", path, strerror( errno ) );
+		return false;
+	}
+
+	char line[ 512 ];
+	uint32_t lineNumber = 0;
+	bool ok = true;
+	while ( ok && fgets( line, sizeof(line), file ) )
+	{
+		lineNumber++;
+		char* comment = strchr( line, '#' );
+		if ( comment )
+		{
+			*comment = '\0';
+		}
+
+		char direction[ 16 ];
+		ScriptStep step;
+		int fields = sscanf( line, "%lf %15s %255[^\n]", &step.time, direction, step.conditions );
+		if ( fields <= 0 )
+		{
+			continue;
+		}
+
+		Conditions check;
+		memset( &check, 0, sizeof(check) );
+		ok = fields == 3 && ParseDirection( direction, &step.direction ) && ParseConditions( step.conditions, &check );
+		if ( !ok )
+		{
+			printf( "%s:%u: expected <seconds> <up|down|both> <conditions>\n", path, lineNumber );
+		}
+		steps->push_back( step );
+	}
+	fclose( file );
+
+	std::stable_sort( steps->begin(), steps->end(), []( const ScriptStep& a, const ScriptStep& b ) { return a.time < b.time; } );
+	return ok;
+}
+
+//-----------
+// Links
+//-----------
+
+struct LinkStats
+{
+	LinkStats() { Clear(); }
+	void Clear() { frames = 0; bytes = 0; lost = 0; reordered = 0; delays.clear(); }
+
+	void Merge( const LinkStats& other )
+	{
+		frames += other.frames;
+		bytes += other.bytes;
+		lost += other.lost;
+		reordered += other.reordered;
+		delays.insert( delays.end(), other.delays.begin(), other.delays.end() );
+	}
+
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t reordered;
+	std::vector< double > delays; // Added by the proxy, per delivered frame
+};
+
+struct Frame
+{
+	double arrived;
+	double due;
+	std::vector< uint8_t > bytes; // Including the length prefix
+};
+
+// One direction of one proxied connection. Bytes read from the source are cut
+// into frames, each frame is given a delivery time, and frames are written to
+// the destination in order once they fall due.
+struct Link
+{
+	int from;
+	int to;
+	std::vector< uint8_t > partial; // Start of a frame still arriving
+	std::deque< Frame > frames;
+	uint32_t queuedBytes;
+	uint32_t written; // Of the front frame
+	double linkFree; // When the capped link finishes sending what it has
+	double lastDue;
+};
+
+class Emulator
+{
+public:
+	Emulator( uint32_t seed ) : m_random( seed ? seed : 1 ), m_listener( -1 )
+	{
+		memset( m_conditions, 0, sizeof(m_conditions) );
+		m_conditions[ 0 ].rto = 0.2;
+		m_conditions[ 1 ].rto = 0.2;
+	}
+
+	Conditions* GetConditions( uint32_t direction ) { return &m_conditions[ direction == kDirectionUp ? 0 : 1 ]; }
+
+	bool Apply( uint32_t direction, const char* text )
+	{
+		for ( uint32_t d = kDirectionUp; d <= kDirectionDown; d <<= 1 )
+		{
+			if ( ( direction & d ) && !ParseConditions( text, GetConditions( d ) ) )
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	int Run( uint16_t listenPort, const char* hostname, uint16_t port, const std::vector< ScriptStep >& script, double duration );
+
+private:
+	struct Connection
+	{
+		Link links[ 2 ]; // Up, then down
+		bool open;
+	};
+
+	void Accept( double now );
+	void Close( Connection* connection );
+	bool Read( Link* link, uint32_t index, double now );
+	bool Write( Link* link, uint32_t index, double now );
+	void Schedule( Link* link, uint32_t index, Frame& frame );
+	void PrintConditions( double elapsed );
+	void Report( double elapsed, double seconds, LinkStats* stats, bool total );
+
+	double Random()
+	{
+		m_random ^= m_random << 13;
+		m_random ^= m_random >> 17;
+		m_random ^= m_random << 5;
+		return m_random / 4294967295.0;
+	}
+
+	uint32_t m_random;
+	int m_listener;
+	const char* m_hostname;
+	uint16_t m_port;
+	Conditions m_conditions[ 2 ];
+	std::vector< Connection* > m_connections;
+	LinkStats m_interval[ 2 ];
+	LinkStats m_total[ 2 ];
+	uint8_t m_buffer[ kReadBytes ];
+};
+
+void Emulator::Accept( double now )
+{
+	int client;
+	while ( ( client = socket_server_accept( m_listener ) ) >= 0 )
+	{
+		int server = socket_client_connect( m_hostname, m_port );
+
+		Connection* connection = new Connection();
+		connection->open = true;
+		for ( uint32_t i = 0; i < 2; i++ )
+		{
+			Link& link = connection->links[ i ];
+			link.from = i == 0 ? client : server;
+			link.to = i == 0 ? server : client;
+			link.queuedBytes = 0;
+			link.written = 0;
+			link.linkFree = now;
+			link.lastDue = now;
+		}
+		m_connections.push_back( connection );
+	}
+}
+
+void Emulator::Close( Connection* connection )
+{
+	if ( connection->open )
+	{
+		close( connection->links[ 0 ].from );
+		close( connection->links[ 0 ].to );
+		connection->open = false;
+	}
+}
+
+// Returns false once the source has closed
+bool Emulator::Read( Link* link, uint32_t index, double now )
+{
+	while ( link->queuedBytes < kMaxQueuedBytes )
+	{
+		ssize_t bytes = recv( link->from, m_buffer, sizeof(m_buffer), 0 );
+		if ( bytes == 0 || ( bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK ) )
+		{
+			return false;
+		}
+		if ( bytes < 0 )
+		{
+			break;
+		}
+		link->partial.insert( link->partial.end(), m_buffer, m_buffer + bytes );
+		link->queuedBytes += bytes;
+
+		size_t offset = 0;
+		while ( link->partial.size() - offset >= sizeof(uint32_t) )
+		{
+			uint32_t length;
+			memcpy( &length, &link->partial[ offset ], sizeof(length) );
+			if ( length > kMaxFrameBytes )
+			{
+				printf( "Frame of %u bytes, closing connection\n", length );
+				return false;
+			}
+			if ( link->partial.size() - offset < sizeof(length) + length )
+			{
+				break;
+			}
+
+			Frame frame;
+			frame.arrived = now;
+			frame.bytes.assign( link->partial.begin() + offset, link->partial.begin() + offset + sizeof(length) + length );
+			offset += frame.bytes.size();
+			Schedule( link, index, frame );
+			link->frames.push_back( std::move( frame ) );
+		}
+		link->partial.erase( link->partial.begin(), link->partial.begin() + offset );
+	}
+	return true;
+}
+
+void Emulator::Schedule( Link* link, uint32_t index, Frame& frame )
+{
+	const Conditions& conditions = m_conditions[ index ];
+
+	// Serialise onto the capped link, then cross it
+	double due = frame.arrived;
+	if ( conditions.rate > 0.0 )
+	{
+		link->linkFree = std::max( link->linkFree, frame.arrived ) + frame.bytes.size() * 8.0 / conditions.rate;
+		due = link->linkFree;
+	}
+	due += std::max( 0.0, conditions.delay + conditions.jitter * ( Random() * 2.0 - 1.0 ) );
+
+	if ( conditions.loss > 0.0 && Random() < conditions.loss )
+	{
+		due += conditions.rto;
+		m_interval[ index ].lost++;
+	}
+	if ( conditions.reorder > 0.0 && Random() < conditions.reorder )
+	{
+		due += conditions.delay;
+		m_interval[ index ].reordered++;
+	}
+
+	// TCP delivers in order, so nothing overtakes a late frame
+	frame.due = std::max( due, link->lastDue );
+	link->lastDue = frame.due;
+}
+
+// Returns false if the destination failed
+bool Emulator::Write( Link* link, uint32_t index, double now )
+{
+	while ( !link->frames.empty() && link->frames.front().due <= now )
+	{
+		Frame& frame = link->frames.front();
+		ssize_t bytes = send( link->to, &frame.bytes[ link->written ], frame.bytes.size() - link->written, kSendFlags );
+		if ( bytes < 0 )
+		{
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+
+		link->written += bytes;
+		if ( link->written < frame.bytes.size() )
+		{
+			return true;
+		}
+
+		LinkStats& stats = m_interval[ index ];
+		stats.frames++;
+		stats.bytes += frame.bytes.size();
+		stats.delays.push_back( now - frame.arrived );
+
+		link->queuedBytes -= frame.bytes.size();
+		link->written = 0;
+		link->frames.pop_front();
+	}
+	return true;
+}
+
+void Emulator::PrintConditions( double elapsed )
+{
+	const char* names[] = { "up", "down" };
+	for ( uint32_t i = 0; i < 2; i++ )
+	{
+		const Conditions& c = m_conditions[ i ];
+		printf( "%6.1f %-4s delay %.0f ms jitter %.0f ms loss %.1f%% reorder %.1f%% rate %.0f kbit/s rto %.0f ms\n", elapsed, names[ i ],
+			c.delay * 1000.0, c.jitter * 1000.0, c.loss * 100.0, c.reorder * 100.0, c.rate / 1000.0, c.rto * 1000.0 );
+	}
+}
+
+void Emulator::Report( double elapsed, double seconds, LinkStats* stats, bool total )
+{
+	const char* names[] = { "up", "down" };
+	for ( uint32_t i = 0; i < 2; i++ )
+	{
+		LinkStats& s = stats[ i ];
+		double p50 = 0.0, p99 = 0.0, max = 0.0;
+		if ( !s.delays.empty() )
+		{
+			std::sort( s.delays.begin(), s.delays.end() );
+			p50 = s.delays[ s.delays.size() / 2 ];
+			p99 = s.delays[ std::min( s.delays.size() - 1, (size_t)( s.delays.size() * 0.99 ) ) ];
+			max = s.delays.back();
+		}
+
+		char delay[ 32 ];
+		snprintf( delay, sizeof(delay), "%.0f/%.0f/%.0f", p50 * 1000.0, p99 * 1000.0, max * 1000.0 );
+		if ( total )
+		{
+			printf( "total %-4s: %llu frames, %.1f MB, %.0f bytes per frame, delay ms p50/p99/max %s, %llu lost, %llu reordered\n", names[ i ],
+				(unsigned long long)s.frames, s.bytes / ( 1024.0 * 1024.0 ), s.frames ? (double)s.bytes / s.frames : 0.0, delay,
+				(unsigned long long)s.lost, (unsigned long long)s.reordered );
+		}
+		else
+		{
+			printf( "%6.0f %-4s %9.0f %9.1f %9.0f %18s %6llu %6llu\n", elapsed, names[ i ], s.frames / seconds, s.bytes / seconds / 1024.0,
+				s.frames ? (double)s.bytes / s.frames : 0.0, delay, (unsigned long long)s.lost, (unsigned long long)s.reordered );
+		}
+	}
+}
+
+int Emulator::Run( uint16_t listenPort, const char* hostname, uint16_t port, const std::vector< ScriptStep >& script, double duration )
+{
+	m_hostname = hostname;
+	m_port = port;
+	m_listener = socket_server_create_listener( listenPort );
+	printf( "Proxying port %hu to %s:%hu\n", listenPort, hostname, port );
+
+	double start = NowSeconds();
+	double lastReport = start;
+	size_t nextStep = 0;
+	bool changed = true;
+	std::vector< pollfd > fds;
+
+	printf( "%6s %-4s %9s %9s %9s %18s %6s %6s\n", "time", "dir", "frames/s", "KB/s", "bytes/fr", "delay p50/p99/max", "lost", "reord" );
+	while ( true )
+	{
+		double now = NowSeconds();
+		double elapsed = now - start;
+		if ( duration > 0.0 && elapsed >= duration )
+		{
+			break;
+		}
+
+		while ( nextStep < script.size() && script[ nextStep ].time <= elapsed )
+		{
+			Apply( script[ nextStep ].direction, script[ nextStep ].conditions );
+			nextStep++;
+			changed = true;
+		}
+		if ( changed )
+		{
+			PrintConditions( elapsed );
+			changed = false;
+		}
+
+		if ( now - lastReport >= kReportInterval )
+		{
+			Report( elapsed, now - lastReport, m_interval, false );
+			for ( uint32_t i = 0; i < 2; i++ )
+			{
+				m_total[ i ].Merge( m_interval[ i ] );
+				m_interval[ i ].Clear();
+			}
+			lastReport = now;
+		}
+
+		// Sleep until something is readable, a blocked write can continue, a
+		// frame falls due, or it's time to report
+		double wake = lastReport + kReportInterval;
+		fds.clear();
+		pollfd listen = { m_listener, POLLIN, 0 };
+		fds.push_back( listen );
+		for ( size_t c = 0; c < m_connections.size(); c++ )
+		{
+			for ( uint32_t i = 0; i < 2; i++ )
+			{
+				Link& link = m_connections[ c ]->links[ i ];
+				bool due = !link.frames.empty() && link.frames.front().due <= now;
+				pollfd from = { link.from, (short)( link.queuedBytes < kMaxQueuedBytes ? POLLIN : 0 ), 0 };
+				pollfd to = { link.to, (short)( due ? POLLOUT : 0 ), 0 };
+				fds.push_back( from );
+				fds.push_back( to );
+				if ( !link.frames.empty() )
+				{
+					wake = std::min( wake, link.frames.front().due );
+				}
+			}
+		}
+
+		int timeoutMs = (int)ceil( std::max( 0.0, wake - now ) * 1000.0 );
+		poll( fds.data(), fds.size(), timeoutMs );
+		now = NowSeconds();
+
+		if ( fds[ 0 ].revents & POLLIN )
+		{
+			Accept( now );
+		}
+
+		for ( size_t c = 0; c < m_connections.size(); c++ )
+		{
+			Connection* connection = m_connections[ c ];
+			for ( uint32_t i = 0; i < 2 && connection->open; i++ )
+			{
+				Link* link = &connection->links[ i ];
+				if ( !Read( link, i, now ) || !Write( link, i, now ) )
+				{
+					Close( connection );
+				}
+			}
+		}
+
+		size_t open = 0;
+		for ( size_t c = 0; c < m_connections.size(); c++ )
+		{
+			if ( m_connections[ c ]->open )
+			{
+				m_connections[ open++ ] = m_connections[ c ];
+			}
+			else
+			{
+				delete m_connections[ c ];
+			}
+		}
+		m_connections.resize( open );
+	}
+
+	for ( size_t c = 0; c < m_connections.size(); c++ )
+	{
+		Close( m_connections[ c ] );
+		delete m_connections[ c ];
+	}
+	m_connections.clear();
+	close( m_listener );
+
+	for ( uint32_t i = 0; i < 2; i++ )
+	{
+		m_total[ i ].Merge( m_interval[ i ] );
+	}
+	Report( NowSeconds() - start, 1.0, m_total, true );
+	return 0;
+}
+
+int main( int argc, char* argv[] )
+{
+	uint16_t listenPort = 7778;
+	const char* hostname = "localhost";
+	uint16_t port = 7777;
+	const char* scriptPath = nullptr;
+	uint32_t seed = 1;
+	double duration = 0.0;
+
+	// Conditions from the command line apply from the start, before any script
+	std::vector< ScriptStep > script;
+
+	for ( int i = 1; i < argc; i++ )
+	{
+		bool hasValue = i + 1 < argc;
+		if ( hasValue && strcmp( "-l", argv[ i ] ) == 0 )
+		{
+			listenPort = atoi( argv[ ++i ] );
+		}
+		else if ( hasValue && strcmp( "-a", argv[ i ] ) == 0 )
+		{
+			hostname = argv[ ++i ];
+		}
+		else if ( hasValue && strcmp( "-p", argv[ i ] ) == 0 )
+		{
+			port = atoi( argv[ ++i ] );
+		}
+		else if ( hasValue && ( strcmp( "-up", argv[ i ] ) == 0 || strcmp( "-down", argv[ i ] ) == 0 || strcmp( "-both", argv[ i ] ) == 0 ) )
+		{
+			ScriptStep step;
+			step.time = 0.0;
+			ParseDirection( argv[ i ] + 1, &step.direction );
+			snprintf( step.conditions, sizeof(step.conditions), "%s", argv[ ++i ] );
+
+			Conditions check;
+			memset( &check, 0, sizeof(check) );
+			if ( !ParseConditions( step.conditions, &check ) )
+			{
+				return -1;
+			}
+			script.push_back( step );
+		}
+		else if ( hasValue && strcmp( "-script", argv[ i ] ) == 0 )
+		{
+			scriptPath = argv[ ++i ];
+		}
+		else if ( hasValue && strcmp( "-seed", argv[ i ] ) == 0 )
+		{
+			seed = strtoul( argv[ ++i ], nullptr, 10 );
+		}
+		else if ( hasValue && strcmp( "-t", argv[ i ] ) == 0 )
+		{
+			duration = atof( argv[ ++i ] );
+		}
+		else
+		{
+			printf( "Unknown or incomplete option %s\n", argv[ i ] );
+			return -1;
+		}
+	}
+
+	if ( scriptPath )
+	{
+		std::vector< ScriptStep > steps;
+		if ( !LoadScript( scriptPath, &steps ) )
+		{
+			return -1;
+		}
+		script.insert( script.end(), steps.begin(), steps.end() );
+	}
+
+	signal( SIGPIPE, SIG_IGN );
+
+	Emulator* emulator = new Emulator( seed );
+	return emulator->Run( listenPort, hostname, port, script, duration );
+}